@@ -34,9 +34,12 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <algorithm>
+#include <new>
 #include <string>
+#include <vector>
 
 #include <Windows.h>
 
@@ -44,9 +47,15 @@
 #include "lua/lualib.h"
 #include "lua/lauxlib.h"
 
+#include "asplite/bytecode_cache.h"
+#include "asplite/bytecode_pack.h"
 #include "asplite/generator.h"
+#include "asplite/html_escape.h"
+#include "asplite/http_date.h"
 #include "asplite/membuf.h"
+#include "asplite/output_cache.h"
 #include "asplite/parser.h"
+#include "asplite/response_writer.h"
 
 #define USE_EMBEDDED_DRIVER
 
@@ -75,9 +84,70 @@ static void *mmap(void *addr,
 #include <sys/mman.h>
 #endif
 
-struct ParserData {
+#ifdef _WIN32
+static const char kPathSeparator = '\\';
+#else
+static const char kPathSeparator = '/';
+#endif
+
+// Includes may nest this deep, which also stops include cycles.
+static const int kMaxIncludeDepth = 16;
+
+typedef std::vector<ArenaString, ArenaAllocator<ArenaString> > ArenaStringList;
+typedef std::vector<size_t, ArenaAllocator<size_t> > SourceLineList;
+typedef std::vector<PageChunk, ArenaAllocator<PageChunk> > PageChunkList;
+typedef std::vector<uint64_t, ArenaAllocator<uint64_t> > FileHashList;
+
+// A source file mapped into memory.
+struct MappedFile {
+  void *content;
+  size_t size;
+};
+
+typedef std::vector<MappedFile, ArenaAllocator<MappedFile> > MappedFileList;
+
+// Generated code together with the map of its lines to the source files.
+struct GeneratedCode {
   struct membuf *buf;
+
+  // Line the next text or the next queued chunk goes to.
+  size_t line;
+
+  // Triples of a generated line, an index into the source files and a line
+  // in that file, recorded wherever the generated code stops following
+  // the source line by line.
+  SourceLineList source_lines;
+};
+
+struct ParserData {
   PageCodeGeneratorCallback handler;
+
+  // Code declaration blocks go to the top level of the chunk, ahead of
+  // the page function with the rest of the page.
+  GeneratedCode declarations;
+  GeneratedCode body;
+  GeneratedCode *code;  // Where the generated code goes now
+
+  // Chunks of the page function, generated together once parsing is over.
+  // They point into |mapped_files|, which stay mapped until then.
+  PageChunkList chunks;
+  MappedFileList mapped_files;
+
+  // The page followed by the files it includes, and HashBytes of each.
+  ArenaStringList files;
+  FileHashList file_hashes;
+  struct BytecodeSource page_source;
+
+  // The map of the whole chunk. Empty if lines of the chunk and the page
+  // match, i.e. the page has neither includes nor declarations.
+  SourceLineList source_lines;
+
+  const ArenaString *document_root;
+  bool minify_content;
+  size_t file_index;  // Index of the file being parsed
+  int include_depth;
+  bool failed;
+  ArenaString error_message;
 };
 
 struct ReaderState {
@@ -85,19 +155,162 @@ struct ReaderState {
   const char *end;
 };
 
-struct FileWriterState {
-  FILE *fp;
-};
-
 static void WriteToBufferCallback(const char *text,
                                   int length,
                                   void *user_data) {
-  struct membuf *buf = ((struct ParserData *)user_data)->buf;
+  struct GeneratedCode *code = ((struct ParserData *)user_data)->code;
+  const char *p = text;
+  const char *end;
 
   if (length < 0)
     length = strlen(text);
 
-  membuf_append(buf, text, length);
+  end = text + length;
+  while ((p = (const char *)memchr(p, '\n', end - p)) != NULL) {
+    code->line++;
+    p++;
+  }
+
+  membuf_append(code->buf, text, length);
+}
+
+// Records that the text generated next comes from |lineno| of the file
+// being parsed, unless the source map already implies it.
+static void MapSourceLine(struct ParserData *data, size_t lineno) {
+  GeneratedCode *code = data->code;
+  SourceLineList &lines = code->source_lines;
+
+  if (!lines.empty()) {
+    size_t count = lines.size();
+    size_t generated_line = lines[count - 3];
+    if (lines[count - 2] == data->file_index &&
+        lines[count - 1] + (code->line - generated_line) == lineno)
+      return;
+  }
+
+  lines.push_back(code->line);
+  lines.push_back(data->file_index);
+  lines.push_back(lineno);
+}
+
+// Queues a chunk of the page function.
+static void QueueChunk(struct ParserData *data,
+                       enum ChunkType chunk_type,
+                       size_t lineno,
+                       const char *text,
+                       size_t length) {
+  PageChunk chunk;
+
+  MapSourceLine(data, lineno);
+
+  chunk.type = chunk_type;
+  chunk.text = text;
+  chunk.length = length;
+  data->chunks.push_back(chunk);
+
+  // The body generator keeps the line count of every chunk.
+  data->body.line += std::count(text, text + length, '\n');
+}
+
+static void FailParsing(struct ParserData *data,
+                        size_t lineno,
+                        const ArenaString &message) {
+  char line[32];
+
+  sprintf(line, ":%lu: ", (unsigned long)lineno);
+  data->error_message = data->files[data->file_index] + line + message;
+  data->failed = true;
+}
+
+static bool ParseSourceFile(struct ParserData *data, const ArenaString &path);
+
+// Inlines the file named by an include directive with |attributes| like
+//    file="header.inc"
+//    virtual="/includes/header.inc"
+// A file path is relative to the including file and a virtual path that
+// starts with a separator is relative to the document root.
+static void IncludeFile(struct ParserData *data,
+                        const char *attributes,
+                        const char *attributes_end,
+                        size_t lineno) {
+  const char *value;
+  const char *value_end;
+  ArenaString path;
+
+  if (GetDirectiveAttribute(
+          attributes, attributes_end, "virtual", &value, &value_end) &&
+      value < value_end && (*value == '/' || *value == '\\')) {
+    if (data->document_root == NULL || data->document_root->empty()) {
+      FailParsing(data, lineno, "virtual include requires a document root");
+      return;
+    }
+
+    while (value < value_end && (*value == '/' || *value == '\\'))
+      value++;
+
+    path = *data->document_root;
+    if (path[path.length() - 1] != '/' && path[path.length() - 1] != '\\')
+      path += kPathSeparator;
+  } else if (GetDirectiveAttribute(
+                 attributes, attributes_end, "file", &value, &value_end) ||
+             GetDirectiveAttribute(
+                 attributes, attributes_end, "virtual", &value, &value_end)) {
+    const ArenaString &including_path = data->files[data->file_index];
+    ArenaString::size_type last_sep = including_path.find_last_of("\\/");
+    if (last_sep != ArenaString::npos)
+      path = including_path.substr(0, last_sep + 1);
+  } else {
+    FailParsing(data, lineno, "include requires a file or virtual attribute");
+    return;
+  }
+
+  path.append(value, value_end - value);
+
+#ifdef _WIN32
+  std::replace(path.begin(), path.end(), '/', '\\');
+#endif
+
+  if (data->include_depth >= kMaxIncludeDepth) {
+    FailParsing(data, lineno, "includes are nested too deeply");
+    return;
+  }
+
+  if (!ParseSourceFile(data, path) && !data->failed) {
+    FailParsing(data,
+                lineno,
+                "cannot open include file " + path + ": " +
+                    data->error_message);
+  }
+}
+
+// Generates content, inlining the include comments it contains.
+static void GenerateContent(struct ParserData *data,
+                            const char *buffer,
+                            size_t lineno,
+                            size_t begin,
+                            size_t end) {
+  const char *p = buffer + begin;
+  const char *content_end = buffer + end;
+
+  while (!data->failed) {
+    const char *attributes;
+    const char *attributes_end;
+    const char *comment_end;
+    const char *comment = FindIncludeComment(
+        p, content_end, &attributes, &attributes_end, &comment_end);
+    const char *chunk_end = comment != NULL ? comment : content_end;
+
+    if (p < chunk_end)
+      QueueChunk(data, Content, lineno, p, chunk_end - p);
+
+    if (comment == NULL)
+      break;
+
+    lineno += std::count(p, comment, '\n');
+    IncludeFile(data, attributes, attributes_end, lineno);
+    lineno += std::count(comment, comment_end, '\n');
+    p = comment_end;
+  }
 }
 
 static void ParserEventHandler(const char *buffer,
@@ -107,8 +320,142 @@ static void ParserEventHandler(const char *buffer,
                                size_t end,
                                void *user_data) {
   struct ParserData *data = (struct ParserData *)user_data;
-  GenerateBodyChunk(
-      data->handler, buffer, chunk_type, lineno, begin, end, user_data);
+
+  if (data->failed)
+    return;
+
+  if (chunk_type == Content) {
+    GenerateContent(data, buffer, lineno, begin, end);
+    return;
+  }
+
+  if (chunk_type == UnterminatedScriptBlock) {
+    FailParsing(data, lineno, "unterminated <script runat=\"server\"> block");
+    return;
+  }
+
+  if (chunk_type == CodeDeclarationBlock) {
+    data->code = &data->declarations;
+    MapSourceLine(data, lineno);
+    GenerateBodyChunk(data->handler, buffer, chunk_type, begin, end, user_data);
+    data->code = &data->body;
+    return;
+  }
+
+  QueueChunk(data, chunk_type, lineno, buffer + begin, end - begin);
+
+  if (chunk_type == DirectiveBlock &&
+      IsDirectiveName(buffer + begin, buffer + end, "Include")) {
+    IncludeFile(data, buffer + begin, buffer + end, lineno);
+  }
+}
+
+// Parses the file at |path| into the generated code.
+// Returns false and an error message in |data| if the file cannot be read
+// or the parsing fails, in which case |data->failed| is set.
+static bool ParseSourceFile(struct ParserData *data, const ArenaString &path) {
+  FILE *fp;
+  struct stat file_stat;
+  const char *content = NULL;
+  const char *content_begin;
+  size_t content_size;
+  size_t parent_index;
+  uint64_t hash;
+
+  fp = fopen(path.c_str(), "rt");
+  if (fp == NULL) {
+    data->error_message = strerror(errno);
+    return false;
+  }
+
+  fstat(_fileno(fp), &file_stat);
+  content_size = file_stat.st_size;
+
+  if (content_size > 0) {
+    content = (const char *)mmap(
+        NULL, content_size, PROT_READ, MAP_PRIVATE, _fileno(fp), 0);
+    if (content == MAP_FAILED) {
+      data->error_message = "mmap failed.";
+      fclose(fp);
+      return false;
+    }
+  }
+
+  // Check for BOM and skip if present
+  content_begin = content;
+  if (content_size >= 3 && strncmp(content_begin, "\xEF\xBB\xBF", 3) == 0) {
+    content_begin += 3;
+    content_size -= 3;
+  }
+
+  hash = HashBytes(content, file_stat.st_size);
+  if (data->files.empty()) {
+    data->page_source.mtime = file_stat.st_mtime;
+    data->page_source.size = file_stat.st_size;
+    data->page_source.hash = hash;
+  }
+
+  parent_index = data->file_index;
+  data->file_index = data->files.size();
+  data->files.push_back(path);
+  data->file_hashes.push_back(hash);
+  data->include_depth++;
+
+  if (content_size > 0)
+    ParseBuffer(content_begin, content_size, ParserEventHandler, data);
+
+  data->include_depth--;
+  data->file_index = parent_index;
+
+  if (content != NULL) {
+    MappedFile mapped_file;
+    mapped_file.content = (void *)content;
+    mapped_file.size = file_stat.st_size;
+    data->mapped_files.push_back(mapped_file);
+  }
+  fclose(fp);
+
+  return !data->failed;
+}
+
+// Rewrites the position a Lua error message starts with, like
+//    [string "page.asp"]:12: message
+// to the file and the line the generated line comes from.
+// Pages whose lines match the chunk need no rewriting.
+static void MapErrorPosition(const struct ParserData &data,
+                             ArenaString *message) {
+  const SourceLineList &lines = data.source_lines;
+  ArenaString::size_type position;
+  const char *line_begin;
+  char *line_end;
+  size_t line;
+  size_t i;
+  char file_line[32];
+
+  if (lines.empty())
+    return;
+
+  position = message->find("\"]:");
+  if (message->compare(0, 9, "[string \"") != 0 ||
+      position == ArenaString::npos)
+    return;
+
+  line_begin = message->c_str() + position + 3;
+  line = strtoul(line_begin, &line_end, 10);
+  if (line_end == line_begin || *line_end != ':')
+    return;
+
+  if (line < lines[0])
+    return;
+
+  i = 0;
+  while (i + 3 < lines.size() && lines[i + 3] <= line)
+    i += 3;
+
+  sprintf(file_line, ":%lu", (unsigned long)(lines[i + 2] + line - lines[i]));
+  message->replace(0,
+                   line_end - message->c_str(),
+                   data.files[lines[i + 1]] + file_line);
 }
 
 static const char *StringStreamReader(lua_State *L, void *ud, size_t *sz) {
@@ -126,12 +473,6 @@ static const char *StringStreamReader(lua_State *L, void *ud, size_t *sz) {
   return r;
 }
 
-static int FileWriter(lua_State *L, const void *p, size_t sz, void *ud) {
-  struct FileWriterState *state = (struct FileWriterState *)ud;
-  fwrite(p, 1, sz, state->fp);
-  return 0;
-}
-
 // Checks if path1 is a prefix path of path2
 static int IsPrefixOf(const char *path1, const char *path2) {
   size_t len1;
@@ -187,150 +528,518 @@ static int RetargetPath(const char *ancestor,
   return 0;
 }
 
-static struct membuf *GenerateLuaFile(const char *asp_path,
-                                      const char *lua_path,
-                                      std::string *error_message) {
-  FILE *fp;
-  struct stat asp_file_stat;
-  const char *asp_content;
-  const char *asp_content_begin_ptr;
-  struct membuf *lua_content;
-  size_t estimated_size;
-  int lua_fd = -1;
-  struct ParserData parser_data;
+// Parses the page at |asp_path| and the files it includes into |data|.
+// Code declaration blocks are generated right away, the chunks of the page
+// function are queued for CodeStreamReader.
+// Returns false and an error message in |data| on failure.
+static bool ParsePage(const ArenaString &asp_path, struct ParserData *data) {
+  size_t declaration_lines;
+
+  data->handler = WriteToBufferCallback;
+  data->declarations.buf = membuf_create_segmented(4096);
+  data->declarations.line = 1;
+  data->body.buf = NULL;
+  data->body.line = 1;
+  data->code = &data->body;
+  data->file_index = 0;
+  data->include_depth = 0;
+  data->failed = false;
+
+  if (!ParseSourceFile(data, asp_path) || data->files.empty())
+    return false;
 
-  if (error_message)
-    error_message->clear();
+  // Declarations end their lines, so the body starts on a line of its own.
+  declaration_lines = data->declarations.line - 1;
+  if (data->files.size() > 1 || declaration_lines > 0) {
+    data->source_lines = data->declarations.source_lines;
+    for (size_t i = 0; i < data->body.source_lines.size(); i += 3) {
+      data->source_lines.push_back(data->body.source_lines[i] +
+                                   declaration_lines);
+      data->source_lines.push_back(data->body.source_lines[i + 1]);
+      data->source_lines.push_back(data->body.source_lines[i + 2]);
+    }
+  }
 
-  fp = fopen(asp_path, "rt");
-  if (fp == NULL) {
-    if (error_message)
-      *error_message = strerror(errno);
-    return NULL;
+  return true;
+}
+
+// Releases what ParsePage holds for code generation.
+static void ClosePage(struct ParserData *data) {
+  for (size_t i = 0; i < data->mapped_files.size(); i++)
+    munmap(data->mapped_files[i].content, data->mapped_files[i].size);
+  data->mapped_files.clear();
+  data->chunks.clear();
+
+  membuf_close(data->declarations.buf);
+  data->declarations.buf = NULL;
+}
+
+// Emits the end of the chunk with the source map, if the page needs one.
+static void GenerateChunkReturn(struct ParserData *data) {
+  std::vector<const char *> files;
+  SourceLineList lines(data->source_lines);
+
+  // The page itself is left out, as pages with the same content share
+  // the bytecode wherever they are.
+  if (!lines.empty()) {
+    files.push_back(NULL);
+    for (size_t i = 1; i < data->files.size(); i++)
+      files.push_back(data->files[i].c_str());
+
+    // Lua indices start from 1.
+    for (size_t i = 1; i < lines.size(); i += 3)
+      lines[i]++;
   }
 
-  fstat(_fileno(fp), &asp_file_stat);
+  GenerateReturn(data->handler,
+                 files.empty() ? NULL : &files[0],
+                 files.size(),
+                 lines.empty() ? NULL : &lines[0],
+                 lines.size(),
+                 data);
+}
 
-  asp_content = (const char *)mmap(
-      NULL, asp_file_stat.st_size, PROT_READ, MAP_PRIVATE, _fileno(fp), 0);
-  if (asp_content == NULL) {
-    if (error_message)
-      *error_message = "mmap failed.";
-    fclose(fp);
-    return NULL;
+// Generated code is handed to lua_load in blocks of about this size.
+static const size_t kCodeBlockSize = 16 * 1024;
+
+enum CodeStreamStage {
+  kStreamDeclarations,
+  kStreamProlog,
+  kStreamBody,
+  kStreamEpilog,
+  kStreamDone
+};
+
+// Generates the code of a parsed page while lua_load reads it, so that
+// the whole code never has to be held in memory.
+struct CodeStream {
+  struct ParserData *data;
+  GeneratedCode block;
+  BodyGenerator body;
+  CodeStreamStage stage;
+  const struct membuf_segment *declarations;  // The next one to read
+  FILE *lua_fp;  // Receives a copy of the code if not NULL
+};
+
+static const char *CodeStreamReader(lua_State *L, void *ud, size_t *size) {
+  struct CodeStream *stream = (struct CodeStream *)ud;
+  struct ParserData *data = stream->data;
+  struct membuf *block = stream->block.buf;
+  const char *code;
+
+  // Declarations are ready, so their segments are read as they are.
+  if (stream->stage == kStreamDeclarations) {
+    const struct membuf_segment *segment = stream->declarations;
+    if (segment != NULL) {
+      stream->declarations = segment->next;
+      code = (const char *)membuf_segment_data(segment);
+      *size = segment->size;
+      goto done;
+    }
+    stream->stage = kStreamProlog;
   }
 
-  // Check for BOM and skip if present
-  asp_content_begin_ptr = asp_content;
-  if (asp_file_stat.st_size >= 3) {
-    if (strncmp(asp_content_begin_ptr, "\xEF\xBB\xBF", 3) == 0)
-      asp_content_begin_ptr += 3;
-  }
-
-  if (lua_path != NULL) {
-    FILE *lua_fp;
-    lua_fp = fopen(lua_path, "wt");
-    if (lua_fp != NULL) {
-      lua_fd = _dup(_fileno(lua_fp));
-      fclose(lua_fp);
+  membuf_clear(block);
+  data->code = &stream->block;
+
+  while (membuf_size(block) < kCodeBlockSize && stream->stage != kStreamDone) {
+    switch (stream->stage) {
+      case kStreamProlog:
+        GenerateProlog(data->handler, data);
+        stream->stage = kStreamBody;
+        break;
+
+      case kStreamBody:
+        if (!GenerateNextBodyPart(&stream->body, data->handler, data))
+          stream->stage = kStreamEpilog;
+        break;
+
+      case kStreamEpilog:
+        GenerateEpilog(data->handler, data);
+        GenerateChunkReturn(data);
+        stream->stage = kStreamDone;
+        break;
+
+      default:
+        break;
     }
   }
 
-  estimated_size = asp_file_stat.st_size * 4;
-  lua_content = membuf_create(estimated_size, lua_fd, 0, 1);
+  data->code = &data->body;
+  code = (const char *)membuf_begin(block);
+  *size = membuf_size(block);
+
+done:
+  if (stream->lua_fp != NULL && *size > 0)
+    fwrite(code, 1, *size, stream->lua_fp);
+  return *size > 0 ? code : NULL;
+}
+
+// Prepares |stream| to generate the code of the page parsed into |data|.
+// Also writes the code to |lua_path| if specified.
+static void OpenCodeStream(struct CodeStream *stream,
+                           struct ParserData *data,
+                           const char *lua_path) {
+  stream->data = data;
+  stream->block.buf = membuf_create(kCodeBlockSize, -1, 0, 1);
+  stream->block.line = 1;
+  stream->stage = kStreamDeclarations;
+  stream->declarations = membuf_first_segment(data->declarations.buf);
+  stream->lua_fp = NULL;
+  if (lua_path != NULL && lua_path[0] != '\0')
+    stream->lua_fp = fopen(lua_path, "wt");
+
+  BeginOptimizedBody(&stream->body,
+                     data->chunks.empty() ? NULL : &data->chunks[0],
+                     data->chunks.size(),
+                     data->minify_content);
+}
+
+static void CloseCodeStream(struct CodeStream *stream) {
+  membuf_close(stream->block.buf);
+  if (stream->lua_fp != NULL)
+    fclose(stream->lua_fp);
+}
+
+// Lists the files the page includes in |deps|, one per line with
+// the HashBytes of the file in 16 hex digits, a space and the path.
+static void GetDependencies(const struct ParserData &data,
+                            ArenaString *deps) {
+  char hash[32];
+
+  deps->clear();
+
+  for (size_t i = 1; i < data.files.size(); i++) {
+    if (std::find(data.files.begin() + 1,
+                  data.files.begin() + i,
+                  data.files[i]) != data.files.begin() + i)
+      continue;
+
+    sprintf(hash, "%016llx ", (unsigned long long)data.file_hashes[i]);
+    *deps += hash;
+    *deps += data.files[i];
+    *deps += '\n';
+  }
+}
+
+// Reads the dependency list written next to the bytecode at |deps_path|.
+// The list is empty if the page includes nothing.
+static void ReadDependencies(const ArenaString &deps_path,
+                             ArenaString *deps) {
+  FILE *fp = fopen(deps_path.c_str(), "rb");
+  char buffer[4096];
+  size_t length;
 
-  parser_data.buf = lua_content;
-  parser_data.handler = WriteToBufferCallback;
+  deps->clear();
+  if (fp == NULL)
+    return;
 
-  GenerateProlog(parser_data.handler, &parser_data);
-  ParseBuffer(asp_content_begin_ptr,
-              asp_file_stat.st_size,
-              ParserEventHandler,
-              &parser_data);
-  GenerateEpilog(parser_data.handler, &parser_data);
+  while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    deps->append(buffer, length);
 
-  munmap(asp_content, asp_file_stat.st_size);
   fclose(fp);
+}
+
+// Writes the dependency list |deps| to |deps_path|, or removes the list
+// if the page includes nothing.
+static void WriteDependencies(const ArenaString &deps_path,
+                              const ArenaString &deps) {
+  FILE *fp;
+
+  if (deps.empty()) {
+    remove(deps_path.c_str());
+    return;
+  }
 
-  return lua_content;
+  fp = fopen(deps_path.c_str(), "wb");
+  if (fp == NULL)
+    return;
+
+  fwrite(deps.data(), 1, deps.length(), fp);
+  fclose(fp);
+}
+
+// Returns the flags of lua_dumpx the bytecode of pages is dumped with.
+static int GetDumpFlags(const struct AspliteCompilerParameters *params) {
+  // Source names are left out, as all functions of the page share
+  // the chunk name. Line information is kept for error positions.
+  int flags = LUA_STRIPSOURCE;
+  if (params->strip_luac)
+    flags |= LUA_STRIPNAMES;
+
+  // Bytecode in the pack stays in memory, so it is loaded in place.
+  if (params->luac_pack != NULL)
+    flags |= LUA_DUMPALIGN;
+  return flags;
+}
+
+// Returns the hash of everything the bytecode of the page parsed into
+// |data| depends on: the versions, the compiler options, the content of
+// the page and of the files it includes, and their paths, which end up in
+// the source map. The path of the page itself does not matter.
+static uint64_t GetContentKey(const struct ParserData &data, int strip) {
+  ArenaString key;
+  char text[64];
+
+  sprintf(text,
+          "%d %u %d %d\n",
+          GENERATOR_VERSION,
+          (unsigned)kBytecodeCacheVersion,
+          strip,
+          data.minify_content ? 1 : 0);
+  key += text;
+
+  for (size_t i = 0; i < data.files.size(); i++) {
+    sprintf(text, "%016llx ", (unsigned long long)data.file_hashes[i]);
+    key += text;
+    if (i > 0)
+      key += data.files[i];
+    key += '\n';
+  }
+
+  return HashBytes(key.data(), key.length());
+}
+
+// Looks up bytecode of |asp_path| that is still current in the pack or
+// the .luac file. Returns NULL if the page needs to be compiled, otherwise
+// the bytecode and its size in |size| and the files it includes in
+// |deps|. The bytecode is kept by |packed| or |luac_content|.
+static const char *FindCachedBytecode(
+    const ArenaString &asp_path,
+    const struct _stat &asp_file_stat,
+    const struct AspliteCompilerParameters *params,
+    const ArenaString &deps_path,
+    BytecodePack::Entry *packed,
+    struct membuf **luac_content,
+    size_t *size,
+    ArenaString *deps) {
+  bool touched;
+
+  if (params->luac_pack != NULL) {
+    if (!params->luac_pack->Find(asp_path, packed) ||
+        !IsBytecodeCurrent(&packed->header,
+                           asp_path.c_str(),
+                           asp_file_stat.st_mtime,
+                           asp_file_stat.st_size,
+                           packed->dependencies,
+                           packed->dependencies_size,
+                           &touched))
+      return NULL;
+
+    if (touched)
+      params->luac_pack->Touch(asp_path, packed->header);
+
+    deps->assign(packed->dependencies, packed->dependencies_size);
+    *size = (size_t)packed->header.bytecode_size;
+    return packed->bytecode;
+  }
+
+  if (params->luac_path.empty())
+    return NULL;
+
+  ReadDependencies(deps_path, deps);
+  *luac_content = ReadBytecodeCache(params->luac_path.c_str(),
+                                    asp_path.c_str(),
+                                    asp_file_stat.st_mtime,
+                                    asp_file_stat.st_size,
+                                    deps->data(),
+                                    deps->length());
+  if (*luac_content == NULL)
+    return NULL;
+
+  *size = membuf_size(*luac_content) - sizeof(BytecodeCacheHeader);
+  return (const char *)membuf_begin(*luac_content) +
+         sizeof(BytecodeCacheHeader);
+}
+
+// Looks up bytecode another page with the same content as the page parsed
+// into |parser_data| has been compiled to. Returns NULL if there is none.
+static const char *FindSharedBytecode(
+    const struct AspliteCompilerParameters *params,
+    const struct ParserData &parser_data,
+    BytecodePack::Entry *packed,
+    size_t *size) {
+  if (params->luac_pack == NULL ||
+      !params->luac_pack->FindContent(parser_data.page_source.content_key,
+                                      packed))
+    return NULL;
+
+  *size = (size_t)packed->header.bytecode_size;
+  return packed->bytecode;
+}
+
+// Caches the bytecode of the page function on top of |L| in the pack or
+// the .luac file, with the files the page includes listed in |deps|.
+static void StoreBytecode(lua_State *L,
+                          const ArenaString &asp_path,
+                          const struct AspliteCompilerParameters *params,
+                          const ArenaString &deps_path,
+                          const struct ParserData &parser_data,
+                          const ArenaString &deps) {
+  struct membuf *bytecode;
+
+  bytecode = DumpBytecode(L, parser_data.page_source, GetDumpFlags(params));
+  if (bytecode == NULL)
+    return;
+
+  if (params->luac_pack != NULL)
+    params->luac_pack->Store(asp_path, bytecode, deps);
+  else if (WriteBytecodeCache(params->luac_path.c_str(), bytecode) == 0)
+    WriteDependencies(deps_path, deps);
+
+  membuf_close(bytecode);
+}
+
+typedef std::shared_ptr<const std::string> BytecodeHolder;
+
+static int bytecode_holder___gc(lua_State *L) {
+  BytecodeHolder *holder = (BytecodeHolder *)lua_touserdata(L, 1);
+  holder->~BytecodeHolder();
+  return 0;
+}
+
+// Keeps |holder| alive as long as |L|, whose functions refer to the code
+// in it when the bytecode is loaded in place.
+static void AnchorBytecode(lua_State *L, const BytecodeHolder &holder) {
+  void *udata = lua_newuserdata(L, sizeof(BytecodeHolder));
+  new (udata) BytecodeHolder(holder);
+  if (luaL_newmetatable(L, "asplite_BytecodeHolder")) {
+    lua_pushcfunction(L, bytecode_holder___gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Records in the pack that |asp_path| shares the bytecode in |packed|.
+static void StoreSharedBytecode(const ArenaString &asp_path,
+                                const struct AspliteCompilerParameters *params,
+                                const struct ParserData &parser_data,
+                                const BytecodePack::Entry &packed,
+                                const ArenaString &deps) {
+  struct BytecodeCacheHeader header;
+
+  InitBytecodeHeader(&header, parser_data.page_source, packed.header.strip);
+  header.bytecode_size = packed.header.bytecode_size;
+  header.checksum = packed.header.checksum;
+
+  params->luac_pack->StoreShared(asp_path, header, deps);
 }
 
 int CompileAspPage(lua_State *L,
-                   const std::string &asp_path,
+                   const ArenaString &asp_path,
                    const struct AspliteCompilerParameters *params,
-                   std::string *error_message) {
+                   ArenaString *error_message) {
   struct _stat asp_file_stat;
-  struct _stat luac_file_stat;
-  struct membuf *lua_content;
+  struct membuf *luac_content = NULL;
+  BytecodePack::Entry packed;
+  const char *bytecode;
+  size_t bytecode_size;
   lua_State *LL;
   int result;
-  struct ReaderState reader_state;
+  struct ParserData parser_data;
+  ArenaString deps_path;
+  ArenaString deps;
+  bool shared = false;
 
   if (error_message != NULL)
     error_message->clear();
 
+  parser_data.document_root = &params->document_root;
+  parser_data.minify_content = params->minify_content;
+
   if (_stat(asp_path.c_str(), &asp_file_stat) != 0) {
     if (error_message)
       *error_message = strerror(errno);
     return errno;
   }
 
-  bool requires_recompilation = true;
+  if (!params->luac_path.empty())
+    deps_path = params->luac_path + ".deps";
 
-  if (!params->luac_path.empty()) {
-    if (_stat(params->luac_path.c_str(), &luac_file_stat) == 0) {
-      if (asp_file_stat.st_mtime < luac_file_stat.st_mtime)
-        requires_recompilation = false;
-    }
-  }
+  bytecode = FindCachedBytecode(asp_path,
+                                asp_file_stat,
+                                params,
+                                deps_path,
+                                &packed,
+                                &luac_content,
+                                &bytecode_size,
+                                &deps);
+  bool requires_recompilation = bytecode == NULL;
 
   if (requires_recompilation) {
-    lua_content = GenerateLuaFile(
-        asp_path.c_str(), params->lua_path.c_str(), error_message);
-    if (lua_content == NULL)
-      return 1;
-  } else {
-    FILE *luac_fp = fopen(params->luac_path.c_str(), "rb");
-    if (luac_fp == NULL) {
+    if (!ParsePage(asp_path, &parser_data)) {
+      ClosePage(&parser_data);
       if (error_message)
-        *error_message = strerror(errno);
+        *error_message = parser_data.error_message;
       return 1;
     }
 
-    lua_content =
-        membuf_create(luac_file_stat.st_size, _dup(_fileno(luac_fp)), 1, 0);
-    fclose(luac_fp);
+    GetDependencies(parser_data, &deps);
+
+    // Pages are parsed anyway to know what they include, but identical
+    // ones are only compiled once.
+    parser_data.page_source.content_key =
+        GetContentKey(parser_data, GetDumpFlags(params));
+    bytecode =
+        FindSharedBytecode(params, parser_data, &packed, &bytecode_size);
+    if (bytecode != NULL) {
+      ClosePage(&parser_data);
+      requires_recompilation = false;
+      shared = true;
+    }
   }
 
-  reader_state.ptr = (char *)membuf_begin(lua_content);
-  reader_state.end = (char *)membuf_end(lua_content);
-
   LL = L ? L : luaL_newstate();
-  result =
-      lua_load(LL, StringStreamReader, &reader_state, asp_path.c_str(), NULL);
+  if (requires_recompilation) {
+    struct CodeStream stream;
+
+    OpenCodeStream(&stream, &parser_data, params->lua_path.c_str());
+    result =
+        lua_load(LL, CodeStreamReader, &stream, asp_path.c_str(), NULL);
+    CloseCodeStream(&stream);
+    ClosePage(&parser_data);
+  } else {
+    struct ReaderState reader_state;
+    const char *mode = NULL;
+
+    // Code in the pack is shared by the states of all requests rather
+    // than copied into each. The pack outlives the states.
+    if (luac_content == NULL && L != NULL) {
+      if (packed.bytecode_holder)
+        AnchorBytecode(LL, packed.bytecode_holder);
+      mode = "bs";
+    }
+
+    reader_state.ptr = bytecode;
+    reader_state.end = bytecode + bytecode_size;
+    result = lua_load(
+        LL, StringStreamReader, &reader_state, asp_path.c_str(), mode);
+    membuf_close(luac_content);
+  }
+
   if (result != LUA_OK) {
-    membuf_close(lua_content);
-    if (error_message)
+    if (error_message) {
       *error_message = lua_tostring(LL, -1);
+      if (requires_recompilation)
+        MapErrorPosition(parser_data, error_message);
+    }
     if (L == NULL)
       lua_close(LL);
     return 1;
   }
 
-  membuf_close(lua_content);
-
-  if (requires_recompilation && !params->luac_path.empty()) {
-    struct FileWriterState writer_state;
+  if (requires_recompilation &&
+      (params->luac_pack != NULL || !params->luac_path.empty()))
+    StoreBytecode(LL, asp_path, params, deps_path, parser_data, deps);
+  else if (shared)
+    StoreSharedBytecode(asp_path, params, parser_data, packed, deps);
 
-    writer_state.fp = fopen(params->luac_path.c_str(), "wb");
-    if (writer_state.fp != NULL) {
-      lua_dump(LL, FileWriter, &writer_state);
-      fclose(writer_state.fp);
-    }
-  }
+  if (params->dependencies != NULL)
+    *params->dependencies = deps;
 
   if (L != NULL) {
-    result = lua_pcall(LL, 0, 0, 0);
+    result = lua_pcall(LL, 0, 2, 0);
     if (result && error_message)
       *error_message = lua_tostring(LL, -1);
   } else {
@@ -346,14 +1055,202 @@ struct AspliteCallbackUserdata {
 };
 
 static int asplite_Write(lua_State *L) {
-  const AspPageContext *context = reinterpret_cast<AspPageContext *>(
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  assert(writer != NULL);
+  size_t length;
+  const char *text = lua_tolstring(L, 1, &length);
+  if (text != NULL)
+    writer->Write(text, length);
+  return 0;
+}
+
+// Starts the response headers from the arguments at |index|:
+// status, reason, content_type, expires, headers. |headers| is an array
+// of {name, value} tables.
+static void BeginResponseHeaders(lua_State *L,
+                                 int index,
+                                 HttpResponseWriter *writer) {
+  // Check all arguments before anything is allocated, because Lua
+  // errors do not unwind the C++ stack.
+  int status = luaL_checkint(L, index);
+  const char *reason = luaL_optstring(L, index + 1, "");
+  size_t content_type_length;
+  const char *content_type =
+      luaL_optlstring(L, index + 2, "", &content_type_length);
+  bool has_expires = !lua_isnoneornil(L, index + 3);
+  time_t expires = has_expires ? (time_t)luaL_checknumber(L, index + 3) : 0;
+
+  writer->BeginHeaders(status,
+                       reason,
+                       content_type,
+                       content_type_length,
+                       has_expires ? &expires : NULL);
+
+  int headers = index + 4;
+  if (lua_istable(L, headers)) {
+    int count = luaL_len(L, headers);
+    for (int i = 1; i <= count; ++i) {
+      lua_rawgeti(L, headers, i);
+      lua_getfield(L, -1, "name");
+      lua_getfield(L, -2, "value");
+
+      size_t name_length, value_length;
+      const char *name = lua_tolstring(L, -2, &name_length);
+      const char *value = lua_tolstring(L, -1, &value_length);
+      if (name != NULL && value != NULL)
+        writer->AddHeader(name, name_length, value, value_length);
+
+      lua_pop(L, 3);
+    }
+  }
+}
+
+// send_func(status, reason, content_type, expires, headers, body, complete)
+// Sends the response headers together with |body|. If |complete| is true,
+// |body| is the whole response body.
+static int asplite_SendResponse(lua_State *L) {
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
       lua_touserdata(L, lua_upvalueindex(1)));
+  assert(writer != NULL);
+
+  size_t body_length;
+  const char *body = luaL_optlstring(L, 6, "", &body_length);
+  bool complete = lua_toboolean(L, 7) != 0;
+
+  BeginResponseHeaders(L, 1, writer);
+  writer->SendHeaders(body, body_length, complete);
+  return 0;
+}
+
+// transmit_func(path, offset, length
+//               [, status, reason, content_type, expires, headers, body])
+// Sends a file. The header arguments are required if the headers have not
+// been sent yet; the file then completes the response.
+static int asplite_TransmitFile(lua_State *L) {
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  assert(writer != NULL);
+
+  const char *path = luaL_checkstring(L, 1);
+  int64_t offset = (int64_t)luaL_optnumber(L, 2, 0);
+  int64_t length = (int64_t)luaL_optnumber(L, 3, -1);
+
+  size_t body_length = 0;
+  const char *body = NULL;
+  if (!writer->headers_sent()) {
+    body = luaL_optlstring(L, 9, "", &body_length);
+    BeginResponseHeaders(L, 4, writer);
+  }
+
+  if (!writer->TransmitFile(path, offset, length, body, body_length))
+    return luaL_error(L, "Cannot open file %s", path);
+  return 0;
+}
+
+static int asplite_FlushResponse(lua_State *L) {
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  assert(writer != NULL);
+  writer->Flush();
+  return 0;
+}
+
+static int asplite_EndResponse(lua_State *L) {
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  assert(writer != NULL);
+  writer->End();
+  return 0;
+}
+
+// cache_func(duration, vary_by_param, vary_by_header)
+// Lets the output cache keep the response of the page for |duration|
+// seconds. A zero duration withdraws it, e.g. when the page fails.
+static int asplite_OutputCache(lua_State *L) {
+  HttpResponseWriter *writer = reinterpret_cast<HttpResponseWriter *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  OutputCachePolicy *policy = reinterpret_cast<OutputCachePolicy *>(
+      lua_touserdata(L, lua_upvalueindex(2)));
+  const AspPageContext *context = reinterpret_cast<AspPageContext *>(
+      lua_touserdata(L, lua_upvalueindex(3)));
+  assert(writer != NULL);
+  assert(policy != NULL);
   assert(context != NULL);
-  assert(context->response != NULL);
-  context->response->Write(lua_tostring(L, 1));
+
+  int duration = luaL_checkint(L, 1);
+  size_t vary_by_param_length, vary_by_header_length;
+  const char *vary_by_param =
+      luaL_optlstring(L, 2, "", &vary_by_param_length);
+  const char *vary_by_header =
+      luaL_optlstring(L, 3, "", &vary_by_header_length);
+
+  policy->duration = duration > 0 ? duration : 0;
+  policy->vary_by_param.assign(vary_by_param, vary_by_param_length);
+  policy->vary_by_header.assign(vary_by_header, vary_by_header_length);
+  writer->set_capture(policy->duration > 0 && context->output_cache != NULL);
   return 0;
 }
 
+// Converts the argument to a string like tostring and escapes HTML special
+// characters. If there is nothing to escape, the string is returned as is.
+static int asplite_HtmlEscapeString(lua_State *L) {
+  size_t length;
+  const char *text = luaL_tolstring(L, 1, &length);
+  size_t pos = FindHtmlSpecialCharacter(text, length);
+  if (pos == length)
+    return 1;
+
+  luaL_Buffer buffer;
+  luaL_buffinit(L, &buffer);
+
+  while (pos < length) {
+    size_t entity_length;
+    const char *entity = GetHtmlEntity(text[pos], &entity_length);
+    luaL_addlstring(&buffer, text, pos);
+    luaL_addlstring(&buffer, entity, entity_length);
+    text += pos + 1;
+    length -= pos + 1;
+    pos = FindHtmlSpecialCharacter(text, length);
+  }
+
+  luaL_addlstring(&buffer, text, length);
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+// Concatenates the arguments converted as by tostring.
+static int asplite_JoinValues(lua_State *L) {
+  int count = lua_gettop(L);
+  luaL_Buffer buffer;
+
+  luaL_buffinit(L, &buffer);
+  for (int i = 1; i <= count; i++) {
+    luaL_tolstring(L, i, NULL);
+    luaL_addvalue(&buffer);
+  }
+
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+// Returns the RFC 1123 date for the time given by os.time(), or for the
+// current time if no argument is given.
+static int asplite_HttpDate(lua_State *L) {
+  char date[kHttpDateLength + 1];
+  if (lua_isnoneornil(L, 1)) {
+    GetCurrentHttpDate(date);
+  } else {
+    time_t t = (time_t)luaL_checknumber(L, 1);
+    if (t == time(NULL))
+      GetCurrentHttpDate(date);
+    else
+      FormatHttpDate(t, date);
+  }
+  lua_pushlstring(L, date, kHttpDateLength);
+  return 1;
+}
+
 static int asplite_Error(lua_State *L) {
   const AspPageContext *context = reinterpret_cast<AspPageContext *>(
       lua_touserdata(L, lua_upvalueindex(1)));
@@ -369,8 +1266,7 @@ static int asplite_MapPath(lua_State *L) {
   assert(context != NULL);
   assert(context->server != NULL);
   const char *uri = lua_tostring(L, 1);
-  lua_pushstring(L,
-                 context->server->MapPath(uri ? uri : std::string()).c_str());
+  lua_pushstring(L, context->server->MapPath(uri ? uri : "").c_str());
   return 1;
 }
 
@@ -383,10 +1279,10 @@ static int asplite_WriteLog(lua_State *L) {
   return 0;
 }
 
-static bool CreateDirectoriesRecursively(const std::string &base_dir,
-                                         const std::string &rel_path) {
-  std::string path(base_dir);
-  std::string rpath(rel_path);
+static bool CreateDirectoriesRecursively(const ArenaString &base_dir,
+                                         const ArenaString &rel_path) {
+  ArenaString path(base_dir);
+  ArenaString rpath(rel_path);
 
   while (true) {
     if (mkdir(path.c_str()) && errno != EEXIST)
@@ -395,8 +1291,8 @@ static bool CreateDirectoriesRecursively(const std::string &base_dir,
     if (rpath.empty())
       break;
 
-    std::string::size_type sep = rpath.find('\\');
-    if (sep != std::string::npos) {
+    ArenaString::size_type sep = rpath.find('\\');
+    if (sep != ArenaString::npos) {
       path += '\\';
       path += rpath.substr(0, sep);
       rpath.erase(0, sep + 1);
@@ -411,10 +1307,12 @@ static bool CreateDirectoriesRecursively(const std::string &base_dir,
 }
 
 void ExeciteAspPage(lua_State *L,
-                    const std::string &asp_path,
+                    const ArenaString &asp_path,
                     const AspPageContext &context) {
   int result;
-  std::string error_message;
+  ArenaString error_message;
+  HttpResponseWriter writer(context.request, context.response);
+  OutputCachePolicy output_cache_policy;
 
   int stack = lua_gettop(L);
   luaL_openlibs(L);
@@ -423,15 +1321,51 @@ void ExeciteAspPage(lua_State *L,
   lua_pushvalue(L, -1);
   lua_setglobal(L, "asplite");
 
+  lua_pushcfunction(L, asplite_HtmlEscapeString);
+  lua_setfield(L, -2, "HtmlEscapeString");
+
+  lua_pushcfunction(L, asplite_JoinValues);
+  lua_setfield(L, -2, "JoinValues");
+
+  lua_pushcfunction(L, asplite_HttpDate);
+  lua_setfield(L, -2, "HttpDate");
+
   // create and populate 'context' table
   lua_pushstring(L, "context");
   lua_newtable(L);
 
   lua_pushstring(L, "write_func");
-  lua_pushlightuserdata(L, (void *)&context);
+  lua_pushlightuserdata(L, &writer);
   lua_pushcclosure(L, asplite_Write, 1);
   lua_settable(L, -3);
 
+  lua_pushstring(L, "send_func");
+  lua_pushlightuserdata(L, &writer);
+  lua_pushcclosure(L, asplite_SendResponse, 1);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "transmit_func");
+  lua_pushlightuserdata(L, &writer);
+  lua_pushcclosure(L, asplite_TransmitFile, 1);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "flush_func");
+  lua_pushlightuserdata(L, &writer);
+  lua_pushcclosure(L, asplite_FlushResponse, 1);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "end_func");
+  lua_pushlightuserdata(L, &writer);
+  lua_pushcclosure(L, asplite_EndResponse, 1);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "cache_func");
+  lua_pushlightuserdata(L, &writer);
+  lua_pushlightuserdata(L, &output_cache_policy);
+  lua_pushlightuserdata(L, (void *)&context);
+  lua_pushcclosure(L, asplite_OutputCache, 3);
+  lua_settable(L, -3);
+
   lua_pushstring(L, "error_func");
   lua_pushlightuserdata(L, (void *)&context);
   lua_pushcclosure(L, asplite_Error, 1);
@@ -447,6 +1381,24 @@ void ExeciteAspPage(lua_State *L,
   lua_pushcclosure(L, asplite_MapPath, 1);
   lua_settable(L, -3);
 
+  if (context.application != NULL) {
+    lua_pushstring(L, "application");
+    CreateSharedCacheTable(L, context.application);
+    lua_settable(L, -3);
+  }
+
+  if (context.cache != NULL) {
+    lua_pushstring(L, "cache");
+    CreateSharedCacheTable(L, context.cache);
+    lua_settable(L, -3);
+  }
+
+  if (context.session_store != NULL) {
+    lua_pushstring(L, "session");
+    CreateSessionStoreTable(L, context.session_store);
+    lua_settable(L, -3);
+  }
+
   // create request table
   lua_pushstring(L, "request");
   lua_newtable(L);
@@ -456,15 +1408,15 @@ void ExeciteAspPage(lua_State *L,
   lua_newtable(L);
 
   lua_pushstring(L, "QUERY_STRING");
-  lua_pushstring(L, context.request->GetQueryStringOld().c_str());
+  lua_pushstring(L, context.request->GetQueryStringOld());
   lua_settable(L, -3);
 
   lua_pushstring(L, "HTTP_METHOD");
-  lua_pushstring(L, context.request->GetRequestMethod().c_str());
+  lua_pushstring(L, context.request->GetRequestMethod());
   lua_settable(L, -3);
 
   lua_pushstring(L, "REQUEST_METHOD");
-  lua_pushstring(L, context.request->GetRequestMethod().c_str());
+  lua_pushstring(L, context.request->GetRequestMethod());
   lua_settable(L, -3);
 
   // set request.ServerVariables field
@@ -497,6 +1449,11 @@ void ExeciteAspPage(lua_State *L,
   CreateHttpFileCollection(L, &context.request->GetFiles());
   lua_settable(L, -3);
 
+  // context.request.Cookies table
+  lua_pushstring(L, "Cookies");
+  CreateHttpCookieCollection(L, &context.request->GetCookies());
+  lua_settable(L, -3);
+
   // set context.request field
   lua_settable(L, -3);
 
@@ -505,17 +1462,24 @@ void ExeciteAspPage(lua_State *L,
 
   lua_pop(L, 1);  // pop asplite table
 
+  ArenaString page_dependencies;
   AspliteCompilerParameters params;
+  params.document_root = context.server->MapPath("");
+  params.minify_content = context.config->minify_content;
+  params.strip_luac = context.config->strip_luac;
+  params.luac_pack = context.config->cache_luac ? context.luac_pack : NULL;
+  params.dependencies = &page_dependencies;
 
   if (!context.config->cache_directory.empty()) {
 
     // Check if doc_root is a prefix of ASP path, then
     // if so, extract asp relative path.
-    std::string document_root = context.server->MapPath(std::string());
+    const ArenaString &document_root = params.document_root;
     if (!document_root.empty() && asp_path.find(document_root) == 0) {
       // Assign cache paths
-      std::string cache_directory(context.config->cache_directory);
-      std::string document_path(asp_path.substr(document_root.length()));
+      ArenaString cache_directory(context.config->cache_directory.data(),
+                                  context.config->cache_directory.length());
+      ArenaString document_path(asp_path.substr(document_root.length()));
 
 #ifdef _WIN32
       // Normalize separators
@@ -531,35 +1495,28 @@ void ExeciteAspPage(lua_State *L,
         document_path.erase(document_path.begin());
 
       // Create relative path to document's directory
-      std::string document_dir(document_path);
-      std::string::size_type last_sep = document_dir.find_last_of('\\');
-      if (last_sep != std::string::npos)
+      ArenaString document_dir(document_path);
+      ArenaString::size_type last_sep = document_dir.find_last_of('\\');
+      if (last_sep != ArenaString::npos)
         document_dir.erase(last_sep);
       else
         document_dir.clear();
 
-      CreateDirectoriesRecursively(cache_directory, document_dir);
+      // The pack is a single file in the cache directory.
+      if (context.config->cache_lua ||
+          (context.config->cache_luac && params.luac_pack == NULL))
+        CreateDirectoriesRecursively(cache_directory, document_dir);
 
       if (context.config->cache_lua) {
         params.lua_path = cache_directory + "\\" + document_path + ".lua";
       }
 
-      if (context.config->cache_luac) {
+      if (context.config->cache_luac && params.luac_pack == NULL) {
         params.luac_path = cache_directory + "\\" + document_path + ".luac";
       }
     }
   }
 
-  result = CompileAspPage(L, asp_path, &params, &error_message);
-  if (result) {
-    lua_pushlightuserdata(L, (void *)&context);
-    lua_pushcclosure(L, asplite_Error, 1);
-    lua_pushstring(L, error_message.c_str());
-    lua_call(L, 1, 0);
-    assert(stack == lua_gettop(L));
-    return;
-  }
-
 #ifdef USE_EMBEDDED_DRIVER
   result = luaL_loadbufferx(
       L, asplite_Driver, sizeof(asplite_Driver), "asplite_Driver", NULL);
@@ -567,7 +1524,19 @@ void ExeciteAspPage(lua_State *L,
   result = luaL_loadfile(L, "asplite.lua");
 #endif  // USE_EMBEDDED_DRIVER
   if (result == LUA_OK) {
-    result = lua_pcall(L, 0, 0, 0);
+    result = CompileAspPage(L, asp_path, &params, &error_message);
+    if (result) {
+      lua_pushlightuserdata(L, (void *)&context);
+      lua_pushcclosure(L, asplite_Error, 1);
+      lua_pushstring(L, error_message.c_str());
+      lua_call(L, 1, 0);
+      lua_settop(L, stack);  // CompileAspPage may leave an error message
+      writer.End();
+      return;
+    }
+
+    // The driver takes the page function and its source map.
+    result = lua_pcall(L, 2, 0, 0);
   }
 
   if (result != LUA_OK) {
@@ -575,10 +1544,21 @@ void ExeciteAspPage(lua_State *L,
     lua_pushcclosure(L, asplite_Error, 1);
     lua_pushvalue(L, -2);
     lua_call(L, 1, 0);
+    lua_pop(L, 1);  // pop error message
+  } else if (output_cache_policy.duration > 0 && writer.captured()) {
+    context.output_cache->Store(asp_path,
+                                context.page_time,
+                                page_dependencies,
+                                context.request,
+                                output_cache_policy,
+                                writer.captured_head(),
+                                writer.captured_body());
   }
 
   assert(stack == lua_gettop(L));
 
+  // Normally the driver has ended the response already.
+  writer.End();
   return;
 }
 
@@ -591,7 +1571,12 @@ static bool StringToBoolean(const std::string &str) {
 
 bool IsAspliteOption(const std::string &option) {
   return option == "cache_lua" || option == "cache_luac" ||
-         option == "cache_directory" || option == "upload_directory";
+         option == "cache_directory" || option == "upload_directory" ||
+         option == "cache_memory_limit" ||
+         option == "output_cache_memory_limit" ||
+         option == "session_timeout" || option == "session_memory_limit" ||
+         option == "minify_content" || option == "strip_luac" ||
+         option == "luac_pack" || option == "trace_memory";
 }
 
 bool SetAspliteOption(AspliteConfig *config,
@@ -605,6 +1590,22 @@ bool SetAspliteOption(AspliteConfig *config,
     config->cache_directory = value;
   else if (option == "upload_directory")
     config->upload_directory = value;
+  else if (option == "cache_memory_limit")
+    config->cache_memory_limit = strtoul(value.c_str(), NULL, 10);
+  else if (option == "output_cache_memory_limit")
+    config->output_cache_memory_limit = strtoul(value.c_str(), NULL, 10);
+  else if (option == "session_timeout")
+    config->session_timeout = atoi(value.c_str());
+  else if (option == "session_memory_limit")
+    config->session_memory_limit = strtoul(value.c_str(), NULL, 10);
+  else if (option == "minify_content")
+    config->minify_content = StringToBoolean(value);
+  else if (option == "strip_luac")
+    config->strip_luac = StringToBoolean(value);
+  else if (option == "luac_pack")
+    config->luac_pack = StringToBoolean(value);
+  else if (option == "trace_memory")
+    config->trace_memory = StringToBoolean(value);
   else
     return false;
 
@@ -23,6 +23,9 @@
 #ifndef ASPLITE_ASPLITE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
 #define ASPLITE_ASPLITE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
 
+#include <stdint.h>
+#include <time.h>
+
 #include <string>
 #include <vector>
 #include <map>
@@ -30,22 +33,32 @@
 #include "lua/lua.hpp"
 
 #include "asplite/posted_file.h"
+#include "asplite/cookie_collection.h"
 #include "asplite/file_collection.h"
 #include "asplite/name_value_collection.h"
+#include "asplite/request_arena.h"
 
 struct HttpHeader {
   HttpHeader(const char *name, const char *value) : name(name), value(value) {}
 
-  std::string name;
-  std::string value;
+  ArenaString name;
+  ArenaString value;
+};
+
+typedef std::vector<HttpHeader, ArenaAllocator<HttpHeader> > HttpHeaderList;
+
+// A piece of output passed to IHttpResponseAdapter::Write in a list.
+struct HttpBuffer {
+  const char *data;
+  size_t length;
 };
 
 class IHttpServerAdapter {
 public:
   virtual ~IHttpServerAdapter() {}
 
-  virtual std::string MapPath(const std::string &uri) = 0;
-  virtual std::string UriToFile(const std::string &uri) = 0;
+  virtual ArenaString MapPath(const char *uri) = 0;
+  virtual ArenaString UriToFile(const char *uri) = 0;
 
   virtual void OnError(const char *text) = 0;
   virtual void WriteLog(const char *text) = 0;
@@ -55,16 +68,18 @@ class IHttpRequestAdapter {
 public:
   virtual ~IHttpRequestAdapter() {}
 
-  virtual std::string GetUri() = 0;
-  virtual std::string GetQueryStringOld() = 0;
-  virtual std::string GetRequestMethod() = 0;
+  virtual const char *GetUri() = 0;
+  virtual const char *GetQueryStringOld() = 0;
+  virtual const char *GetRequestMethod() = 0;
+  virtual const char *GetHttpVersion() = 0;
 
-  virtual const std::vector<HttpHeader> &GetHeaders() const = 0;
-  virtual std::string GetHeader(const char *name) const = 0;
+  virtual const HttpHeaderList &GetHeaders() const = 0;
+  virtual const char *GetHeader(const char *name) const = 0;
 
   virtual NameValueCollection &GetQueryString() = 0;
   virtual NameValueCollection &GetForm() = 0;
   virtual HttpFileCollection &GetFiles() = 0;
+  virtual HttpCookieCollection &GetCookies() = 0;
 
   virtual int Read(void *buffer, size_t buffer_size) = 0;
 };
@@ -76,10 +91,24 @@ public:
   virtual void Write(const char *data, size_t len) = 0;
   virtual void Write(const char *text) = 0;
 
-  virtual void Respond405(const std::string &allow,
-                          const std::string &extra) = 0;
+  // Writes |count| buffers, preferably in a single system call.
+  virtual void Write(const HttpBuffer *buffers, int count) = 0;
+
+  // Called before the response headers are sent. |can_keep_alive| is false
+  // if the end of the response is marked by closing the connection.
+  // Returns true if the connection is kept alive after the response.
+  virtual bool BeginResponse(int status_code, bool can_keep_alive) = 0;
 
-  virtual void Respond415(const std::string &content_type) = 0;
+  // Sends |length| bytes of the file |path| starting at |offset|, letting
+  // the system copy the data where possible. Returns the number of bytes
+  // sent or -1 if the file cannot be opened.
+  virtual int64_t TransmitFile(const char *path,
+                               int64_t offset,
+                               int64_t length) = 0;
+
+  virtual void Respond405(const char *allow, const char *extra) = 0;
+
+  virtual void Respond415(const char *content_type) = 0;
 
   //    virtual void SendError(int code, const char *msg,
   //                           const std::vector<std::string> *headers = NULL,
@@ -92,36 +121,82 @@ public:
   bool cache_luac;
   std::string cache_directory;
   std::string upload_directory;
+  size_t cache_memory_limit;  // Bytes used by the Cache object, 0 for no limit
+  size_t output_cache_memory_limit;  // Bytes of cached pages, 0 for no limit
+  int session_timeout;  // In minutes
+  size_t session_memory_limit;  // Bytes used by sessions, 0 for no limit
+  bool minify_content;  // Default of the Minify attribute of @Page
+  bool strip_luac;  // Leaves names of locals and upvalues out of .luac files
+  bool luac_pack;  // Keeps the bytecode of all pages in one pack file
+  bool trace_memory;  // Reports memory use of each request on stderr
 };
 
+class BytecodePack;
+
 struct AspliteCompilerParameters {
-  std::string lua_path;
-  std::string luac_path;
+  ArenaString lua_path;
+  ArenaString luac_path;
+
+  // Virtual includes are resolved against this directory.
+  ArenaString document_root;
+
+  // Collapses whitespace in static content unless the page says otherwise.
+  bool minify_content;
+
+  // Leaves names of locals and upvalues out of the cached bytecode.
+  bool strip_luac;
+
+  // Caches the bytecode in the pack instead of |luac_path| if not NULL.
+  BytecodePack *luac_pack;
+
+  // Receives the list of files the page includes if not NULL, one per
+  // line with the hash of the file, a space and the path.
+  ArenaString *dependencies;
 };
 
 typedef void (*asplite_WriteCallback)(void *user_data, const char *text);
 
+class OutputCache;
+class SessionStore;
+class SharedCache;
+
 struct AspPageContext {
   AspliteConfig *config;
   IHttpServerAdapter *server;
   IHttpRequestAdapter *request;
   IHttpResponseAdapter *response;
+
+  // Receives the response if the page declares an OutputCache directive.
+  // Can be NULL. |page_time| is the modification time of the page file.
+  OutputCache *output_cache;
+  time_t page_time;
+
+  // Stores behind the Application and Cache objects. Can be NULL.
+  SharedCache *application;
+  SharedCache *cache;
+
+  // Store behind the Session object. Can be NULL.
+  SessionStore *session_store;
+
+  // Pack of the cached bytecode if the luac_pack option is set. Can be NULL.
+  BytecodePack *luac_pack;
 };
 
 // Compiles |asp_file| according to options specified in |config|.
-// If |L| specified, then compiled page is left in the state.
+// If |L| specified, then the page function and its source map, or nil if
+// lines of the page and the generated code match, are left on the stack.
 // This parameter can be null.
 // Returns 0 if compilation suceeded and NULL in |error_message| if specified.
 // Returns a non-zero error code and an error message in |error_message|.
 // If |error_message| is not NULL, then user must free the the returned
 // string with free function.
 int CompileAspPage(lua_State *L,
-                   const std::string &asp_path,
-                   const struct AspEngineConfig *config,
-                   std::string *error_message);
+                   const ArenaString &asp_path,
+                   const struct AspliteCompilerParameters *params,
+                   ArenaString *error_message);
 
 void ExeciteAspPage(lua_State *L,
-                    const std::string &asp_path,
+                    const ArenaString &asp_path,
                     const AspPageContext &context);
 
 bool IsAspliteOption(const std::string &option);
@@ -133,7 +208,10 @@ bool SetAspliteOption(AspliteConfig *asplite,
 int luaopen_asplite(lua_State *L);
 int CreateNameValueCollection(lua_State *L, NameValueCollection *collection);
 int CreateHttpFileCollection(lua_State *L, HttpFileCollection *collection);
+int CreateHttpCookieCollection(lua_State *L, HttpCookieCollection *collection);
 int CreateHttpPostedFileObject(lua_State *L, const HttpPostedFile *posted_file);
+int CreateSharedCacheTable(lua_State *L, SharedCache *cache);
+int CreateSessionStoreTable(lua_State *L, SessionStore *store);
 
 int QueryString___tostring(lua_State *L);
 
@@ -21,13 +21,7 @@
 // CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 --]=]
 
-asplite.HtmlEscapeString = function(text)
-	local HtmlEscapeEntities = {
-			['&'] = '&amp;', ['"'] = '&quot;',
-			['<'] = '&lt;', ['>'] = '&gt;'};
-
-	return string.gsub(text, '[&"<>]', HtmlEscapeEntities);
-end
+-- asplite.HtmlEscapeString is provided natively.
 
 
 asplite.UrlDecode = function(str)
@@ -39,20 +33,8 @@ asplite.UrlDecode = function(str)
 end
 
 
--- RFC 1123 date format
--- t must be a value returned by os.time()
-asplite.HttpDate = function(t)
-	local weekdays = { 'Sun', 'Mon', 'Tue', 'Wed', 'Thu', 'Fri', 'Sat' };
-
-	local months = {
-		"Jan", "Feb",  "Mar", "Apr", "May", "Jun",
-		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-	local dt = os.date('!*t', t);
-	return string.format('%s, %02d %s %04d %02d:%02d:%02d GMT',
-		weekdays[dt.wday], dt.day, months[dt.month], dt.year,
-		dt.hour, dt.min, dt.sec);
-end
+-- asplite.HttpDate(t) is provided natively. It returns the RFC 1123 date
+-- for t, a value returned by os.time(), or for the current time if t is nil.
 
 asplite.ReadEntityBodyMode = {
 	None = 0,
@@ -119,7 +101,7 @@ asplite.CreateRequestObject = function(request)
 	local object = {
 		prototype = {
 			queryString_ = request.QueryString;
-			cookies_ = {};
+			cookies_ = request.Cookies;
 			form_ = request.Form;
 			files_ = request.Files;
 			serverVariables_ = request.ServerVariables;
@@ -270,7 +252,8 @@ asplite.CreateRequestObject = function(request)
 end
 
 
-asplite.CreateResponseObject = function(httpWrite, writeToLog)
+asplite.CreateResponseObject = function(httpWrite, sendResponse,
+		transmitFile, flushResponse, endResponse, writeToLog, outputCache)
 	local object = {
 		prototype = {
 			buffer_ = true;
@@ -281,8 +264,15 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 			headers_ = {};
 			content_ = '';
 			headersSent_ = false;
+			complete_ = false;
 			httpWrite_ = httpWrite;
+			sendResponse_ = sendResponse;
+			transmitFile_ = transmitFile;
+			flushResponse_ = flushResponse;
+			endResponse_ = endResponse;
 			writeToLog_ = writeToLog;
+			outputCache_ = outputCache;
+			onEnd_ = nil;
 
 			HTTP_STATUS_CODES_ = {
 				[100] = 'Continue';
@@ -329,39 +319,73 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 		};
 	};
 
-	function object.prototype:sendHeaders_()
-		local reasonPhrase = self.HTTP_STATUS_CODES_[self.status_];
-		if not reasonPhrase then
-			reasonPhrase = '';
-		end
+	-- The header block is serialized natively and sent together
+	-- with the first part of the body. If complete is true, body is
+	-- the whole response body and it is sent with Content-Length,
+	-- otherwise chunked encoding is used.
+	function object.prototype:sendHeaders_(body, complete)
+		self.sendResponse_(self.status_, self:getReasonPhrase_(),
+			self.contentType_, self.expires_, self.headers_, body, complete);
+		self.headersSent_ = true;
+	end
 
-		self.httpWrite_('HTTP/1.0 ' .. self.status_ .. ' ' .. reasonPhrase .. '\r\n');
+	function object.prototype:getReasonPhrase_()
+		return self.HTTP_STATUS_CODES_[self.status_] or '';
+	end
 
-		if #self.contentType_ then
-			self.httpWrite_('ContentType: ' .. self.contentType_ .. '\r\n');
+	-- Calls the function set by setOnEnd_ once, logging its errors.
+	function object.prototype:runOnEnd_()
+		if self.onEnd_ then
+			local onEnd = self.onEnd_;
+			self.onEnd_ = nil;
+			local res, msg = pcall(onEnd);
+			if not res then
+				self.writeToLog_(msg);
+			end
 		end
+	end
 
-		self.httpWrite_('Date: ' .. asplite.HttpDate(os.time()) .. '\r\n');
-
-		if self.expires_ ~= nil then
-			self.httpWrite_('Expires: ' .. asplite.HttpDate(self.expires_) .. '\r\n');
+	-- Sends buffered content. If final is true, the response is ended.
+	function object.prototype:flushInternal_(final)
+		if final then
+			self:runOnEnd_();
 		end
-			
-		for i, p in ipairs(self.headers_) do
-			self.httpWrite_(p.name .. ': ' .. p.value .. '\r\n');
+		if self.complete_ then
+			if final then
+				self.endResponse_();
+			end
+			return;
 		end
-		self.httpWrite_('\r\n');
-		self.headersSent_ = true;
-	end
-
-	function object.prototype:flushInternal_()
 		if not self.headersSent_ then
-			self:sendHeaders_();
-		end
-		if #self.content_ then
+			self:sendHeaders_(self.content_, final);
+		elseif #self.content_ > 0 then
 			self.httpWrite_(self.content_);
-			self.content_ = '';
 		end
+		self.content_ = '';
+		if final then
+			self.endResponse_();
+		end
+	end
+
+	function object.prototype:renderPage_()
+		self:flushInternal_(true);
+	end
+
+	-- Sets a function that is called once before the response is ended,
+	-- while headers can still be added if the response is buffered.
+	function object.prototype:setOnEnd_(onEnd)
+		self.onEnd_ = onEnd;
+	end
+
+	function object.prototype:isComplete_()
+		return self.complete_;
+	end
+
+	-- Called by the OutputCache directive. The complete response of the
+	-- page is kept for duration seconds. Zero duration disables caching.
+	function object.prototype:setOutputCache_(duration, varyByParam,
+			varyByHeader)
+		self.outputCache_(duration, varyByParam, varyByHeader);
 	end
 
 	function object.prototype:setBuffer_(value)
@@ -455,15 +479,15 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 	end
 	
 	function object.prototype:end_()
-		self:flushInternal_();
+		self:flushInternal_(true);
 		error('__asplite_end_request__', 0);
 	end
 
+	-- Unbuffered output is collected in a small write buffer
+	-- as well, so Flush is allowed in both modes.
 	function object.prototype:flush_()
-		if not self.buffer_ then
-			error("Output is not buffered");
-		end
-		self:flushInternal_();
+		self:flushInternal_(false);
+		self.flushResponse_();
 	end
 
 	function object.prototype:redirect_(url)
@@ -471,7 +495,14 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 			error('Headers already sent');
 		end
 		self.status_ = 302;   -- 302 Found
-		self:clearHeaders_();
+		-- Cookies are kept, a session may have been started by the page.
+		local cookies = {};
+		for _, header in ipairs(self.headers_) do
+			if string.lower(header.name) == 'set-cookie' then
+				table.insert(cookies, header);
+			end
+		end
+		self.headers_ = cookies;
 		self:addHeader_("Location", url);
 		--[=[ 
 			TODO: Unless the request method was HEAD,
@@ -481,14 +512,50 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 			At the moment we have no idea about what method was used.
 		--]=]
 		self:clear_();
-		self:flushInternal_();
+		self:flushInternal_(true);
 	end
 
-	function object.prototype:write_(text)
+	-- Sends the file at path, or length bytes of it starting at offset,
+	-- without reading it into Lua. If the headers have not been sent yet,
+	-- the buffered content and the file complete the response, and a Range
+	-- request for the whole file is honoured. Nothing can be written after
+	-- such a complete response.
+	function object.prototype:writeFile_(path, offset, length)
+		if type(path) ~= 'string' then
+			error('Invalid file name', 2);
+		end
+		if self.complete_ then
+			error('Response already completed by WriteFile', 2);
+		end
+		if self.headersSent_ then
+			self:flushInternal_(false);
+			self.transmitFile_(path, offset, length);
+		else
+			self:runOnEnd_();
+			self.transmitFile_(path, offset, length, self.status_,
+				self:getReasonPhrase_(), self.contentType_, self.expires_,
+				self.headers_, self.content_);
+			self.content_ = '';
+			self.headersSent_ = true;
+			self.complete_ = true;
+		end
+	end
+
+	-- Several arguments are joined as by tostring. Generated page code
+	-- writes consecutive static text and expressions in one call.
+	function object.prototype:write_(text, ...)
+		if select('#', ...) > 0 then
+			text = asplite.JoinValues(text, ...);
+		end
+		if self.complete_ then
+			error('Response already completed by WriteFile', 2);
+		end
 		if self.buffer_ then
 			self.content_ = self.content_ .. text;
+		elseif not self.headersSent_ then
+			self.content_ = self.content_ .. text;
+			self:flushInternal_(false);
 		else
-			self:flushInternal_();
 			self.httpWrite_(text);
 		end
 	end
@@ -521,9 +588,13 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 		['Flush'] = object.prototype.flush_;
 		['Redirect'] = object.prototype.redirect_;
 		['Write'] = object.prototype.write_;
+		['WriteFile'] = object.prototype.writeFile_;
 
 		-- An internal method that finalizes page execution.
-		['RenderPageInternal'] = object.prototype.flushInternal_;
+		['RenderPageInternal'] = object.prototype.renderPage_;
+		['OutputCacheInternal'] = object.prototype.setOutputCache_;
+		['OnEndInternal'] = object.prototype.setOnEnd_;
+		['IsCompleteInternal'] = object.prototype.isComplete_;
 	};
 
 	local function getprop__(t, k)
@@ -564,10 +635,288 @@ asplite.CreateResponseObject = function(httpWrite, writeToLog)
 end
 
 
+-- Wraps a native store that is shared by all requests. Values are
+-- copied in and out, so only strings, numbers, booleans and tables of
+-- these can be stored. Changing a table that was read does not change
+-- the stored value.
+asplite.CreateCacheObject = function(cache)
+	local object = {
+		prototype = {
+			cache_ = cache;
+		};
+	};
+
+	function object.prototype:get_(key)
+		return self.cache_.get(key);
+	end
+
+	-- ttl is the time to live in seconds, the value does not expire
+	-- if it is nil. Setting nil removes the value.
+	function object.prototype:set_(key, value, ttl)
+		self.cache_.set(key, value, ttl);
+	end
+
+	function object.prototype:remove_(key)
+		return self.cache_.remove(key);
+	end
+
+	function object.prototype:clear_()
+		self.cache_.clear();
+	end
+
+	-- Returns the value of key or adds the one returned by factory.
+	-- While factory runs, other requests for the same key wait for it.
+	function object.prototype:getOrAdd_(key, factory, ttl)
+		return self.cache_.get_or_add(key, factory, ttl);
+	end
+
+	function object.prototype:getCount_()
+		return self.cache_.stats().count;
+	end
+
+	function object.prototype:getHits_()
+		return self.cache_.stats().hits;
+	end
+
+	function object.prototype:getMisses_()
+		return self.cache_.stats().misses;
+	end
+
+	function object.prototype:getEvictions_()
+		return self.cache_.stats().evictions;
+	end
+
+	object.propertyMap__ = {
+		['Count'] = {
+			get = object.prototype.getCount_;
+		};
+		['Hits'] = {
+			get = object.prototype.getHits_;
+		};
+		['Misses'] = {
+			get = object.prototype.getMisses_;
+		};
+		['Evictions'] = {
+			get = object.prototype.getEvictions_;
+		};
+		['Clear'] = object.prototype.clear_;
+		['Get'] = object.prototype.get_;
+		['GetOrAdd'] = object.prototype.getOrAdd_;
+		['Remove'] = object.prototype.remove_;
+		['Set'] = object.prototype.set_;
+	};
+
+	local function getprop__(t, k)
+		local entry = rawget(t, 'propertyMap__')[k];
+		if type(entry) == 'function' then
+			return function(...) return entry(t.prototype, ...); end;
+		elseif type(entry) == 'table' then
+			if entry.get then
+				return entry.get(t.prototype);
+			else
+				error('Property is write-only');
+			end
+		else
+			error('Undefined property ' .. k, 2);
+		end
+	end
+
+	local function setprop__(t, k, v)
+		local entry = rawget(t, 'propertyMap__')[k];
+		if type(entry) == 'table' then
+			if entry.set then
+				entry.set(t.prototype, v);
+			else
+				error('Property is read-only');
+			end
+		else
+			error('Undefined property ' .. k);
+		end
+	end
+
+	-- Application('name') reads a value like in classic ASP.
+	local function call__(t, key)
+		return t.prototype:get_(key);
+	end
+
+	local metatable__ = {
+		__index = getprop__;
+		__newindex = setprop__;
+		__call = call__;
+	};
+
+	setmetatable(object, metatable__);
+	return object;
+end
+
+
+asplite.SessionCookieName = 'ASPLITESESSIONID';
+
+-- Session values are read with Session('name') or Session['name'] and
+-- written with Session['name'] = value. The session is loaded on first
+-- access, and written back at the end of the request only if a value has
+-- been assigned. Changing a table stored in the session does not mark it
+-- modified, assign the table again. A session and its cookie are created
+-- when the first value is assigned, so that has to happen before the
+-- headers are sent.
+asplite.CreateSessionObject = function(store, cookies, response)
+	local object = {
+		prototype = {
+			store_ = store;
+			cookies_ = cookies;
+			response_ = response;
+			id_ = nil;
+			data_ = nil;
+			new_ = false;
+			dirty_ = false;
+		};
+	};
+
+	function object.prototype:load_()
+		if self.data_ then
+			return;
+		end
+		local id = self.cookies_.Get(asplite.SessionCookieName);
+		if id then
+			self.data_ = self.store_.load(id);
+		end
+		if self.data_ then
+			self.id_ = id;
+		else
+			self.data_ = {};
+		end
+	end
+
+	function object.prototype:get_(key)
+		self:load_();
+		return self.data_[key];
+	end
+
+	function object.prototype:set_(key, value)
+		self:load_();
+		if not self.id_ then
+			-- Never adopt an unknown id sent by the client.
+			local id = self.store_.new_id();
+			if not pcall(self.response_.AddHeader, 'Set-Cookie',
+					asplite.SessionCookieName .. '=' .. id .. '; path=/; HttpOnly') then
+				error('Cannot create session because headers already sent', 3);
+			end
+			self.id_ = id;
+			self.new_ = true;
+		end
+		self.data_[key] = value;
+		self.dirty_ = true;
+	end
+
+	function object.prototype:getSessionId_()
+		self:load_();
+		return self.id_;
+	end
+
+	function object.prototype:getTimeout_()
+		return self.store_.timeout();
+	end
+
+	function object.prototype:abandon_()
+		self:load_();
+		if self.id_ and not self.new_ then
+			self.store_.abandon(self.id_);
+		end
+		self.id_ = nil;
+		self.data_ = {};
+		self.new_ = false;
+		self.dirty_ = false;
+	end
+
+	-- Writes a modified session back. A session that has not been read
+	-- still has its timeout restarted.
+	function object.prototype:save_()
+		if self.dirty_ then
+			self.store_.save(self.id_, self.data_);
+		elseif not self.data_ then
+			local id = self.cookies_.Get(asplite.SessionCookieName);
+			if id then
+				self.store_.touch(id);
+			end
+		end
+	end
+
+	object.propertyMap__ = {
+		['SessionID'] = {
+			get = object.prototype.getSessionId_;
+		};
+		['Timeout'] = {
+			get = object.prototype.getTimeout_;
+		};
+		['Abandon'] = object.prototype.abandon_;
+
+		-- An internal method that saves the session at the end of request.
+		['SaveInternal'] = object.prototype.save_;
+	};
+
+	-- Names that are not properties are session values.
+	local function getprop__(t, k)
+		local entry = rawget(t, 'propertyMap__')[k];
+		if type(entry) == 'function' then
+			return function(...) return entry(t.prototype, ...); end;
+		elseif type(entry) == 'table' then
+			if entry.get then
+				return entry.get(t.prototype);
+			else
+				error('Property is write-only');
+			end
+		else
+			return t.prototype:get_(k);
+		end
+	end
+
+	local function setprop__(t, k, v)
+		local entry = rawget(t, 'propertyMap__')[k];
+		if type(entry) == 'table' then
+			if entry.set then
+				entry.set(t.prototype, v);
+			else
+				error('Property is read-only');
+			end
+		elseif entry then
+			error('Property is read-only');
+		else
+			t.prototype:set_(k, v);
+		end
+	end
+
+	local function call__(t, key)
+		return t.prototype:get_(key);
+	end
+
+	local metatable__ = {
+		__index = getprop__;
+		__newindex = setprop__;
+		__call = call__;
+	};
+
+	setmetatable(object, metatable__);
+	return object;
+end
+
+
 asplite.InitAspEnvironment = function(context)
 	Server = asplite.CreateServerObject(context.map_path);
 	Request = asplite.CreateRequestObject(context.request);
-	Response = asplite.CreateResponseObject(context.write_func, context.log_func);
+	Response = asplite.CreateResponseObject(context.write_func, context.send_func,
+		context.transmit_func, context.flush_func, context.end_func,
+		context.log_func, context.cache_func);
+	if context.application then
+		Application = asplite.CreateCacheObject(context.application);
+	end
+	if context.cache then
+		Cache = asplite.CreateCacheObject(context.cache);
+	end
+	if context.session then
+		Session = asplite.CreateSessionObject(context.session,
+			context.request.Cookies, Response);
+		Response.OnEndInternal(function() Session.SaveInternal(); end);
+	end
 end
 
 local res, msg = pcall(asplite.InitAspEnvironment, asplite.context);
@@ -582,8 +931,44 @@ end
 --]=]
 
 
+-- The compiled page function and its source map.
+local page, sourceMap = ...;
+
+
+-- Rewrites the position a page error starts with to the file and the line
+-- it comes from. Only pages with includes or declarations carry a source map,
+-- which leaves out the name of the page itself as the bytecode may be shared
+-- by pages at different paths.
+asplite.MapErrorPosition = function(msg)
+	local map = sourceMap;
+	if type(msg) ~= 'string' or map == nil or page == nil then
+		return msg;
+	end
+
+	local prefix = debug.getinfo(page, 'S').short_src .. ':';
+	if msg:sub(1, #prefix) ~= prefix then
+		return msg;
+	end
+
+	local line, rest = msg:match('^(%d+)(:.*)$', #prefix + 1);
+	if line == nil then
+		return msg;
+	end
+
+	line = tonumber(line);
+	local lines = map.lines;
+	local i = 1;
+	while lines[i + 3] ~= nil and lines[i + 3] <= line do
+		i = i + 3;
+	end
+
+	local file = map.files[lines[i + 1]] or debug.getinfo(page, 'S').source;
+	return file .. ':' .. (lines[i + 2] + line - lines[i]) .. rest;
+end
+
+
 asplite.AspErrorHandler = function(msg)
-	return msg;
+	return asplite.MapErrorPosition(msg);
 end
 
 
@@ -591,14 +976,20 @@ asplite.InvokeAspPage = function()
 	if cb then
 		cb();
 	end
-	AspPage__();
+	page(Request, Response, Server, Session, Application, Cache);
 end
 
 
 local res, msg = xpcall(asplite.InvokeAspPage, asplite.AspErrorHandler);
 if not res then
 	if msg ~= '__asplite_end_request__' then
-		Response.Write('ASP page error: ' .. msg);
+		Response.OutputCacheInternal(0);
+		if Response.IsCompleteInternal() then
+			-- WriteFile has sent the whole response already.
+			Response.AppendToLog('ASP page error: ' .. msg);
+		else
+			Response.Write('ASP page error: ' .. msg);
+		end
 	end
 end
 Response.RenderPageInternal();
@@ -0,0 +1,297 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/bytecode_cache.h"
+
+#include <errno.h>
+#include <io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "asplite/membuf.h"
+
+namespace {
+
+const char kSignature[4] = {'\x1b', 'A', 'S', 'P'};
+
+const uint64_t kHashSeed = 0x9e3779b97f4a7c15ULL;
+const uint64_t kHashMultiplier = 0xff51afd7ed558ccdULL;
+
+// Finalizer of MurmurHash3, spreads every bit of |x| over the result.
+inline uint64_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= kHashMultiplier;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+int BufferWriter(lua_State *L, const void *p, size_t sz, void *ud) {
+  return membuf_append((struct membuf *)ud, p, sz);
+}
+
+// Reads the whole file |fp| of |size| bytes.
+struct membuf *ReadFile(FILE *fp, size_t size) {
+  return membuf_create(size, _dup(_fileno(fp)), 1, 0);
+}
+
+// Returns true if the file |path| hashes to |hash|.
+bool HasHash(const char *path, uint64_t hash) {
+  FILE *fp = fopen(path, "rb");
+  struct _stat file_stat;
+  struct membuf *content;
+  bool result;
+
+  if (fp == NULL)
+    return false;
+
+  if (_fstat(_fileno(fp), &file_stat) != 0) {
+    fclose(fp);
+    return false;
+  }
+
+  content = ReadFile(fp, (size_t)file_stat.st_size);
+  fclose(fp);
+
+  result = HashBytes(membuf_begin(content), membuf_size(content)) == hash;
+  membuf_close(content);
+  return result;
+}
+
+// Checks the included files listed in |deps| against |check_time|.
+// Returns false if one of them has changed, and sets |hashed| to true if
+// one had to be hashed to tell.
+bool AreDependenciesCurrent(const char *deps,
+                            size_t deps_size,
+                            int64_t check_time,
+                            bool *hashed) {
+  const char *end = deps + deps_size;
+  char path[4096];
+
+  while (deps < end) {
+    const char *line_end = (const char *)memchr(deps, '\n', end - deps);
+    struct _stat file_stat;
+    size_t length;
+    uint64_t hash;
+    char *hash_end;
+
+    if (line_end == NULL)
+      line_end = end;
+
+    length = line_end - deps;
+    if (length >= sizeof(path))
+      return false;
+
+    memcpy(path, deps, length);
+    path[length] = '\0';
+    deps = line_end + 1;
+
+    hash = strtoull(path, &hash_end, 16);
+    if (*hash_end != ' ')
+      return false;
+
+    if (_stat(hash_end + 1, &file_stat) != 0)
+      return false;
+
+    if ((int64_t)file_stat.st_mtime >= check_time) {
+      if (!HasHash(hash_end + 1, hash))
+        return false;
+      *hashed = true;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace
+
+uint64_t HashBytes(const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t hash = kHashSeed ^ ((uint64_t)size * kHashMultiplier);
+  uint64_t word;
+
+  for (; size >= sizeof(word); p += sizeof(word), size -= sizeof(word)) {
+    memcpy(&word, p, sizeof(word));
+    hash = (hash ^ Mix(word)) * kHashMultiplier;
+  }
+
+  if (size > 0) {
+    word = 0;
+    memcpy(&word, p, size);
+    hash = (hash ^ Mix(word)) * kHashMultiplier;
+  }
+
+  return Mix(hash);
+}
+
+void InitBytecodeHeader(struct BytecodeCacheHeader *header,
+                        const struct BytecodeSource &source,
+                        int strip) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->signature, kSignature, sizeof(kSignature));
+  header->version = kBytecodeCacheVersion;
+  header->lua_version = LUA_VERSION_NUM;
+  header->strip = strip;
+  header->source_mtime = source.mtime;
+  header->source_size = source.size;
+  header->source_hash = source.hash;
+  header->content_key = source.content_key;
+  header->compile_time = time(NULL);
+  header->check_time = header->compile_time;
+}
+
+struct membuf *DumpBytecode(lua_State *L,
+                            const struct BytecodeSource &source,
+                            int strip) {
+  struct BytecodeCacheHeader header;
+  struct BytecodeCacheHeader *dumped;
+  struct membuf *buf;
+
+  // The header is completed once the size of the bytecode is known.
+  InitBytecodeHeader(&header, source, strip);
+  buf = membuf_create(0, -1, 0, 0);
+  if (membuf_append(buf, &header, sizeof(header)) != 0 ||
+      lua_dumpx(L, BufferWriter, buf, strip) != 0) {
+    membuf_close(buf);
+    return NULL;
+  }
+
+  dumped = (struct BytecodeCacheHeader *)membuf_begin(buf);
+  dumped->bytecode_size = membuf_size(buf) - sizeof(header);
+  dumped->checksum = HashBytes(dumped + 1, (size_t)dumped->bytecode_size);
+  return buf;
+}
+
+int WriteBytecodeCache(const char *path, const struct membuf *bytecode) {
+  FILE *fp;
+  int result = 0;
+
+  fp = fopen(path, "wb");
+  if (fp == NULL)
+    return errno;
+
+  if (fwrite(membuf_begin(bytecode), 1, membuf_size(bytecode), fp) !=
+      membuf_size(bytecode))
+    result = errno;
+  fclose(fp);
+  return result;
+}
+
+bool IsBytecodeCurrent(struct BytecodeCacheHeader *header,
+                       const char *source_path,
+                       time_t source_mtime,
+                       uint64_t source_size,
+                       const char *deps,
+                       size_t deps_size,
+                       bool *touched) {
+  bool hashed = false;
+
+  *touched = false;
+
+  if (memcmp(header->signature, kSignature, sizeof(kSignature)) != 0 ||
+      header->version != kBytecodeCacheVersion ||
+      header->lua_version != LUA_VERSION_NUM ||
+      header->source_size != source_size)
+    return false;
+
+  // Modification times are too coarse to tell apart changes made within
+  // the second the sources have been checked.
+  if (header->source_mtime != (int64_t)source_mtime ||
+      header->source_mtime >= header->check_time) {
+    if (!HasHash(source_path, header->source_hash))
+      return false;
+    hashed = true;
+  }
+
+  if (!AreDependenciesCurrent(deps, deps_size, header->check_time, &hashed))
+    return false;
+
+  // The sources have only been touched, so they are not hashed again.
+  if (hashed) {
+    header->source_mtime = source_mtime;
+    header->check_time = time(NULL);
+    *touched = true;
+  }
+
+  return true;
+}
+
+bool VerifyBytecode(const struct BytecodeCacheHeader &header,
+                    const void *bytecode) {
+  return HashBytes(bytecode, (size_t)header.bytecode_size) == header.checksum;
+}
+
+struct membuf *ReadBytecodeCache(const char *path,
+                                 const char *source_path,
+                                 time_t source_mtime,
+                                 uint64_t source_size,
+                                 const char *deps,
+                                 size_t deps_size) {
+  struct _stat file_stat;
+  struct BytecodeCacheHeader header;
+  struct membuf *content;
+  bool touched;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  // Everything but the checksum is verified before the bytecode is read.
+  if (_fstat(_fileno(fp), &file_stat) != 0 ||
+      fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.bytecode_size + sizeof(header) != (uint64_t)file_stat.st_size ||
+      !IsBytecodeCurrent(&header,
+                         source_path,
+                         source_mtime,
+                         source_size,
+                         deps,
+                         deps_size,
+                         &touched)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  if (touched) {
+    FILE *header_fp = fopen(path, "r+b");
+    if (header_fp != NULL) {
+      fwrite(&header, sizeof(header), 1, header_fp);
+      fclose(header_fp);
+    }
+  }
+
+  rewind(fp);
+  content = ReadFile(fp, (size_t)file_stat.st_size);
+  fclose(fp);
+
+  if (!VerifyBytecode(header, (const char *)membuf_begin(content) +
+                                  sizeof(header))) {
+    membuf_close(content);
+    return NULL;
+  }
+
+  return content;
+}
@@ -0,0 +1,118 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_BYTECODE_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_BYTECODE_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lua/lua.hpp"
+
+// Bytecode cached in another format, or compiled from code generated by
+// another version, is compiled again. Bump it when the generated code
+// changes.
+const uint32_t kBytecodeCacheVersion = 3;
+
+// The page source cached bytecode has been compiled from.
+struct BytecodeSource {
+  time_t mtime;
+  uint64_t size;
+  uint64_t hash;  // HashBytes of the content
+
+  // Hash of everything the bytecode depends on: the content of the page
+  // and the files it includes, the include paths, the version and the
+  // compiler options. Pages with the same key share their bytecode.
+  uint64_t content_key;
+};
+
+// Header of a bytecode cache file. |bytecode_size| bytes of lua_dumpx
+// output follow.
+struct BytecodeCacheHeader {
+  char signature[4];
+  uint32_t version;  // kBytecodeCacheVersion
+  uint32_t lua_version;  // LUA_VERSION_NUM
+  uint32_t strip;  // LUA_STRIP* flags the bytecode has been dumped with
+  int64_t source_mtime;
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint64_t content_key;
+  int64_t compile_time;
+  int64_t check_time;  // When the sources were last found unchanged
+  uint64_t bytecode_size;
+  uint64_t checksum;  // HashBytes of the bytecode
+};
+
+// Returns a 64-bit hash of |size| bytes at |data|. The hash is fast rather
+// than cryptographically strong and depends on the byte order.
+uint64_t HashBytes(const void *data, size_t size);
+
+// Fills |header| for bytecode compiled from |source| with |strip|,
+// except for the size and the checksum of the bytecode.
+void InitBytecodeHeader(struct BytecodeCacheHeader *header,
+                        const struct BytecodeSource &source,
+                        int strip);
+
+// Dumps the function on top of |L| into a buffer that starts with
+// the header. |strip| tells which debug information to leave out.
+// Returns NULL if the function cannot be dumped.
+struct membuf *DumpBytecode(lua_State *L,
+                            const struct BytecodeSource &source,
+                            int strip);
+
+// Writes |bytecode| made by DumpBytecode to |path|.
+// Returns 0 on success or an errno value.
+int WriteBytecodeCache(const char *path, const struct membuf *bytecode);
+
+// Returns true if |header| belongs to bytecode compiled by this version
+// from the current content of |source_path|, whose modification time and
+// size are |source_mtime| and |source_size|, and of the files it includes.
+// The included files are listed in |deps| one per line, as the hash of the
+// file in 16 hexadecimal digits, a space and the path.
+// Files modified since they were last checked, or within that second,
+// are hashed. If their content is the same, the modification and check
+// times in |header| are updated and |touched| set to true.
+bool IsBytecodeCurrent(struct BytecodeCacheHeader *header,
+                       const char *source_path,
+                       time_t source_mtime,
+                       uint64_t source_size,
+                       const char *deps,
+                       size_t deps_size,
+                       bool *touched);
+
+// Returns true if |bytecode| matches the checksum in |header|.
+bool VerifyBytecode(const struct BytecodeCacheHeader &header,
+                    const void *bytecode);
+
+// Reads the bytecode cached at |path| if IsBytecodeCurrent, updating the
+// header of touched sources. Returns NULL if the cache is missing, stale,
+// foreign or corrupt, otherwise a buffer with the whole file, which the
+// caller closes. The bytecode follows the header.
+struct membuf *ReadBytecodeCache(const char *path,
+                                 const char *source_path,
+                                 time_t source_mtime,
+                                 uint64_t source_size,
+                                 const char *deps,
+                                 size_t deps_size);
+
+#endif  // ASPLITE_BYTECODE_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
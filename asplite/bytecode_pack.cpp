@@ -0,0 +1,465 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/bytecode_pack.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "asplite/membuf.h"
+
+namespace {
+
+const char kPackSignature[8] = {'\x1b', 'A', 'S', 'P', 'P', 'A', 'C', 'K'};
+const uint32_t kPackVersion = 3;
+
+}  // namespace
+
+BytecodePack::BytecodePack()
+    : mapping_(NULL), mapping_size_(0), fp_(NULL), generation_(0) {}
+
+BytecodePack::~BytecodePack() {
+  Close();
+}
+
+bool BytecodePack::Open(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  CloseLocked();
+  path_ = path;
+
+  // A missing or foreign file is replaced by an empty pack.
+  if (!MapFile() || !IndexMapping()) {
+    if (!Compact()) {
+      CloseLocked();
+      return false;
+    }
+  }
+
+  fp_ = fopen(path_.c_str(), "ab");
+  return fp_ != NULL;
+}
+
+void BytecodePack::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CloseLocked();
+}
+
+void BytecodePack::CloseLocked() {
+  if (fp_ != NULL) {
+    fclose(fp_);
+    fp_ = NULL;
+  }
+
+  index_.clear();
+  content_index_.clear();
+  UnmapFile();
+}
+
+bool BytecodePack::Find(const ArenaString &asp_path, Entry *entry) {
+  std::string path(asp_path.data(), asp_path.length());
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Index::const_iterator it = index_.find(path);
+  if (it == index_.end())
+    return false;
+
+  FillEntry(it->second, entry);
+  return true;
+}
+
+bool BytecodePack::FindContent(uint64_t content_key, Entry *entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  ContentIndex::const_iterator it = content_index_.find(content_key);
+  if (it == content_index_.end())
+    return false;
+
+  IndexEntry index_entry;
+  index_entry.record = it->second;
+  index_entry.bytecode = it->second;
+  index_entry.source_mtime = it->second.record->bytecode.source_mtime;
+  index_entry.check_time = it->second.record->bytecode.check_time;
+  FillEntry(index_entry, entry);
+  return true;
+}
+
+void BytecodePack::FillEntry(const IndexEntry &index_entry, Entry *entry) {
+  const Record *record = index_entry.record.record;
+
+  entry->header = record->bytecode;
+  entry->header.source_mtime = index_entry.source_mtime;
+  entry->header.check_time = index_entry.check_time;
+  entry->dependencies = (const char *)(record + 1) + record->path_size;
+  entry->dependencies_size = record->dependencies_size;
+  entry->bytecode = GetBytecode(index_entry.bytecode.record);
+  entry->holder = index_entry.record.holder;
+  entry->bytecode_holder = index_entry.bytecode.holder;
+}
+
+void BytecodePack::Touch(const ArenaString &asp_path,
+                         const BytecodeCacheHeader &header) {
+  std::string path(asp_path.data(), asp_path.length());
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Index::iterator it = index_.find(path);
+  if (it != index_.end()) {
+    it->second.source_mtime = header.source_mtime;
+    it->second.check_time = header.check_time;
+  }
+}
+
+bool BytecodePack::Store(const ArenaString &asp_path,
+                         const struct membuf *bytecode,
+                         const ArenaString &dependencies) {
+  const BytecodeCacheHeader *header =
+      (const BytecodeCacheHeader *)membuf_begin(bytecode);
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Another page with the same content may have been compiled meanwhile.
+  if (content_index_.count(header->content_key) != 0)
+    return AppendLocked(asp_path, *header, NULL, dependencies);
+
+  return AppendLocked(
+      asp_path, *header, (const char *)(header + 1), dependencies);
+}
+
+bool BytecodePack::StoreShared(const ArenaString &asp_path,
+                               const BytecodeCacheHeader &header,
+                               const ArenaString &dependencies) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (content_index_.count(header.content_key) == 0)
+    return false;
+
+  return AppendLocked(asp_path, header, NULL, dependencies);
+}
+
+bool BytecodePack::AppendLocked(const ArenaString &asp_path,
+                                const BytecodeCacheHeader &header,
+                                const char *bytecode,
+                                const ArenaString &dependencies) {
+  std::shared_ptr<std::string> data(new std::string);
+
+  MakeRecord(header,
+             asp_path.data(),
+             asp_path.length(),
+             dependencies.data(),
+             dependencies.length(),
+             bytecode,
+             data.get());
+
+  if (fp_ == NULL ||
+      fwrite(data->data(), 1, data->size(), fp_) != data->size() ||
+      fflush(fp_) != 0)
+    return false;
+
+  IndexEntry &entry =
+      index_[std::string(asp_path.data(), asp_path.length())];
+  entry.record.record = (const Record *)data->data();
+  entry.record.holder = data;
+  if (bytecode != NULL) {
+    entry.bytecode = entry.record;
+    if (header.content_key != 0)
+      content_index_.insert(std::make_pair(header.content_key, entry.record));
+  } else {
+    entry.bytecode = content_index_[header.content_key];
+  }
+  entry.source_mtime = header.source_mtime;
+  entry.check_time = header.check_time;
+  return true;
+}
+
+void BytecodePack::MakeRecord(const BytecodeCacheHeader &header,
+                              const char *path,
+                              size_t path_size,
+                              const char *dependencies,
+                              size_t dependencies_size,
+                              const char *bytecode,
+                              std::string *data) {
+  Record record;
+  size_t size;
+
+  memset(&record, 0, sizeof(record));
+  record.path_size = (uint32_t)path_size;
+  record.dependencies_size = (uint32_t)dependencies_size;
+  record.flags = bytecode == NULL ? kSharedBytecode : 0;
+  record.bytecode = header;
+
+  size = GetRecordSize(&record);
+  data->reserve(size);
+  data->append((const char *)&record, sizeof(record));
+  data->append(path, path_size);
+  data->append(dependencies, dependencies_size);
+  if (bytecode != NULL) {
+    data->resize(GetBytecodeOffset(&record), '\0');
+    data->append(bytecode, (size_t)header.bytecode_size);
+  }
+  data->resize(size, '\0');
+}
+
+size_t BytecodePack::AlignSize(size_t size) {
+  return (size + kRecordAlignment - 1) & ~(kRecordAlignment - 1);
+}
+
+size_t BytecodePack::GetRecordSize(const Record *record) {
+  size_t size = GetBytecodeOffset(record);
+  if ((record->flags & kSharedBytecode) == 0)
+    size += (size_t)record->bytecode.bytecode_size;
+  return AlignSize(size);
+}
+
+size_t BytecodePack::GetBytecodeOffset(const Record *record) {
+  return AlignSize(sizeof(Record) + record->path_size +
+                   record->dependencies_size);
+}
+
+const char *BytecodePack::GetBytecode(const Record *record) {
+  return (const char *)record + GetBytecodeOffset(record);
+}
+
+bool BytecodePack::IndexMapping() {
+  const char *p = mapping_ + sizeof(FileHeader);
+  const char *end = mapping_ + mapping_size_;
+  size_t dead_size = 0;
+
+  index_.clear();
+  content_index_.clear();
+
+  while (p < end) {
+    const Record *record = (const Record *)p;
+    size_t available = (size_t)(end - p);
+    RecordRef bytecode;
+    size_t size;
+
+    // The last record may have been written partially. Each part is
+    // checked against what is left, so that the record size cannot wrap
+    // around on a corrupt record.
+    if (available < sizeof(Record))
+      return false;
+    available -= sizeof(Record);
+    if (record->path_size > available)
+      return false;
+    available -= record->path_size;
+    if (record->dependencies_size > available)
+      return false;
+    available -= record->dependencies_size;
+    if ((record->flags & kSharedBytecode) == 0 &&
+        record->bytecode.bytecode_size > (uint64_t)available)
+      return false;
+
+    size = GetRecordSize(record);
+    if (size > (size_t)(end - p))
+      return false;
+
+    p += size;
+    if ((record->flags & kSharedBytecode) != 0) {
+      ContentIndex::const_iterator it =
+          content_index_.find(record->bytecode.content_key);
+      if (it == content_index_.end()) {
+        dead_size += size;
+        continue;
+      }
+      bytecode = it->second;
+    } else {
+      if (!VerifyBytecode(record->bytecode, GetBytecode(record)))
+        return false;
+      bytecode.record = record;
+      if (record->bytecode.content_key != 0)
+        content_index_.insert(
+            std::make_pair(record->bytecode.content_key, bytecode));
+    }
+
+    const char *path = (const char *)(record + 1);
+    IndexEntry &entry = index_[std::string(path, record->path_size)];
+    if (entry.record.record != NULL)
+      dead_size += GetRecordSize(entry.record.record);
+    entry.record.record = record;
+    entry.bytecode = bytecode;
+    entry.source_mtime = record->bytecode.source_mtime;
+    entry.check_time = record->bytecode.check_time;
+  }
+
+  return dead_size <= mapping_size_ / 2;
+}
+
+bool BytecodePack::MapFile() {
+  const FileHeader *header;
+  size_t size;
+
+#ifdef _WIN32
+  HANDLE file = ::CreateFileA(path_.c_str(),
+                              GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+  LARGE_INTEGER file_size;
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  if (!GetFileSizeEx(file, &file_size) ||
+      (size_t)file_size.QuadPart < sizeof(FileHeader)) {
+    CloseHandle(file);
+    return false;
+  }
+
+  size = (size_t)file_size.QuadPart;
+  HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (mapping == NULL)
+    return false;
+
+  mapping_ = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+  CloseHandle(mapping);
+  if (mapping_ == NULL)
+    return false;
+#else
+  struct stat file_stat;
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  if (fstat(fd, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(FileHeader)) {
+    close(fd);
+    return false;
+  }
+
+  size = (size_t)file_stat.st_size;
+  void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  mapping_ = (const char *)p;
+#endif
+
+  mapping_size_ = size;
+
+  header = (const FileHeader *)mapping_;
+  if (memcmp(header->signature, kPackSignature, sizeof(kPackSignature)) !=
+          0 ||
+      header->version != kPackVersion ||
+      header->record_size != sizeof(Record)) {
+    UnmapFile();
+    return false;
+  }
+
+  generation_ = header->generation;
+  return true;
+}
+
+void BytecodePack::UnmapFile() {
+  if (mapping_ == NULL)
+    return;
+
+#ifdef _WIN32
+  UnmapViewOfFile(mapping_);
+#else
+  munmap((void *)mapping_, mapping_size_);
+#endif
+
+  mapping_ = NULL;
+  mapping_size_ = 0;
+}
+
+bool BytecodePack::Compact() {
+  std::string temp_path(path_ + ".tmp");
+  std::unordered_set<uint64_t> written;
+  std::string data;
+  FileHeader header;
+  FILE *fp;
+  bool result = true;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, kPackSignature, sizeof(kPackSignature));
+  header.version = kPackVersion;
+  header.record_size = sizeof(Record);
+  header.generation = generation_ + 1;
+
+  fp = fopen(temp_path.c_str(), "wb");
+  if (fp == NULL)
+    return false;
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1)
+    result = false;
+
+  // The bytecode goes with the first record of each content key, the other
+  // records share it.
+  for (Index::const_iterator it = index_.begin();
+       result && it != index_.end();
+       ++it) {
+    const Record *record = it->second.record.record;
+    const char *bytecode = GetBytecode(it->second.bytecode.record);
+    BytecodeCacheHeader record_header = record->bytecode;
+
+    if (record_header.content_key != 0 &&
+        !written.insert(record_header.content_key).second)
+      bytecode = NULL;
+
+    record_header.source_mtime = it->second.source_mtime;
+    record_header.check_time = it->second.check_time;
+    record_header.bytecode_size =
+        it->second.bytecode.record->bytecode.bytecode_size;
+    record_header.checksum = it->second.bytecode.record->bytecode.checksum;
+
+    data.clear();
+    MakeRecord(record_header,
+               (const char *)(record + 1),
+               record->path_size,
+               (const char *)(record + 1) + record->path_size,
+               record->dependencies_size,
+               bytecode,
+               &data);
+    if (fwrite(data.data(), 1, data.size(), fp) != data.size())
+      result = false;
+  }
+
+  if (fclose(fp) != 0)
+    result = false;
+
+  // The old generation can only be replaced once it is unmapped.
+  index_.clear();
+  content_index_.clear();
+  UnmapFile();
+
+  if (!result) {
+    remove(temp_path.c_str());
+    return false;
+  }
+
+  remove(path_.c_str());
+  if (rename(temp_path.c_str(), path_.c_str()) != 0)
+    return false;
+
+  return MapFile() && IndexMapping();
+}
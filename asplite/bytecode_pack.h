@@ -0,0 +1,186 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_BYTECODE_PACK_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_BYTECODE_PACK_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "asplite/asplite.h"
+#include "asplite/bytecode_cache.h"
+
+struct membuf;
+
+// Keeps the bytecode of all pages in a single append-only pack file
+// instead of a .luac file per page. The file is mapped once when the pack
+// is opened and indexed by page path, so a cached page is found with
+// a lookup into the mapping. Pages compiled afterwards are appended to the
+// file and served from memory until the pack is opened again.
+// Pages whose bytecode has the same content key share it: the bytecode is
+// stored once, and the other pages get records that refer to it.
+// The bytecode is aligned in the file, so that Lua states can load it in
+// place while the pack is open.
+// Records superseded by newer ones are dropped when the pack is opened,
+// if they take more than half of the file, by writing the live records to
+// the next generation of the file.
+class BytecodePack {
+public:
+  // A page found in the pack. The pointers stay valid while the entry
+  // exists, until the pack is closed.
+  struct Entry {
+    BytecodeCacheHeader header;
+    const char *bytecode;
+    const char *dependencies;  // Included files with their hashes
+    size_t dependencies_size;
+    std::shared_ptr<const std::string> holder;
+    std::shared_ptr<const std::string> bytecode_holder;  // NULL if mapped
+  };
+
+  BytecodePack();
+  ~BytecodePack();
+
+  // Maps the pack file |path|, creating it if it does not exist.
+  bool Open(const std::string &path);
+
+  void Close();
+
+  // Returns the bytecode last stored for |asp_path|.
+  bool Find(const ArenaString &asp_path, Entry *entry);
+
+  // Returns the bytecode stored for any page with |content_key|.
+  bool FindContent(uint64_t content_key, Entry *entry);
+
+  // Records that the page source has been touched without being changed,
+  // so that it is not hashed again. |header| is the one IsBytecodeCurrent
+  // has updated.
+  void Touch(const ArenaString &asp_path, const BytecodeCacheHeader &header);
+
+  // Appends |bytecode| made by DumpBytecode for |asp_path| that includes
+  // |dependencies|. The bytecode is not stored again if a page with the
+  // same content key has it already.
+  bool Store(const ArenaString &asp_path,
+             const struct membuf *bytecode,
+             const ArenaString &dependencies);
+
+  // Appends a record for |asp_path| that shares the bytecode found by
+  // FindContent for the content key in |header|.
+  bool StoreShared(const ArenaString &asp_path,
+                   const BytecodeCacheHeader &header,
+                   const ArenaString &dependencies);
+
+  uint64_t generation() const { return generation_; }
+
+private:
+  // Record of a page in the file, followed by the page path, the
+  // dependencies and the bytecode, which starts and ends padded to
+  // kRecordAlignment.
+  // Records with kSharedBytecode leave out the bytecode, which is in
+  // an earlier record with the same content key.
+  struct Record {
+    uint32_t path_size;
+    uint32_t dependencies_size;
+    uint32_t flags;
+    uint32_t reserved;
+    BytecodeCacheHeader bytecode;
+  };
+
+  struct FileHeader {
+    char signature[8];
+    uint32_t version;
+    uint32_t record_size;  // sizeof(Record)
+    uint64_t generation;
+  };
+
+  struct RecordRef {
+    const Record *record;
+    std::shared_ptr<const std::string> holder;  // NULL if in the mapping
+  };
+
+  struct IndexEntry {
+    RecordRef record;
+    RecordRef bytecode;  // The record with the bytecode
+    int64_t source_mtime;
+    int64_t check_time;
+  };
+
+  typedef std::unordered_map<std::string, IndexEntry> Index;
+  typedef std::unordered_map<uint64_t, RecordRef> ContentIndex;
+
+  static const uint32_t kSharedBytecode = 1;
+  static const size_t kRecordAlignment = 8;
+
+  BytecodePack(const BytecodePack &);
+  BytecodePack &operator=(const BytecodePack &);
+
+  static size_t AlignSize(size_t size);
+  static size_t GetRecordSize(const Record *record);
+  static size_t GetBytecodeOffset(const Record *record);
+  static const char *GetBytecode(const Record *record);
+
+  // Makes the record of |path| in |data|. |bytecode| is NULL if the
+  // record shares the bytecode of another one.
+  static void MakeRecord(const BytecodeCacheHeader &header,
+                         const char *path,
+                         size_t path_size,
+                         const char *dependencies,
+                         size_t dependencies_size,
+                         const char *bytecode,
+                         std::string *data);
+
+  bool AppendLocked(const ArenaString &asp_path,
+                    const BytecodeCacheHeader &header,
+                    const char *bytecode,
+                    const ArenaString &dependencies);
+
+  static void FillEntry(const IndexEntry &index_entry, Entry *entry);
+
+  // Indexes the records of the mapping. Returns false if the file has
+  // a broken tail or records worth compacting.
+  bool IndexMapping();
+
+  bool MapFile();
+  void UnmapFile();
+
+  // Writes the indexed records to the next generation of the file.
+  bool Compact();
+
+  void CloseLocked();
+
+  std::mutex mutex_;
+  std::string path_;
+  const char *mapping_;
+  size_t mapping_size_;
+  FILE *fp_;
+  uint64_t generation_;
+  Index index_;
+  ContentIndex content_index_;  // Records with bytecode by content key
+};
+
+#endif  // ASPLITE_BYTECODE_PACK_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
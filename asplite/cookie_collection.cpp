@@ -0,0 +1,148 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/cookie_collection.h"
+
+#include <string.h>
+
+#include "asplite/name_value_collection.h"
+
+namespace {
+
+inline bool IsCookieSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+}  // namespace
+
+void HttpCookieCollection::EnsureParsed() const {
+  if (parsed_)
+    return;
+
+  parsed_ = true;
+
+  if (header_ == NULL)
+    return;
+
+  // Cookie: name1=value1; name2=value2
+  // Single pass over the header, each pair is recorded as a pair of ranges.
+  const char *p = header_;
+  while (*p != '\0') {
+    while (IsCookieSpace(*p) || *p == ';')
+      p++;
+
+    if (*p == '\0')
+      break;
+
+    Entry entry;
+    entry.name = p;
+    entry.value = NULL;
+    entry.value_length = 0;
+
+    while (*p != '\0' && *p != '=' && *p != ';')
+      p++;
+
+    const char *name_end = p;
+    while (name_end > entry.name && IsCookieSpace(name_end[-1]))
+      name_end--;
+    entry.name_length = name_end - entry.name;
+
+    if (*p == '=') {
+      p++;
+      while (IsCookieSpace(*p))
+        p++;
+
+      entry.value = p;
+      while (*p != '\0' && *p != ';')
+        p++;
+
+      const char *value_end = p;
+      while (value_end > entry.value && IsCookieSpace(value_end[-1]))
+        value_end--;
+
+      // Strip optional DQUOTEs (RFC 6265, 4.1.1)
+      if (value_end - entry.value >= 2 && *entry.value == '"' &&
+          value_end[-1] == '"') {
+        entry.value++;
+        value_end--;
+      }
+
+      entry.value_length = value_end - entry.value;
+    }
+
+    if (entry.name_length > 0)
+      entries_.push_back(entry);
+  }
+}
+
+size_t HttpCookieCollection::GetCount() const {
+  EnsureParsed();
+  return entries_.size();
+}
+
+HttpCookieCollection::key_list_type HttpCookieCollection::AllKeys() const {
+  EnsureParsed();
+
+  key_list_type keys;
+  keys.reserve(entries_.size());
+  for (auto iter = entries_.begin(); iter != entries_.end(); ++iter)
+    keys.push_back(key_type(iter->name, iter->name_length));
+  return keys;
+}
+
+bool HttpCookieCollection::Get(size_t index, value_type *value) const {
+  EnsureParsed();
+
+  if (index >= entries_.size())
+    return false;
+
+  const Entry &entry = entries_[index];
+  value->clear();
+  UrlDecode(entry.value, entry.value_length, false, value);
+  return true;
+}
+
+bool HttpCookieCollection::Get(const char *name,
+                               size_t name_length,
+                               value_type *value) const {
+  EnsureParsed();
+
+  // Browsers send more specific cookies first, so the first match wins.
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const Entry &entry = entries_[i];
+    if (entry.name_length == name_length &&
+        memcmp(entry.name, name, name_length) == 0)
+      return Get(i, value);
+  }
+
+  return false;
+}
+
+bool HttpCookieCollection::GetKey(size_t index, key_type *key) const {
+  EnsureParsed();
+
+  if (index >= entries_.size())
+    return false;
+
+  key->assign(entries_[index].name, entries_[index].name_length);
+  return true;
+}
@@ -0,0 +1,70 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_COOKIE_COLLECTION_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_COOKIE_COLLECTION_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <string>
+#include <vector>
+
+#include "asplite/request_arena.h"
+
+// Read-only collection of request cookies.
+// The collection keeps a pointer to the Cookie header value, which must
+// outlive the collection. The header is parsed on the first access and
+// entries refer directly to the header buffer. Values are URL-decoded
+// only when read.
+class HttpCookieCollection {
+public:
+  typedef ArenaString key_type;
+  typedef ArenaString value_type;
+  typedef std::vector<key_type, ArenaAllocator<key_type> > key_list_type;
+
+  explicit HttpCookieCollection(const char *header)
+      : header_(header), parsed_(false) {}
+
+  size_t GetCount() const;
+  key_list_type AllKeys() const;
+
+  bool Get(size_t index, value_type *value) const;
+  bool Get(const char *name, size_t name_length, value_type *value) const;
+  bool Get(const key_type &name, value_type *value) const {
+    return Get(name.data(), name.length(), value);
+  }
+  bool GetKey(size_t index, key_type *key) const;
+
+private:
+  struct Entry {
+    const char *name;
+    size_t name_length;
+    const char *value;
+    size_t value_length;
+  };
+
+  void EnsureParsed() const;
+
+  const char *header_;
+  mutable bool parsed_;
+  mutable std::vector<Entry, ArenaAllocator<Entry> > entries_;
+};
+
+#endif  // ASPLITE_COOKIE_COLLECTION_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,114 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/asplite.h"
+
+#include <assert.h>
+
+#include "lua/lua.hpp"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+namespace {
+inline HttpCookieCollection *GetCollection(lua_State *L, int index) {
+  return *reinterpret_cast<HttpCookieCollection **>(lua_touserdata(L, index));
+}
+
+void KeyListToLuaArray(lua_State *L,
+                       const HttpCookieCollection::key_list_type &keys) {
+  lua_newtable(L);
+  int index = 0;
+  for (auto iter = keys.begin(); iter != keys.end(); ++iter) {
+    lua_pushlstring(L, iter->data(), iter->length());
+    lua_rawseti(L, -2, ++index);
+  }
+}
+}  // namespace
+
+int cookie_collection_Get(lua_State *L) {
+  HttpCookieCollection *collection = GetCollection(L, lua_upvalueindex(1));
+  HttpCookieCollection::value_type value;
+  bool found;
+
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Unsigned index = luaL_checkunsigned(L, 1);
+    found = collection->Get(index, &value);
+  } else {
+    size_t name_length;
+    const char *name = luaL_checklstring(L, 1, &name_length);
+    found = collection->Get(name, name_length, &value);
+  }
+
+  if (found)
+    lua_pushlstring(L, value.data(), value.length());
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+int cookie_collection_GetKey(lua_State *L) {
+  HttpCookieCollection *collection = GetCollection(L, lua_upvalueindex(1));
+  lua_Unsigned index = luaL_checkunsigned(L, 1);
+  HttpCookieCollection::key_type key;
+  if (collection->GetKey(index, &key))
+    lua_pushlstring(L, key.data(), key.length());
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+int cookie_collection___index(lua_State *L) {
+  HttpCookieCollection *collection = GetCollection(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  if (strcmp(name, "Count") == 0) {
+    lua_pushunsigned(L, collection->GetCount());
+  } else if (strcmp(name, "AllKeys") == 0) {
+    KeyListToLuaArray(L, collection->AllKeys());
+  } else if (strcmp(name, "Get") == 0) {
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, cookie_collection_Get, 1);
+  } else if (strcmp(name, "GetKey") == 0) {
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, cookie_collection_GetKey, 1);
+  } else {
+    lua_pushstring(L, "Unknown property or method.");
+    lua_error(L);
+  }
+
+  return 1;
+}
+
+int CreateHttpCookieCollection(lua_State *L, HttpCookieCollection *collection) {
+  int stack = lua_gettop(L);
+
+  HttpCookieCollection **udata = (HttpCookieCollection **)lua_newuserdata(
+      L, sizeof(HttpCookieCollection *));
+  *udata = collection;
+  if (luaL_newmetatable(L, "asplite_HttpCookieCollection")) {
+    lua_pushcfunction(L, cookie_collection___index);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+
+  assert(stack + 1 == lua_gettop(L));
+  return 1;
+}
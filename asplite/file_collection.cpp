@@ -41,7 +41,7 @@ bool HttpFileCollection::Get(size_t index,
   return true;
 }
 
-bool HttpFileCollection::Get(const std::string &name,
+bool HttpFileCollection::Get(const key_type &name,
                              HttpFileCollection::value_type *value) const {
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter != keys_.end())
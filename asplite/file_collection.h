@@ -28,13 +28,14 @@
 #include <vector>
 
 #include "asplite/posted_file.h"
+#include "asplite/request_arena.h"
 
 class HttpFileCollection {
 public:
-  typedef std::string key_type;
+  typedef ArenaString key_type;
   typedef HttpPostedFile value_type;
-  typedef std::vector<key_type> key_list_type;
-  typedef std::vector<value_type> value_list_type;
+  typedef std::vector<key_type, ArenaAllocator<key_type> > key_list_type;
+  typedef std::vector<value_type, ArenaAllocator<value_type> > value_list_type;
 
   size_t GetCount() const { return values_.size(); }
   key_list_type AllKeys() const;
@@ -45,12 +46,17 @@ public:
 
   bool GetMultiple(const key_type &name, const value_list_type **values) const;
 
-  bool Add(const std::string &name, const value_type &value);
+  bool Add(const key_type &name, const value_type &value);
 
 private:
   typedef std::pair<key_type, value_list_type> pair_type;
-  typedef std::vector<pair_type> pair_list_type;
-  typedef std::map<key_type, typename pair_list_type::size_type> key_map_type;
+  typedef std::vector<pair_type, ArenaAllocator<pair_type> > pair_list_type;
+  typedef std::map<key_type,
+                   typename pair_list_type::size_type,
+                   std::less<key_type>,
+                   ArenaAllocator<std::pair<const key_type,
+                                            pair_list_type::size_type> > >
+      key_map_type;
 
   key_map_type keys_;
   pair_list_type values_;
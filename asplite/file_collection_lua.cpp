@@ -83,7 +83,7 @@ int file_collection_GetKey(lua_State *L) {
   HttpFileCollection *collection = GetCollection(L, lua_upvalueindex(1));
   lua_Unsigned index = luaL_checkunsigned(L, 1);
 
-  std::string value;
+  HttpFileCollection::key_type value;
   if (collection->GetKey(index, &value))
     lua_pushlstring(L, value.data(), value.length());
   else
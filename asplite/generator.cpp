@@ -23,8 +23,13 @@
 #include "asplite/generator.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "asplite/html_escape.h"
 
 static char *EscapeLuaString(const char *text,
                              size_t length,
@@ -102,8 +107,585 @@ static char *EscapeLuaString(const char *text,
   return buffer;
 }
 
+// Emits a Lua string literal with |length| characters of |text|.
+static void GenerateStringLiteral(PageCodeGeneratorCallback callback,
+                                  const char *text,
+                                  size_t length,
+                                  void *user_data) {
+  size_t encoded_length;
+  char *encoded = EscapeLuaString(text, length, &encoded_length);
+
+  callback("\'", -1, user_data);
+  if (encoded != NULL) {
+    callback(encoded, encoded_length, user_data);
+    free(encoded);
+  }
+  callback("\'", -1, user_data);
+}
+
+// Translates a directive block like
+//    <%@ OutputCache Duration="60" VaryByParam="id" %>
+// into code. Directives other than OutputCache generate nothing.
+static void GenerateDirective(PageCodeGeneratorCallback callback,
+                              const char *begin,
+                              const char *end,
+                              void *user_data) {
+  const char *duration;
+  const char *duration_end;
+  const char *vary_by_param = "";
+  const char *vary_by_param_end = vary_by_param;
+  const char *vary_by_header = "";
+  const char *vary_by_header_end = vary_by_header;
+  char number[32];
+
+  if (!IsDirectiveName(begin, end, "OutputCache"))
+    return;
+
+  if (!GetDirectiveAttribute(begin, end, "Duration", &duration, &duration_end))
+    duration = NULL;
+  GetDirectiveAttribute(
+      begin, end, "VaryByParam", &vary_by_param, &vary_by_param_end);
+  GetDirectiveAttribute(
+      begin, end, "VaryByHeader", &vary_by_header, &vary_by_header_end);
+
+  if (duration == NULL) {
+    callback("error(\'OutputCache directive requires Duration\');",
+             -1,
+             user_data);
+    return;
+  }
+
+  callback("Response.OutputCacheInternal(", -1, user_data);
+  if (duration_end - duration > 0 &&
+      (size_t)(duration_end - duration) < sizeof(number)) {
+    memcpy(number, duration, duration_end - duration);
+    number[duration_end - duration] = '\0';
+    sprintf(number, "%ld", strtol(number, NULL, 10));
+  } else {
+    strcpy(number, "0");
+  }
+  callback(number, -1, user_data);
+  callback(",", -1, user_data);
+  GenerateStringLiteral(
+      callback, vary_by_param, vary_by_param_end - vary_by_param, user_data);
+  callback(",", -1, user_data);
+  GenerateStringLiteral(
+      callback, vary_by_header, vary_by_header_end - vary_by_header, user_data);
+  callback(");", -1, user_data);
+}
+
+static size_t CountNewlines(const char *text, size_t length) {
+  size_t count = 0;
+  const char *end = text + length;
+
+  while ((text = (const char *)memchr(text, '\n', end - text)) != NULL) {
+    count++;
+    text++;
+  }
+
+  return count;
+}
+
+// Returns non-zero if the code of |expression| is a literal whose string
+// value is known at compile time: a quoted string without escapes or
+// a small decimal integer. The value goes to |value| and |value_length|.
+static int GetLiteralValue(const struct PageChunk *expression,
+                           const char **value,
+                           size_t *value_length) {
+  const char *begin = expression->text;
+  const char *end = begin + expression->length;
+  const char *p;
+
+  while (begin < end && isspace((unsigned char)*begin))
+    begin++;
+  while (end > begin && isspace((unsigned char)end[-1]))
+    end--;
+
+  if (end - begin >= 2 && (*begin == '\'' || *begin == '\"') &&
+      end[-1] == *begin) {
+    for (p = begin + 1; p < end - 1; p++) {
+      if (*p == *begin || *p == '\\' || *p == '\n' || *p == '\r')
+        return 0;
+    }
+    *value = begin + 1;
+    *value_length = end - begin - 2;
+    return 1;
+  }
+
+  // tostring gives integers back unchanged as long as they stay integers.
+  if (end - begin < 1 || end - begin > 9 || (*begin == '0' && end - begin > 1))
+    return 0;
+  for (p = begin; p < end; p++) {
+    if (!isdigit((unsigned char)*p))
+      return 0;
+  }
+  *value = begin;
+  *value_length = end - begin;
+  return 1;
+}
+
+// Returns non-zero if |chunk| writes text known at compile time.
+static int IsStaticChunk(const struct PageChunk *chunk) {
+  const char *value;
+  size_t value_length;
+
+  switch (chunk->type) {
+    case Content:
+      return 1;
+    case InlineExpressionRenderBlock:
+    case InlineExpressionRenderHtmlBlock:
+      return GetLiteralValue(chunk, &value, &value_length);
+    default:
+      return 0;
+  }
+}
+
+// Returns non-zero if |chunk| can be part of a batched write, i.e. it
+// writes output or generates nothing but newlines.
+static int IsWriteChunk(const struct PageChunk *chunk) {
+  switch (chunk->type) {
+    case Content:
+    case InlineExpressionRenderBlock:
+    case InlineExpressionRenderHtmlBlock:
+    case ServerSideComment:
+      return 1;
+    case DirectiveBlock:
+      return !IsDirectiveName(
+          chunk->text, chunk->text + chunk->length, "OutputCache");
+    default:
+      return 0;
+  }
+}
+
+// Elements whose bodies keep their whitespace when content is minified.
+static const char *const kRawTextElements[] = {
+    "pre", "textarea", "script", "style"};
+
+// The most chunks one Response.Write call takes.
+static const int kMaxBatchChunks = 32;
+
+// Output state of a Response.Write call that takes a batch of chunks.
+struct WriteBatch {
+  PageCodeGeneratorCallback callback;
+  void *user_data;
+  struct ContentMinifier *minifier;
+  size_t arguments;
+  int in_literal;
+
+  // Newlines of the chunks that generate no code. They are emitted before
+  // the next code, which keeps the code on the line of its chunk.
+  size_t padding;
+};
+
+static void FlushPadding(struct WriteBatch *batch) {
+  static const char kNewlines[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+
+  while (batch->padding > 0) {
+    size_t count = batch->padding;
+    if (count > sizeof(kNewlines) - 1)
+      count = sizeof(kNewlines) - 1;
+    batch->callback(kNewlines, (int)count, batch->user_data);
+    batch->padding -= count;
+  }
+}
+
+static void BeginArgument(struct WriteBatch *batch) {
+  if (batch->in_literal) {
+    batch->callback("\'", -1, batch->user_data);
+    batch->in_literal = 0;
+  }
+
+  FlushPadding(batch);
+
+  if (batch->arguments++ > 0)
+    batch->callback(",", -1, batch->user_data);
+
+  batch->minifier->after_space = 0;
+}
+
+// Appends |text| to the string literal being written, so that adjacent
+// static text becomes one argument.
+static void AddStaticText(struct WriteBatch *batch,
+                          const char *text,
+                          size_t length) {
+  size_t encoded_length;
+  char *encoded;
+
+  if (length == 0)
+    return;
+
+  if (!batch->in_literal) {
+    BeginArgument(batch);
+    batch->callback("\'", -1, batch->user_data);
+    batch->in_literal = 1;
+  }
+
+  encoded = EscapeLuaString(text, length, &encoded_length);
+  if (encoded != NULL) {
+    batch->callback(encoded, encoded_length, batch->user_data);
+    free(encoded);
+  }
+
+  batch->minifier->after_space = isspace((unsigned char)text[length - 1]);
+}
+
+// Returns non-zero if [text, end) starts with |name| in any case.
+static int StartsWithName(const char *text, const char *end, const char *name) {
+  for (; *name != '\0'; text++, name++) {
+    if (text == end || tolower((unsigned char)*text) != *name)
+      return 0;
+  }
+  return 1;
+}
+
+// Returns the raw text element a start tag at |tag| opens, or NULL.
+static const char *GetRawTextElement(const char *tag, const char *end) {
+  size_t i;
+
+  for (i = 0; i < sizeof(kRawTextElements) / sizeof(kRawTextElements[0]);
+       i++) {
+    const char *name = kRawTextElements[i];
+    const char *name_end = tag + 1 + strlen(name);
+    if (StartsWithName(tag + 1, end, name) && name_end < end &&
+        (isspace((unsigned char)*name_end) || *name_end == '>' ||
+         *name_end == '/'))
+      return name;
+  }
+
+  return NULL;
+}
+
+// Returns the end tag of |element| in [text, end), or NULL.
+static const char *FindEndTag(const char *text,
+                              const char *end,
+                              const char *element) {
+  for (; text < end; text++) {
+    if (*text == '<' && text + 1 < end && text[1] == '/' &&
+        StartsWithName(text + 2, end, element))
+      return text;
+  }
+  return NULL;
+}
+
+// Appends content with every run of whitespace collapsed to one space,
+// or to one newline if the run spans lines. The other newlines of the run
+// become padding. Bodies of raw text elements and quoted attribute values
+// are appended as is.
+static void AddMinifiedText(struct WriteBatch *batch,
+                            const char *text,
+                            size_t length) {
+  struct ContentMinifier *minifier = batch->minifier;
+  const char *p = text;
+  const char *end = text + length;
+
+  while (p < end) {
+    const char *start = p;
+
+    if (minifier->raw_element != NULL) {
+      p = FindEndTag(p, end, minifier->raw_element);
+      if (p == NULL)
+        p = end;
+      else
+        minifier->raw_element = NULL;
+      AddStaticText(batch, start, p - start);
+    } else if (minifier->quote != '\0') {
+      p = (const char *)memchr(p, minifier->quote, end - p);
+      if (p == NULL) {
+        p = end;
+      } else {
+        p++;
+        minifier->quote = '\0';
+      }
+      AddStaticText(batch, start, p - start);
+    } else if (isspace((unsigned char)*p)) {
+      size_t newlines = 0;
+
+      for (; p < end && isspace((unsigned char)*p); p++) {
+        if (*p == '\n')
+          newlines++;
+      }
+
+      if (!minifier->after_space) {
+        AddStaticText(batch, newlines > 0 ? "\n" : " ", 1);
+        if (newlines > 0)
+          newlines--;
+      }
+      batch->padding += newlines;
+    } else {
+      if (*p == '<') {
+        minifier->raw_element = GetRawTextElement(p, end);
+        minifier->in_tag = p + 1 < end &&
+                           (isalpha((unsigned char)p[1]) || p[1] == '/');
+      }
+
+      if (minifier->raw_element != NULL) {
+        // The rest of the start tag of a raw text element is kept as is.
+        p = start + 1 + strlen(minifier->raw_element);
+        minifier->in_tag = 0;
+      } else {
+        do {
+          if (minifier->in_tag && (*p == '"' || *p == '\'')) {
+            minifier->quote = *p++;
+            break;
+          }
+          if (*p == '>')
+            minifier->in_tag = 0;
+          p++;
+        } while (p < end && !isspace((unsigned char)*p) && *p != '<');
+      }
+
+      AddStaticText(batch, start, p - start);
+    }
+  }
+}
+
+static void AddHtmlEscapedText(struct WriteBatch *batch,
+                               const char *text,
+                               size_t length) {
+  size_t pos = FindHtmlSpecialCharacter(text, length);
+
+  while (pos < length) {
+    size_t entity_length;
+    const char *entity = GetHtmlEntity(text[pos], &entity_length);
+    AddStaticText(batch, text, pos);
+    AddStaticText(batch, entity, entity_length);
+    text += pos + 1;
+    length -= pos + 1;
+    pos = FindHtmlSpecialCharacter(text, length);
+  }
+
+  AddStaticText(batch, text, length);
+}
+
+// Generates one Response.Write call for the write chunks in [begin, end).
+static void GenerateWriteBatch(PageCodeGeneratorCallback callback,
+                               const struct PageChunk *begin,
+                               const struct PageChunk *end,
+                               struct ContentMinifier *minifier,
+                               void *user_data) {
+  struct WriteBatch batch;
+  const struct PageChunk *chunk;
+  size_t arguments = 0;
+  int in_static = 0;
+
+  batch.callback = callback;
+  batch.user_data = user_data;
+  batch.minifier = minifier;
+  batch.arguments = 0;
+  batch.in_literal = 0;
+  batch.padding = 0;
+
+  for (chunk = begin; chunk < end; chunk++) {
+    if (chunk->type == ServerSideComment || chunk->type == DirectiveBlock ||
+        (chunk->type == Content && chunk->length == 0))
+      continue;
+
+    if (IsStaticChunk(chunk)) {
+      if (!in_static)
+        arguments++;
+      in_static = 1;
+    } else {
+      arguments++;
+      in_static = 0;
+    }
+  }
+
+  if (arguments == 0) {
+    for (chunk = begin; chunk < end; chunk++)
+      batch.padding += CountNewlines(chunk->text, chunk->length);
+    FlushPadding(&batch);
+    return;
+  }
+
+  // A single value goes through the plain translation.
+  if (arguments == 1 && !in_static) {
+    for (chunk = begin; chunk < end; chunk++) {
+      if (chunk->type == InlineExpressionRenderBlock ||
+          chunk->type == InlineExpressionRenderHtmlBlock) {
+        FlushPadding(&batch);
+        minifier->after_space = 0;
+        GenerateBodyChunk(callback,
+                          chunk->text,
+                          chunk->type,
+                          0,
+                          chunk->length,
+                          user_data);
+      } else {
+        batch.padding += CountNewlines(chunk->text, chunk->length);
+      }
+    }
+    FlushPadding(&batch);
+    return;
+  }
+
+  callback("Response.Write(", -1, user_data);
+
+  for (chunk = begin; chunk < end; chunk++) {
+    const char *value;
+    size_t value_length;
+
+    switch (chunk->type) {
+      case Content:
+        if (minifier->enabled)
+          AddMinifiedText(&batch, chunk->text, chunk->length);
+        else
+          AddStaticText(&batch, chunk->text, chunk->length);
+        break;
+
+      case InlineExpressionRenderBlock:
+        if (GetLiteralValue(chunk, &value, &value_length)) {
+          AddStaticText(&batch, value, value_length);
+          batch.padding += CountNewlines(chunk->text, chunk->length);
+        } else {
+          // Parentheses keep a call from passing on more than one value.
+          BeginArgument(&batch);
+          callback("(", -1, user_data);
+          callback(chunk->text, chunk->length, user_data);
+          callback(")", -1, user_data);
+        }
+        break;
+
+      case InlineExpressionRenderHtmlBlock:
+        if (GetLiteralValue(chunk, &value, &value_length)) {
+          AddHtmlEscapedText(&batch, value, value_length);
+          batch.padding += CountNewlines(chunk->text, chunk->length);
+        } else {
+          BeginArgument(&batch);
+          callback("asplite.HtmlEscapeString(", -1, user_data);
+          callback(chunk->text, chunk->length, user_data);
+          callback(")", -1, user_data);
+        }
+        break;
+
+      default:
+        batch.padding += CountNewlines(chunk->text, chunk->length);
+        break;
+    }
+  }
+
+  if (batch.in_literal)
+    callback("\'", -1, user_data);
+  callback(");", -1, user_data);
+  FlushPadding(&batch);
+}
+
+// Returns the Minify attribute of a Page directive in |chunks|, which
+// overrides |minify_content|, or |minify_content| if there is none.
+static int GetMinifyContent(const struct PageChunk *chunks,
+                            size_t count,
+                            int minify_content) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    const char *begin = chunks[i].text;
+    const char *end = begin + chunks[i].length;
+    const char *value;
+    const char *value_end;
+
+    if (chunks[i].type == DirectiveBlock &&
+        IsDirectiveName(begin, end, "Page") &&
+        GetDirectiveAttribute(begin, end, "Minify", &value, &value_end)) {
+      minify_content = value_end - value == 4 &&
+                       StartsWithName(value, value_end, "true");
+    }
+  }
+
+  return minify_content;
+}
+
+void BeginOptimizedBody(struct BodyGenerator *generator,
+                        const struct PageChunk *chunks,
+                        size_t count,
+                        int minify_content) {
+  generator->chunk = chunks;
+  generator->end = chunks + count;
+  generator->minifier.enabled =
+      GetMinifyContent(chunks, count, minify_content);
+  generator->minifier.raw_element = NULL;
+  generator->minifier.in_tag = 0;
+  generator->minifier.quote = '\0';
+  generator->minifier.after_space = 0;
+}
+
+int GenerateNextBodyPart(struct BodyGenerator *generator,
+                         PageCodeGeneratorCallback callback,
+                         void *user_data) {
+  const struct PageChunk *chunk = generator->chunk;
+  const struct PageChunk *end = generator->end;
+  const struct PageChunk *batch_end = chunk;
+
+  if (chunk == end)
+    return 0;
+
+  // Lua limits the number of arguments of a call.
+  while (batch_end < end && batch_end - chunk < kMaxBatchChunks &&
+         IsWriteChunk(batch_end))
+    batch_end++;
+
+  if (batch_end > chunk) {
+    GenerateWriteBatch(
+        callback, chunk, batch_end, &generator->minifier, user_data);
+    generator->chunk = batch_end;
+    return 1;
+  }
+
+  // The code may write anything.
+  generator->minifier.after_space = 0;
+
+  if (chunk->type == DirectiveBlock) {
+    GenerateDirective(
+        callback, chunk->text, chunk->text + chunk->length, user_data);
+    GenerateWriteBatch(
+        callback, chunk, chunk + 1, &generator->minifier, user_data);
+  } else {
+    GenerateBodyChunk(callback,
+                      chunk->text,
+                      chunk->type,
+                      0,
+                      chunk->length,
+                      user_data);
+  }
+
+  generator->chunk = chunk + 1;
+  return 1;
+}
+
+void GenerateReturn(PageCodeGeneratorCallback callback,
+                    const char *const *files,
+                    size_t file_count,
+                    const size_t *lines,
+                    size_t line_count,
+                    void *user_data) {
+  char number[32];
+  size_t i;
+
+  if (file_count == 0) {
+    callback("return AspPage__;\n", -1, user_data);
+    return;
+  }
+
+  callback("return AspPage__, {files = {", -1, user_data);
+  for (i = 0; i < file_count; i++) {
+    if (files[i] != NULL)
+      GenerateStringLiteral(callback, files[i], strlen(files[i]), user_data);
+    else
+      callback("false", -1, user_data);
+    callback(",", -1, user_data);
+  }
+
+  callback("}, lines = {", -1, user_data);
+  for (i = 0; i < line_count; i++) {
+    sprintf(number, "%lu,", (unsigned long)lines[i]);
+    callback(number, -1, user_data);
+  }
+
+  callback("}};\n", -1, user_data);
+}
+
 void GenerateProlog(PageCodeGeneratorCallback callback, void *user_data) {
-  const char kString[] = "function AspPage__()";
+  const char kString[] =
+      "local function AspPage__"
+      "(Request, Response, Server, Session, Application, Cache)";
   callback(kString, sizeof(kString) - 1, user_data);
 }
 
@@ -118,7 +700,6 @@ void GenerateEpilog(PageCodeGeneratorCallback callback, void *user_data) {
 void GenerateBodyChunk(PageCodeGeneratorCallback callback,
                        const char *buffer,
                        enum ChunkType chunk_type,
-                       size_t lineno,
                        size_t begin,
                        size_t end,
                        void *user_data) {
@@ -160,13 +741,24 @@ void GenerateBodyChunk(PageCodeGeneratorCallback callback,
       break;
 
     case InlineExpressionRenderHtmlBlock:
-      callback(
-          "Response.Write(asplite.HtmlEscapeString(tostring(", -1, user_data);
+      // HtmlEscapeString applies tostring itself.
+      callback("Response.Write(asplite.HtmlEscapeString(", -1, user_data);
       callback(buffer + begin, end - begin, user_data);
-      callback(")));", -1, user_data);
+      callback("));", -1, user_data);
+      break;
+
+    case CodeDeclarationBlock:
+      // The caller places declarations at the top level of the chunk,
+      // apart from the page body. Ending the line keeps a trailing
+      // comment from swallowing the code that follows.
+      callback(buffer + begin, end - begin, user_data);
+      callback("\n", -1, user_data);
       break;
 
     case DirectiveBlock:
+      GenerateDirective(callback, buffer + begin, buffer + end, user_data);
+      // Fall through to keep the directive as a comment.
+
     case ServerSideComment:
       // Use long comment to make collision less likely
       // with possible comments inside commented block.
@@ -184,5 +776,9 @@ void GenerateBodyChunk(PageCodeGeneratorCallback callback,
       callback(buffer + begin, end - begin, user_data);
       callback("]=============================]", -1, user_data);
       break;
+
+    case UnterminatedScriptBlock:
+      // The parser reports it as an error, there is no code to generate.
+      break;
   }
 }
@@ -25,18 +25,87 @@
 
 #include "asplite/parser.h"
 
+// Changes whenever the code generated for the same page does, so that
+// bytecode compiled by older versions is not reused.
+#define GENERATOR_VERSION 2
+
 typedef void (*PageCodeGeneratorCallback)(const char *text,
                                           int length,
                                           void *user_data);
 
+// A parsed chunk of the page body waiting for code generation.
+struct PageChunk {
+  enum ChunkType type;
+  const char *text;
+  size_t length;
+};
+
 void GenerateProlog(PageCodeGeneratorCallback callback, void *user_data);
 void GenerateEpilog(PageCodeGeneratorCallback callback, void *user_data);
 void GenerateBodyChunk(PageCodeGeneratorCallback callback,
                        const char *buffer,
                        enum ChunkType chunk_type,
-                       size_t lineno,
                        size_t begin,
                        size_t end,
                        void *user_data);
 
+// State of whitespace minification that carries over between chunks.
+struct ContentMinifier {
+  int enabled;
+
+  // The element whose body is being written as is, or NULL.
+  const char *raw_element;
+
+  // Non-zero inside a start or end tag.
+  int in_tag;
+
+  // The quote of the attribute value being written as is, or '\0'.
+  char quote;
+
+  // Non-zero if the static text written last ends with whitespace.
+  int after_space;
+};
+
+// Generates the page body from a list of chunks a part at a time.
+struct BodyGenerator {
+  const struct PageChunk *chunk;  // The next chunk to generate
+  const struct PageChunk *end;
+  struct ContentMinifier minifier;
+};
+
+// Starts generating the page body from |chunks| like GenerateBodyChunk
+// does for each of them, but merges adjacent static content, folds literal
+// expressions into it and drops comments. Consecutive writes become one
+// Response.Write call with several arguments. The code of every chunk
+// stays on the same line as with GenerateBodyChunk.
+// If |minify_content| is not zero, or a Page directive specifies
+// Minify="true", runs of whitespace in static content collapse to one
+// space or newline, except in bodies of pre, textarea, script and style.
+// |chunks| must stay valid until the body is complete.
+void BeginOptimizedBody(struct BodyGenerator *generator,
+                        const struct PageChunk *chunks,
+                        size_t count,
+                        int minify_content);
+
+// Generates the code of the next batch of writes or the next chunk of code.
+// Returns zero if the body is complete.
+int GenerateNextBodyPart(struct BodyGenerator *generator,
+                         PageCodeGeneratorCallback callback,
+                         void *user_data);
+
+// Emits the end of the chunk, which returns the page function. The page
+// function takes the intrinsic objects as parameters.
+// If |file_count| is not zero, the chunk also returns the source map that
+// maps lines of the generated code back to the page and the files it
+// includes. |lines| holds triples of a generated line, a 1-based index into
+// |files| and the line in that file the generated line comes from.
+// A NULL file name stands for the chunk itself, so that the code does
+// not depend on the path the page is loaded from.
+void GenerateReturn(PageCodeGeneratorCallback callback,
+                    const char *const *files,
+                    size_t file_count,
+                    const size_t *lines,
+                    size_t line_count,
+                    void *user_data);
+
 #endif  // ASPLITE_GENERATOR_H_8EFAF588_E5D1_492B_BDBD_9A65D1F3566E
@@ -0,0 +1,106 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/html_escape.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define ASPLITE_USE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif  // SSE2
+
+namespace {
+
+inline bool IsHtmlSpecialCharacter(char c) {
+  return c == '&' || c == '"' || c == '<' || c == '>' || c == '\'';
+}
+
+#ifdef ASPLITE_USE_SSE2
+inline unsigned CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif  // ASPLITE_USE_SSE2
+
+}  // namespace
+
+size_t FindHtmlSpecialCharacter(const char *text, size_t length) {
+  size_t i = 0;
+
+#ifdef ASPLITE_USE_SSE2
+  // Compare 16 bytes at a time against each of the special characters.
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i quot = _mm_set1_epi8('"');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i apos = _mm_set1_epi8('\'');
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    __m128i match = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, quot)),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, lt), _mm_cmpeq_epi8(chunk, gt)),
+            _mm_cmpeq_epi8(chunk, apos)));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(match));
+    if (mask != 0)
+      return i + CountTrailingZeros(mask);
+  }
+#endif  // ASPLITE_USE_SSE2
+
+  for (; i < length; i++) {
+    if (IsHtmlSpecialCharacter(text[i]))
+      return i;
+  }
+
+  return length;
+}
+
+const char *GetHtmlEntity(char c, size_t *entity_length) {
+  switch (c) {
+    case '&':
+      *entity_length = 5;
+      return "&amp;";
+    case '"':
+      *entity_length = 6;
+      return "&quot;";
+    case '<':
+      *entity_length = 4;
+      return "&lt;";
+    case '>':
+      *entity_length = 4;
+      return "&gt;";
+    case '\'':
+      *entity_length = 5;
+      return "&#39;";
+  }
+
+  return NULL;
+}
@@ -0,0 +1,35 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_HTML_ESCAPE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_HTML_ESCAPE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stdlib.h>
+
+// Returns the offset of the first character in |text| that must be
+// escaped in HTML (one of &"<>'), or |length| if there is none.
+size_t FindHtmlSpecialCharacter(const char *text, size_t length);
+
+// Returns the entity that replaces |c|, or NULL if |c| is not special.
+const char *GetHtmlEntity(char c, size_t *entity_length);
+
+#endif  // ASPLITE_HTML_ESCAPE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,123 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/http_date.h"
+
+#include <string.h>
+
+#include <atomic>
+
+namespace {
+
+const char kWeekdays[] = "SunMonTueWedThuFriSat";
+const char kMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+// The date of the current second. An odd sequence number means that
+// the value is being updated; readers that see the sequence change
+// while copying format the date themselves.
+struct CachedHttpDate {
+  std::atomic<unsigned> sequence;
+  std::atomic<time_t> time;
+  char value[kHttpDateLength + 1];
+};
+
+CachedHttpDate cached_date;
+
+inline char *PutTwoDigits(char *p, int value) {
+  p[0] = static_cast<char>('0' + value / 10);
+  p[1] = static_cast<char>('0' + value % 10);
+  return p + 2;
+}
+
+}  // namespace
+
+void FormatHttpDate(time_t t, char *buffer) {
+  long long seconds = static_cast<long long>(t);
+  long long days = seconds / 86400;
+  int seconds_of_day = static_cast<int>(seconds % 86400);
+  if (seconds_of_day < 0) {
+    seconds_of_day += 86400;
+    --days;
+  }
+
+  int weekday = static_cast<int>((days + 4) % 7);  // 1970-01-01 is Thursday
+  if (weekday < 0)
+    weekday += 7;
+
+  // Civil date from the day number, see
+  // http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+  days += 719468;
+  long long era = (days >= 0 ? days : days - 146096) / 146097;
+  int day_of_era = static_cast<int>(days - era * 146097);
+  int year_of_era =
+      (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+       day_of_era / 146096) / 365;
+  int day_of_year =
+      day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int mp = (5 * day_of_year + 2) / 153;
+  int day = day_of_year - (153 * mp + 2) / 5 + 1;
+  int month = mp < 10 ? mp + 3 : mp - 9;
+  int year = static_cast<int>(year_of_era + era * 400) + (month <= 2);
+
+  char *p = buffer;
+  memcpy(p, kWeekdays + weekday * 3, 3);
+  p[3] = ',';
+  p[4] = ' ';
+  p = PutTwoDigits(p + 5, day);
+  *p++ = ' ';
+  memcpy(p, kMonths + (month - 1) * 3, 3);
+  p[3] = ' ';
+  p = PutTwoDigits(p + 4, year / 100 % 100);
+  p = PutTwoDigits(p, year % 100);
+  *p++ = ' ';
+  p = PutTwoDigits(p, seconds_of_day / 3600);
+  *p++ = ':';
+  p = PutTwoDigits(p, seconds_of_day / 60 % 60);
+  *p++ = ':';
+  p = PutTwoDigits(p, seconds_of_day % 60);
+  memcpy(p, " GMT", 5);
+}
+
+void GetCurrentHttpDate(char *buffer) {
+  time_t now = time(NULL);
+
+  unsigned sequence = cached_date.sequence.load(std::memory_order_acquire);
+  if ((sequence & 1) == 0 &&
+      cached_date.time.load(std::memory_order_relaxed) == now) {
+    memcpy(buffer, cached_date.value, sizeof(cached_date.value));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (cached_date.sequence.load(std::memory_order_relaxed) == sequence)
+      return;
+  }
+
+  FormatHttpDate(now, buffer);
+
+  // Publish the new value unless another thread is doing that already.
+  if ((sequence & 1) == 0 &&
+      cached_date.sequence.compare_exchange_strong(
+          sequence, sequence + 1, std::memory_order_relaxed)) {
+    std::atomic_thread_fence(std::memory_order_release);
+    cached_date.time.store(now, std::memory_order_relaxed);
+    memcpy(cached_date.value, buffer, sizeof(cached_date.value));
+    cached_date.sequence.store(sequence + 2, std::memory_order_release);
+  }
+}
@@ -24,18 +24,18 @@
 
 #include <cassert>
 #include <cstdio>
-#include <iomanip>
-#include <sstream>
 #include <string>
 #include <vector>
 
 #include "mongoose/mongoose.h"
 #include "asplite/asplite.h"
 
+typedef std::vector<ArenaString, ArenaAllocator<ArenaString> > ArenaStringList;
+
 template <typename STR>
 static size_t TokenizeT(const STR &str,
                         const STR &delimiters,
-                        std::vector<STR> *tokens) {
+                        std::vector<STR, ArenaAllocator<STR> > *tokens) {
   tokens->clear();
 
   typename STR::size_type start = str.find_first_not_of(delimiters);
@@ -53,9 +53,9 @@ static size_t TokenizeT(const STR &str,
   return tokens->size();
 }
 
-size_t Tokenize(const std::string &str,
-                const std::string &delimiters,
-                std::vector<std::string> *tokens) {
+size_t Tokenize(const ArenaString &str,
+                const ArenaString &delimiters,
+                ArenaStringList *tokens) {
   return TokenizeT(str, delimiters, tokens);
 }
 
@@ -73,7 +73,7 @@ size_t FindSpan(const char *begin, const char *end, const char *delimiters) {
 static size_t TokenizeBuffer(const char *buf,
                              size_t buf_size,
                              const char *delimiters,
-                             std::vector<std::string> *tokens) {
+                             ArenaStringList *tokens) {
   const char *p = buf;
   const char *end = buf + buf_size;
 
@@ -84,7 +84,7 @@ static size_t TokenizeBuffer(const char *buf,
       continue;
     }
 
-    tokens->push_back(std::string(p, span));
+    tokens->push_back(ArenaString(p, span));
     p += span + 1;
   }
 
@@ -93,7 +93,7 @@ static size_t TokenizeBuffer(const char *buf,
 
 static ptrdiff_t FindStringInBuffer(char *buf,
                                     size_t len,
-                                    const std::string &str) {
+                                    const ArenaString &str) {
   if (len < str.length())
     return -1;
 
@@ -106,7 +106,7 @@ static ptrdiff_t FindStringInBuffer(char *buf,
   return -1;
 }
 
-std::string UnquoteString(const std::string &str) {
+ArenaString UnquoteString(const ArenaString &str) {
   const char kQuote = '"';
 
   if (str[0] != kQuote || str.length() < 2)
@@ -115,7 +115,7 @@ std::string UnquoteString(const std::string &str) {
   if (str[0] != str[str.length() - 1])
     return str;
 
-  std::string s(str);
+  ArenaString s(str);
   s.erase(s.length() - 1, 1);
   s.erase(0, 1);
   return s;
@@ -126,13 +126,13 @@ std::string UnquoteString(const std::string &str) {
 // Returns true if at least content type was found.
 // The function assumes that leading and trailing whitspaces were removed,
 // including trailing CRLF
-bool ParseContentTypeHeader(const std::string value,
-                            std::string *content_type,
-                            std::string *boundary) {
+bool ParseContentTypeHeader(const ArenaString &value,
+                            ArenaString *content_type,
+                            ArenaString *boundary) {
   content_type->clear();
   boundary->clear();
 
-  std::vector<std::string> v;
+  ArenaStringList v;
   if (Tokenize(value, "; ", &v) == 0)
     return false;
 
@@ -143,7 +143,7 @@ bool ParseContentTypeHeader(const std::string value,
   v.erase(v.begin());
 
   for (auto iter = v.begin(); iter != v.end(); ++iter) {
-    std::vector<std::string> name_value_pair;
+    ArenaStringList name_value_pair;
     if (Tokenize(*iter, "=", &name_value_pair) == 2) {
       if (name_value_pair[0] == "boundary") {
         *boundary = name_value_pair[1];
@@ -157,15 +157,15 @@ bool ParseContentTypeHeader(const std::string value,
 
 // Extracts Content-Disposition HTTP header parameters.
 // |data| is value of Content-Disposition header.
-static bool ExtractContentDispositionParameters(std::string data,
+static bool ExtractContentDispositionParameters(const ArenaString &data,
                                                 struct FormItem *form_item) {
-  std::vector<std::string> params;
+  ArenaStringList params;
   if (Tokenize(data, "; ", &params) == 0) {
     // no parameters
     return false;
   }
 
-  std::string content_disposition = params[0];
+  ArenaString content_disposition = params[0];
   params.erase(params.begin());
 
   form_item->content_disposition = content_disposition;
@@ -177,7 +177,7 @@ static bool ExtractContentDispositionParameters(std::string data,
   }
 
   for (auto iter = params.begin(); iter != params.end(); ++iter) {
-    std::vector<std::string> pair;
+    ArenaStringList pair;
     if (Tokenize(*iter, "=", &pair) != 2)
       continue;
 
@@ -192,15 +192,15 @@ static bool ExtractContentDispositionParameters(std::string data,
   return true;
 }
 
-std::string GenerateUniqueFileName() {
+ArenaString GenerateUniqueFileName() {
   // TODO: Do better.
   static int index = 0;
-  std::ostringstream s;
-  s << "file" << std::setw(8) << std::setfill('0') << index;
-  return s.str();
+  char name[32];
+  sprintf(name, "file%08d", index);
+  return ArenaString(name);
 }
 
-static bool ProcessPartHeaders(const std::vector<std::string> &headers,
+static bool ProcessPartHeaders(const ArenaStringList &headers,
                                struct FormItem *form_item) {
   // Go through the headers and find Content-Disposition
   for (auto iter = headers.begin(); iter != headers.end(); ++iter) {
@@ -208,8 +208,8 @@ static bool ProcessPartHeaders(const std::vector<std::string> &headers,
       // TODO: Strip leading WS
       ExtractContentDispositionParameters(iter->substr(20), form_item);
     } else if (strncmp(iter->c_str(), "Content-Type:", 13) == 0) {
-      std::string content_type;
-      std::string boundary;
+      ArenaString content_type;
+      ArenaString boundary;
 
       // TODO: Strip leading WS
       ParseContentTypeHeader(iter->substr(13), &content_type, &boundary);
@@ -230,8 +230,8 @@ public:
 
 class FileBackedContentBuffer : public ContentBuffer {
 public:
-  FileBackedContentBuffer(const std::string &file) {
-    file_ = fopen(file.c_str(), "wb");
+  FileBackedContentBuffer(const char *file) {
+    file_ = fopen(file, "wb");
   }
 
   ~FileBackedContentBuffer() { Finish(); }
@@ -254,7 +254,7 @@ private:
 
 class StringBackedContentBuffer : public ContentBuffer {
 public:
-  StringBackedContentBuffer(std::string *str) : str_(str) {}
+  StringBackedContentBuffer(ArenaString *str) : str_(str) {}
 
   ~StringBackedContentBuffer() { Finish(); }
 
@@ -266,25 +266,25 @@ public:
   void Finish() override {}
 
 private:
-  std::string *str_;
+  ArenaString *str_;
 };
 
 int ProcessMultipartFormData(IHttpRequestAdapter *request,
                              IHttpResponseAdapter *response,
-                             const std::string &boundary,
-                             const std::string &request_upload_directory,
-                             std::vector<FormItem> *form_items) {
+                             const ArenaString &boundary,
+                             const ArenaString &request_upload_directory,
+                             FormItemList *form_items) {
   // static const size_t kDefaultBufferSize = 0x4000;
   static const size_t kDefaultBufferSize = 10000;
   FormItem *current_item = NULL;
   ContentBuffer *current_buffer = NULL;
 
-  std::string bd("\r\n--");
+  ArenaString bd("\r\n--");
   bd += boundary;
 
   assert(kDefaultBufferSize > bd.length());
 
-  std::vector<char> buf(kDefaultBufferSize);
+  std::vector<char, ArenaAllocator<char> > buf(kDefaultBufferSize);
 
   // The first CRLF was consumed during HTTP request parsing,
   // so we stuff it here artificially.
@@ -341,7 +341,7 @@ int ProcessMultipartFormData(IHttpRequestAdapter *request,
 
       // Check if there are headers
       if (content_offset > 0) {
-        std::vector<std::string> part_headers;
+        ArenaStringList part_headers;
         TokenizeBuffer(
             &buf[part_offset], content_offset, "\r\n", &part_headers);
 
@@ -393,25 +393,27 @@ int ProcessMultipartFormData(IHttpRequestAdapter *request,
   return 0;
 }
 
-void ProcessPostRequest(IHttpRequestAdapter *request,
+bool ProcessPostRequest(IHttpRequestAdapter *request,
                         IHttpResponseAdapter *response,
-                        const std::string &upload_directory,
-                        std::vector<FormItem> *form_items) {
-  std::string content_type_header = request->GetHeader("Content-Type");
-  if (!content_type_header.empty()) {
-    std::string content_type;
-    std::string boundary;
+                        const ArenaString &upload_directory,
+                        FormItemList *form_items) {
+  const char *content_type_header = request->GetHeader("Content-Type");
+  if (content_type_header != NULL && *content_type_header != '\0') {
+    ArenaString content_type;
+    ArenaString boundary;
 
     if (ParseContentTypeHeader(content_type_header, &content_type, &boundary)) {
       if (content_type == "multipart/form-data") {
-        std::string request_directory;
         ProcessMultipartFormData(
             request, response, boundary, upload_directory, form_items);
       } else if (content_type == "application/x-www-form-urlencoded") {
         // TODO: Process form
       } else {
         response->Respond415(content_type_header);
+        return false;
       }
     }
   }
+
+  return true;
 }
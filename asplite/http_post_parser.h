@@ -31,17 +31,22 @@
 struct FormItem {
   FormItem() : is_file(false) {}
 
-  std::string name;
-  std::string content_type;
-  std::string content_disposition;
-  std::string file_name;
-  std::string value;
+  ArenaString name;
+  ArenaString content_type;
+  ArenaString content_disposition;
+  ArenaString file_name;
+  ArenaString value;
   bool is_file;
 };
 
-void ProcessPostRequest(IHttpRequestAdapter *request,
+typedef std::vector<FormItem, ArenaAllocator<FormItem> > FormItemList;
+
+// Parses the form data posted with |request| into |form_items|.
+// Returns false if the request has been rejected with a response already,
+// in which case the page must not run.
+bool ProcessPostRequest(IHttpRequestAdapter *request,
                         IHttpResponseAdapter *response,
-                        const std::string &upload_directory,
-                        std::vector<FormItem> *form_items);
+                        const ArenaString &upload_directory,
+                        FormItemList *form_items);
 
 #endif  // ASPLITE_POST_H_DE76E377_F1BF_4939_AE8E_7BD93F040F44
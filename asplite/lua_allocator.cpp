@@ -0,0 +1,212 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/lua_allocator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua/lauxlib.h"
+
+#include "asplite/thread_local.h"
+
+namespace {
+
+// Slabs kept per thread when states are destroyed (4MB).
+const size_t kMaxCachedSlabs = 256;
+
+ASPLITE_THREAD_LOCAL void *cached_slabs = NULL;
+ASPLITE_THREAD_LOCAL size_t cached_slab_count = 0;
+
+int Panic(lua_State *L) {
+  fprintf(stderr,
+          "PANIC: unprotected error in call to Lua API (%s)\n",
+          lua_tostring(L, -1));
+  return 0;  // return to Lua to abort
+}
+
+}  // namespace
+
+LuaStateAllocator::LuaStateAllocator()
+    : slab_ptr_(NULL), slab_end_(NULL), slabs_(NULL) {
+  static_assert(sizeof(Slab) <= kSlabHeaderSize, "slab header too large");
+  memset(free_cells_, 0, sizeof(free_cells_));
+}
+
+LuaStateAllocator::~LuaStateAllocator() {
+  // The closed state has returned all cells, so the slabs are free.
+  while (slabs_ != NULL) {
+    Slab *next = slabs_->next;
+    if (cached_slab_count < kMaxCachedSlabs) {
+      slabs_->next = (Slab *)cached_slabs;
+      cached_slabs = slabs_;
+      cached_slab_count++;
+    } else {
+      free(slabs_);
+    }
+    slabs_ = next;
+  }
+}
+
+lua_State *LuaStateAllocator::NewState() {
+  lua_State *L = lua_newstate(Alloc, this);
+  if (L != NULL)
+    lua_atpanic(L, Panic);
+  return L;
+}
+
+void *LuaStateAllocator::Alloc(void *ud,
+                               void *ptr,
+                               size_t osize,
+                               size_t nsize) {
+  LuaStateAllocator *allocator = static_cast<LuaStateAllocator *>(ud);
+
+  if (nsize == 0) {
+    if (ptr != NULL)
+      allocator->Free(ptr, osize);
+    return NULL;
+  }
+
+  // When |ptr| is NULL, |osize| encodes the kind of object.
+  if (ptr == NULL)
+    return allocator->Allocate(nsize);
+
+  return allocator->Reallocate(ptr, osize, nsize);
+}
+
+void LuaStateAllocator::ReleaseThreadCache() {
+  while (cached_slabs != NULL) {
+    Slab *next = ((Slab *)cached_slabs)->next;
+    free(cached_slabs);
+    cached_slabs = next;
+  }
+  cached_slab_count = 0;
+}
+
+void *LuaStateAllocator::Allocate(size_t size) {
+  void *ptr;
+
+  if (size <= kMaxSmallSize) {
+    ptr = AllocateSmall(SizeClass(size));
+    statistics_.small_allocation_count++;
+  } else {
+    ptr = malloc(size);
+    statistics_.large_allocation_count++;
+  }
+
+  if (ptr != NULL) {
+    statistics_.bytes_in_use += size;
+    if (statistics_.bytes_in_use > statistics_.peak_bytes_in_use)
+      statistics_.peak_bytes_in_use = statistics_.bytes_in_use;
+  }
+
+  return ptr;
+}
+
+void LuaStateAllocator::Free(void *ptr, size_t size) {
+  if (size <= kMaxSmallSize) {
+    FreeCell *cell = static_cast<FreeCell *>(ptr);
+    size_t size_class = SizeClass(size);
+    cell->next = free_cells_[size_class];
+    free_cells_[size_class] = cell;
+  } else {
+    free(ptr);
+  }
+
+  statistics_.bytes_in_use -= size;
+}
+
+void *LuaStateAllocator::Reallocate(void *ptr,
+                                    size_t old_size,
+                                    size_t new_size) {
+  void *new_ptr;
+
+  if (old_size > kMaxSmallSize && new_size > kMaxSmallSize) {
+    new_ptr = realloc(ptr, new_size);
+    if (new_ptr == NULL)
+      return NULL;
+  } else if (old_size <= kMaxSmallSize && new_size <= kMaxSmallSize &&
+             SizeClass(old_size) == SizeClass(new_size)) {
+    new_ptr = ptr;
+  } else {
+    new_ptr = Allocate(new_size);
+    if (new_ptr == NULL)
+      return NULL;
+
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    Free(ptr, old_size);
+    // Allocate() and Free() accounted for the sizes already.
+    return new_ptr;
+  }
+
+  statistics_.bytes_in_use += new_size;
+  statistics_.bytes_in_use -= old_size;
+  if (statistics_.bytes_in_use > statistics_.peak_bytes_in_use)
+    statistics_.peak_bytes_in_use = statistics_.bytes_in_use;
+
+  return new_ptr;
+}
+
+void *LuaStateAllocator::AllocateSmall(size_t size_class) {
+  FreeCell *cell = free_cells_[size_class];
+  if (cell != NULL) {
+    free_cells_[size_class] = cell->next;
+    return cell;
+  }
+
+  size_t cell_size = (size_class + 1) * kGranularity;
+  size_t available = slab_end_ - slab_ptr_;
+  if (available < cell_size) {
+    // The remainder of the current slab is smaller than the requested
+    // cell, so it makes exactly one cell of a smaller class. The class
+    // is rounded down to never hand out more than is left.
+    if (available >= kGranularity) {
+      size_t remainder_class = available / kGranularity - 1;
+      FreeCell *remainder = (FreeCell *)slab_ptr_;
+      remainder->next = free_cells_[remainder_class];
+      free_cells_[remainder_class] = remainder;
+    }
+
+    Slab *slab;
+    if (cached_slabs != NULL) {
+      slab = (Slab *)cached_slabs;
+      cached_slabs = slab->next;
+      cached_slab_count--;
+    } else {
+      slab = (Slab *)malloc(kSlabSize);
+      if (slab == NULL)
+        return NULL;
+    }
+
+    slab->next = slabs_;
+    slabs_ = slab;
+    statistics_.slab_count++;
+
+    slab_ptr_ = (char *)slab + kSlabHeaderSize;
+    slab_end_ = (char *)slab + kSlabSize;
+  }
+
+  void *ptr = slab_ptr_;
+  slab_ptr_ += cell_size;
+  return ptr;
+}
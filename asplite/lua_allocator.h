@@ -0,0 +1,108 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_LUA_ALLOCATOR_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_LUA_ALLOCATOR_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+
+#include "lua/lua.hpp"
+
+// lua_Alloc implementation for page states.
+// Small blocks (strings, tables, closures, upvalues) are carved out of
+// slabs and recycled through per-size-class free lists. Larger blocks
+// are taken from the heap. lua_close frees every block, after which
+// destroying the allocator hands its slabs over to a thread local cache
+// to be reused by the next state created on the same thread.
+// The allocator is not thread safe, as is a lua_State.
+class LuaStateAllocator {
+public:
+  struct Statistics {
+    Statistics()
+        : bytes_in_use(0),
+          peak_bytes_in_use(0),
+          small_allocation_count(0),
+          large_allocation_count(0),
+          slab_count(0) {}
+
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+    size_t small_allocation_count;
+    size_t large_allocation_count;
+    size_t slab_count;
+  };
+
+  LuaStateAllocator();
+
+  // The state created with this allocator must be closed by then.
+  ~LuaStateAllocator();
+
+  // Creates a new state that uses this allocator.
+  lua_State *NewState();
+
+  const Statistics &GetStatistics() const { return statistics_; }
+
+  static void *Alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+  // Frees slabs cached by the calling thread.
+  static void ReleaseThreadCache();
+
+private:
+  enum {
+    kGranularity = 16,
+    kMaxSmallSize = 256,
+    kSizeClassCount = kMaxSmallSize / kGranularity,
+    kSlabSize = 16 * 1024,
+    // Cells start this far into a slab, so the payload of a slab is
+    // a multiple of kGranularity whatever the size of the header.
+    kSlabHeaderSize = kGranularity
+  };
+
+  struct FreeCell {
+    FreeCell *next;
+  };
+
+  struct Slab {
+    Slab *next;
+  };
+
+  LuaStateAllocator(const LuaStateAllocator &);
+  LuaStateAllocator &operator=(const LuaStateAllocator &);
+
+  static size_t SizeClass(size_t size) {
+    return (size + kGranularity - 1) / kGranularity - 1;
+  }
+
+  void *Allocate(size_t size);
+  void Free(void *ptr, size_t size);
+  void *Reallocate(void *ptr, size_t old_size, size_t new_size);
+
+  void *AllocateSmall(size_t size_class);
+
+  FreeCell *free_cells_[kSizeClassCount];
+  char *slab_ptr_;  // Uncarved part of the current slab
+  char *slab_end_;
+  Slab *slabs_;
+  Statistics statistics_;
+};
+
+#endif  // ASPLITE_LUA_ALLOCATOR_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,178 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/lua_serializer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lua/lauxlib.h"
+
+namespace {
+
+// Values are stored in a compact binary form: a tag followed by
+//    'b' one byte, 0 or 1
+//    'd' lua_Number
+//    's' uint32_t length and the bytes
+//    't' uint32_t number of pairs and the serialized keys and values
+const char kBooleanTag = 'b';
+const char kNumberTag = 'd';
+const char kStringTag = 's';
+const char kTableTag = 't';
+
+// Also stops on cyclic tables.
+const int kMaxNestingDepth = 32;
+
+void AppendLength(uint32_t length, ArenaString *out) {
+  out->append(reinterpret_cast<const char *>(&length), sizeof(length));
+}
+
+// Raises a Lua error for values that cannot be stored. The output buffer
+// is allocated from the request arena, so it is not leaked then.
+void SerializeValue(lua_State *L, int index, int depth, ArenaString *out) {
+  switch (lua_type(L, index)) {
+    case LUA_TBOOLEAN:
+      out->push_back(kBooleanTag);
+      out->push_back(lua_toboolean(L, index) ? 1 : 0);
+      break;
+
+    case LUA_TNUMBER: {
+      lua_Number number = lua_tonumber(L, index);
+      out->push_back(kNumberTag);
+      out->append(reinterpret_cast<const char *>(&number), sizeof(number));
+      break;
+    }
+
+    case LUA_TSTRING: {
+      size_t length;
+      const char *text = lua_tolstring(L, index, &length);
+      out->push_back(kStringTag);
+      AppendLength((uint32_t)length, out);
+      out->append(text, length);
+      break;
+    }
+
+    case LUA_TTABLE: {
+      if (depth >= kMaxNestingDepth)
+        luaL_error(L, "Cannot store tables nested deeper than %d levels",
+                   kMaxNestingDepth);
+
+      luaL_checkstack(L, 3, NULL);
+      out->push_back(kTableTag);
+      size_t count_offset = out->length();
+      AppendLength(0, out);
+
+      uint32_t count = 0;
+      lua_pushnil(L);
+      while (lua_next(L, index)) {
+        int top = lua_gettop(L);
+        SerializeValue(L, top - 1, depth + 1, out);
+        SerializeValue(L, top, depth + 1, out);
+        lua_pop(L, 1);
+        ++count;
+      }
+
+      memcpy(&(*out)[count_offset], &count, sizeof(count));
+      break;
+    }
+
+    default:
+      luaL_error(L, "Cannot store a value of type %s",
+                 luaL_typename(L, index));
+      break;
+  }
+}
+
+bool ReadLength(const char **p, const char *end, uint32_t *length) {
+  if ((size_t)(end - *p) < sizeof(*length))
+    return false;
+  memcpy(length, *p, sizeof(*length));
+  *p += sizeof(*length);
+  return true;
+}
+
+// Pushes the value serialized at |*p|. Returns false if the data is
+// malformed, in which case the stack is left as it was.
+bool DeserializeValue(lua_State *L, const char **p, const char *end) {
+  if (*p >= end)
+    return false;
+
+  luaL_checkstack(L, 3, NULL);
+
+  switch (*(*p)++) {
+    case kBooleanTag:
+      if (*p >= end)
+        return false;
+      lua_pushboolean(L, *(*p)++);
+      return true;
+
+    case kNumberTag: {
+      lua_Number number;
+      if ((size_t)(end - *p) < sizeof(number))
+        return false;
+      memcpy(&number, *p, sizeof(number));
+      *p += sizeof(number);
+      lua_pushnumber(L, number);
+      return true;
+    }
+
+    case kStringTag: {
+      uint32_t length;
+      if (!ReadLength(p, end, &length) || (size_t)(end - *p) < length)
+        return false;
+      lua_pushlstring(L, *p, length);
+      *p += length;
+      return true;
+    }
+
+    case kTableTag: {
+      uint32_t count;
+      if (!ReadLength(p, end, &count))
+        return false;
+      lua_createtable(L, 0, count);
+      for (uint32_t i = 0; i < count; ++i) {
+        if (!DeserializeValue(L, p, end)) {
+          lua_pop(L, 1);
+          return false;
+        }
+        if (!DeserializeValue(L, p, end)) {
+          lua_pop(L, 2);
+          return false;
+        }
+        lua_rawset(L, -3);
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}  // namespace
+
+void SerializeLuaValue(lua_State *L, int index, ArenaString *out) {
+  SerializeValue(L, lua_absindex(L, index), 0, out);
+}
+
+bool DeserializeLuaValue(lua_State *L, const char *data, size_t length) {
+  return DeserializeValue(L, &data, data + length);
+}
@@ -0,0 +1,44 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_LUA_SERIALIZER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_LUA_SERIALIZER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+
+#include "lua/lua.hpp"
+
+#include "asplite/request_arena.h"
+
+// Converts Lua values to a byte string and back, so that they can be kept
+// outside of a Lua state. Strings, numbers, booleans and tables of these
+// are supported.
+
+// Appends the serialized value at |index| to |out|. Raises a Lua error if
+// the value cannot be serialized.
+void SerializeLuaValue(lua_State *L, int index, ArenaString *out);
+
+// Pushes the value serialized in |data|. Returns false and leaves the
+// stack as it was if the data is malformed.
+bool DeserializeLuaValue(lua_State *L, const char *data, size_t length);
+
+#endif  // ASPLITE_LUA_SERIALIZER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -23,30 +23,173 @@
 #include "asplite/membuf.h"
 
 #include <errno.h>
-#include <io.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#define _read ::read
+#define _write ::write
+#define _close ::close
+#define _lseek ::lseek
+#define _chsize ::ftruncate
+#endif  // _WIN32
+
+#include "asplite/thread_local.h"
+
+namespace {
+
+// The smallest block allocated for a buffer.
+const size_t kMinCapacity = 256;
+
+// Blocks kept per thread when buffers are closed.
+const size_t kMaxCachedBlocks = 8;
+const size_t kMaxCachedBlockSize = 1024 * 1024;
+
+// Header written over a cached block.
+struct CachedBlock {
+  CachedBlock *next;
+  size_t capacity;
+};
+
+ASPLITE_THREAD_LOCAL CachedBlock *cached_blocks = NULL;
+ASPLITE_THREAD_LOCAL size_t cached_block_count = 0;
+
+// Allocates a block of at least |size| bytes and returns
+// its actual size in |capacity|.
+void *AllocateBlock(size_t size, size_t *capacity) {
+  CachedBlock **link;
+  void *ptr;
+
+  for (link = &cached_blocks; *link != NULL; link = &(*link)->next) {
+    CachedBlock *block = *link;
+    if (block->capacity >= size) {
+      *link = block->next;
+      cached_block_count--;
+      *capacity = block->capacity;
+      return block;
+    }
+  }
+
+  if (size < kMinCapacity)
+    size = kMinCapacity;
+
+  ptr = malloc(size);
+  if (ptr != NULL)
+    *capacity = size;
+  return ptr;
+}
+
+void ReleaseBlock(void *ptr, size_t capacity) {
+  CachedBlock *block = (CachedBlock *)ptr;
+
+  if (ptr == NULL)
+    return;
+
+  if (cached_block_count < kMaxCachedBlocks &&
+      capacity >= sizeof(CachedBlock) && capacity <= kMaxCachedBlockSize) {
+    block->next = cached_blocks;
+    block->capacity = capacity;
+    cached_blocks = block;
+    cached_block_count++;
+  } else {
+    free(ptr);
+  }
+}
+
+struct membuf_segment *AllocateSegment(size_t size) {
+  struct membuf_segment *segment;
+  size_t capacity;
+
+  segment = (struct membuf_segment *)AllocateBlock(
+      sizeof(struct membuf_segment) + size, &capacity);
+  if (segment == NULL)
+    return NULL;
+
+  segment->next = NULL;
+  segment->size = 0;
+  segment->capacity = capacity - sizeof(struct membuf_segment);
+  return segment;
+}
+
+void ReleaseSegments(struct membuf_segment *segment) {
+  while (segment != NULL) {
+    struct membuf_segment *next = segment->next;
+    ReleaseBlock(segment, sizeof(struct membuf_segment) + segment->capacity);
+    segment = next;
+  }
+}
+
+int AppendToSegments(struct membuf *buf, const void *data, size_t length) {
+  const char *p = (const char *)data;
+
+  while (length > 0) {
+    struct membuf_segment *segment = buf->last_segment;
+    size_t count;
+
+    if (segment == NULL || segment->size == segment->capacity) {
+      segment = AllocateSegment(
+          length > buf->segment_size ? length : buf->segment_size);
+      if (segment == NULL)
+        return ENOMEM;
+
+      if (buf->last_segment != NULL)
+        buf->last_segment->next = segment;
+      else
+        buf->first_segment = segment;
+      buf->last_segment = segment;
+    }
+
+    count = segment->capacity - segment->size;
+    if (count > length)
+      count = length;
+
+    memcpy((char *)membuf_segment_data(segment) + segment->size, p, count);
+    segment->size += count;
+    buf->size += count;
+    p += count;
+    length -= count;
+  }
+
+  return 0;
+}
+
+}  // namespace
+
 struct membuf *membuf_create(size_t capacity, int fd, int read, int write) {
   struct membuf *buf = (struct membuf *)malloc(sizeof(struct membuf));
   buf->fd = fd;
   buf->read = read;
   buf->write = write;
-  buf->ptr = malloc(capacity);
-  memset(buf->ptr, 0, capacity);
-
+  buf->ptr = NULL;
+  buf->capacity = 0;
   buf->size = 0;
-  buf->capacity = capacity;
+  buf->segment_size = 0;
+  buf->first_segment = NULL;
+  buf->last_segment = NULL;
+
+  // The content is not initialized, only what has been appended or read
+  // is ever used.
+  if (capacity > 0)
+    buf->ptr = AllocateBlock(capacity, &buf->capacity);
 
   if (fd && read) {
-    _read(fd, buf->ptr, buf->capacity);
+    _read(fd, buf->ptr, capacity);
     buf->size = capacity;
   }
 
   return buf;
 }
 
+struct membuf *membuf_create_segmented(size_t segment_size) {
+  struct membuf *buf = membuf_create(0, -1, 0, 0);
+  buf->segment_size = segment_size > 0 ? segment_size : kMinCapacity;
+  return buf;
+}
+
 int membuf_commit(struct membuf *buf) {
   int bytes;
 
@@ -54,8 +197,6 @@ int membuf_commit(struct membuf *buf) {
     return EINVAL;
 
   if (buf->fd >= 0 && buf->write) {
-    buf->capacity = buf->size;
-
     // Setting file size of text files may truncate them
     // so we just start from scratch.
     if (_chsize(buf->fd, 0) == -1)
@@ -63,9 +204,18 @@ int membuf_commit(struct membuf *buf) {
 
     _lseek(buf->fd, 0, SEEK_SET);
 
-    bytes = _write(buf->fd, buf->ptr, buf->capacity);
-    if (bytes == -1)
-      return errno;
+    if (membuf_is_segmented(buf)) {
+      struct membuf_segment *segment;
+      for (segment = buf->first_segment; segment; segment = segment->next) {
+        bytes = _write(buf->fd, membuf_segment_data(segment), segment->size);
+        if (bytes == -1)
+          return errno;
+      }
+    } else {
+      bytes = _write(buf->fd, buf->ptr, buf->size);
+      if (bytes == -1)
+        return errno;
+    }
   }
 
   return 0;
@@ -74,9 +224,12 @@ int membuf_commit(struct membuf *buf) {
 int membuf_ensure(struct membuf *buf, size_t new_size) {
   void *p = NULL;
 
-  if (buf == NULL)
+  if (buf == NULL || membuf_is_segmented(buf))
     return EINVAL;
 
+  if (new_size <= buf->capacity)
+    return 0;
+
   p = realloc(buf->ptr, new_size);
   if (p == NULL)
     return ENOMEM;
@@ -88,15 +241,23 @@ int membuf_ensure(struct membuf *buf, size_t new_size) {
 
 int membuf_ensure_extra(struct membuf *buf, size_t size) {
   size_t available;
+  size_t new_size;
 
   if (buf == NULL)
     return EINVAL;
 
   available = buf->capacity - buf->size;
-  if (available < size)
-    return membuf_ensure(buf, buf->size + size);
+  if (available >= size)
+    return 0;
 
-  return 0;
+  // Grow by half at least to keep appends amortized O(1).
+  new_size = buf->capacity + buf->capacity / 2;
+  if (new_size < buf->size + size)
+    new_size = buf->size + size;
+  if (new_size < kMinCapacity)
+    new_size = kMinCapacity;
+
+  return membuf_ensure(buf, new_size);
 }
 
 int membuf_append(struct membuf *buf, const void *data, size_t length) {
@@ -105,6 +266,9 @@ int membuf_append(struct membuf *buf, const void *data, size_t length) {
   if (buf == NULL)
     return EINVAL;
 
+  if (membuf_is_segmented(buf))
+    return AppendToSegments(buf, data, length);
+
   result = membuf_ensure_extra(buf, length);
   if (result)
     return result;
@@ -115,6 +279,21 @@ int membuf_append(struct membuf *buf, const void *data, size_t length) {
   return 0;
 }
 
+void membuf_clear(struct membuf *buf) {
+  if (buf == NULL)
+    return;
+
+  // The first segment is kept for the content to come.
+  if (buf->first_segment != NULL) {
+    ReleaseSegments(buf->first_segment->next);
+    buf->first_segment->next = NULL;
+    buf->first_segment->size = 0;
+    buf->last_segment = buf->first_segment;
+  }
+
+  buf->size = 0;
+}
+
 void membuf_close(struct membuf *buf) {
   int result;
 
@@ -126,6 +305,16 @@ void membuf_close(struct membuf *buf) {
   if (buf->fd >= 0)
     _close(buf->fd);
 
-  free(buf->ptr);
+  ReleaseSegments(buf->first_segment);
+  ReleaseBlock(buf->ptr, buf->capacity);
   free(buf);
 }
+
+void membuf_release_thread_cache(void) {
+  while (cached_blocks != NULL) {
+    CachedBlock *next = cached_blocks->next;
+    free(cached_blocks);
+    cached_blocks = next;
+  }
+  cached_block_count = 0;
+}
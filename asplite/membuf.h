@@ -25,6 +25,20 @@
 
 #include <stdlib.h>
 
+// A segment of a segmented buffer, the data follows the header.
+struct membuf_segment {
+  struct membuf_segment *next;
+  size_t size;
+  size_t capacity;
+};
+
+// A growable buffer, optionally backed by a file. Capacity grows
+// geometrically, and memory of closed buffers is kept in a small per-thread
+// cache for the next buffers created on the same thread.
+//
+// A segmented buffer appends to a chain of segments instead, so bytes once
+// appended never move. Its |ptr| is NULL and |size| is the total size;
+// the content is read with membuf_first_segment.
 struct membuf {
   int fd;
   int read;
@@ -32,6 +46,9 @@ struct membuf {
   void *ptr;
   size_t capacity;
   size_t size;
+  size_t segment_size;  // Non-zero for segmented buffers
+  struct membuf_segment *first_segment;
+  struct membuf_segment *last_segment;
 };
 
 #define membuf_begin(b) ((b)->ptr)
@@ -39,6 +56,9 @@ struct membuf {
 #define membuf_size(b) ((b)->size)
 #define membuf_capacity(b) ((b)->capacity)
 #define membuf_ptr(b) membuf_end((b))
+#define membuf_is_segmented(b) ((b)->segment_size != 0)
+#define membuf_first_segment(b) ((b)->first_segment)
+#define membuf_segment_data(s) ((void *)((s) + 1))
 
 // dangerous without assert(s < capacity).
 //#define membuf_set_size(b, s)  ((b)->size = (s))
@@ -48,12 +68,17 @@ extern "C" {
 #endif  // __cplusplus
 
 struct membuf *membuf_create(size_t capacity, int fd, int read, int write);
+struct membuf *membuf_create_segmented(size_t segment_size);
 int membuf_commit(struct membuf *buf);
 int membuf_ensure(struct membuf *buf, size_t new_size);
 int membuf_ensure_extra(struct membuf *buf, size_t size);
 int membuf_append(struct membuf *buf, const void *data, size_t length);
+void membuf_clear(struct membuf *buf);
 void membuf_close(struct membuf *buf);
 
+// Frees memory cached by the calling thread.
+void membuf_release_thread_cache(void);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
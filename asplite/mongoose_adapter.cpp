@@ -22,15 +22,28 @@
 
 #include "asplite/mongoose_adapter.h"
 
+#include <assert.h>
 #include <direct.h>
+#include <stdio.h>
 #include <ctime>
 #include <string>
 #include <vector>
 
 #include "asplite/http_post_parser.h"
+#include "asplite/lua_allocator.h"
+#include "asplite/membuf.h"
+#include "asplite/thread_local.h"
 
 namespace {
 
+const size_t kRequestArenaInitialSize = 64 * 1024;
+
+const int kMaxWriteBuffers = 8;
+
+// Each mongoose worker thread serves one request at a time,
+// so it owns a single arena that is reset after each request.
+ASPLITE_THREAD_LOCAL RequestArena *worker_arena = NULL;
+
 AspliteMongooseAdapter *DefaultGetter(void *user_data) {
   return reinterpret_cast<AspliteMongooseAdapter *>(user_data);
 }
@@ -41,20 +54,20 @@ class MongooseHttpServerAdapter : public IHttpServerAdapter {
 public:
   MongooseHttpServerAdapter(struct mg_connection *conn) : conn_(conn) {}
 
-  std::string MapPath(const std::string &uri) override {
+  ArenaString MapPath(const char *uri) override {
     // TODO: Make it more versatile
     char buffer[4096];
-    mg_map_path(conn_, uri.c_str(), 0, buffer, sizeof(buffer));
-    return std::string(buffer);
+    mg_map_path(conn_, uri, 0, buffer, sizeof(buffer));
+    return ArenaString(buffer);
   }
 
-  std::string UriToFile(const std::string &uri) override {
+  ArenaString UriToFile(const char *uri) override {
     // TODO: Make it more versatile
     char buffer[4096];
-    if (mg_map_path(conn_, uri.c_str(), 1, buffer, sizeof(buffer)) == 0)
-      return std::string(buffer);
+    if (mg_map_path(conn_, uri, 1, buffer, sizeof(buffer)) == 0)
+      return ArenaString(buffer);
     else
-      return std::string();
+      return ArenaString();
   }
 
   void OnError(const char *text) override {
@@ -72,38 +85,45 @@ private:
 class MongooseHttpRequestAdapter : public IHttpRequestAdapter {
 public:
   MongooseHttpRequestAdapter(struct mg_connection *conn)
-      : conn_(conn), request_info_(mg_get_request_info(conn)) {
+      : conn_(conn),
+        request_info_(mg_get_request_info(conn)),
+        cookies_(mg_get_header(conn, "Cookie")) {
+    headers_.reserve(request_info_->num_headers);
     for (int i = 0; i < request_info_->num_headers; i++) {
       const char *name = request_info_->http_headers[i].name;
       const char *value = request_info_->http_headers[i].value;
       headers_.push_back(HttpHeader(name, value));
     }
 
-    SetQueryString();
+    // Query string is parsed when QueryString collection is first accessed.
+    if (request_info_->query_string != NULL)
+      query_string_.SetLoadCallback(
+          LoadQueryString, const_cast<char *>(request_info_->query_string));
   }
 
-  std::string GetUri() override { return std::string(request_info_->uri); }
+  const char *GetUri() override { return request_info_->uri; }
 
-  std::string GetQueryStringOld() override {
-    return std::string(request_info_->query_string ? request_info_->query_string
-                                                   : "");
+  const char *GetQueryStringOld() override {
+    return request_info_->query_string ? request_info_->query_string : "";
   }
 
-  std::string GetRequestMethod() override {
-    return std::string(request_info_->request_method);
+  const char *GetRequestMethod() override {
+    return request_info_->request_method;
   }
 
-  const std::vector<HttpHeader> &GetHeaders() const override {
-    return headers_;
+  const char *GetHttpVersion() override {
+    return request_info_->http_version;
   }
 
-  std::string GetHeader(const char *name) const override {
+  const HttpHeaderList &GetHeaders() const override { return headers_; }
+
+  const char *GetHeader(const char *name) const override {
     for (auto v = headers_.rbegin(); v != headers_.rend(); ++v) {
       if (v->name == name)
-        return v->value;
+        return v->value.c_str();
     }
 
-    return std::string();
+    return NULL;
   }
 
   NameValueCollection &GetQueryString() override { return query_string_; }
@@ -112,84 +132,19 @@ public:
 
   HttpFileCollection &GetFiles() override { return files_; }
 
+  HttpCookieCollection &GetCookies() override { return cookies_; }
+
   int Read(void *buffer, size_t buffer_size) override {
     return mg_read(conn_, buffer, buffer_size);
   }
 
-  static void UrlDecode(const char *src,
-                        int src_len,
-                        bool is_form_url_encoded,
-                        std::string *decoded) {
-#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
-    for (int i = 0; i < src_len; i++) {
-      if (src[i] == '%' && i < src_len - 2 &&
-          isxdigit(*(const unsigned char *)(src + i + 1)) &&
-          isxdigit(*(const unsigned char *)(src + i + 2))) {
-        int a = tolower(*(const unsigned char *)(src + i + 1));
-        int b = tolower(*(const unsigned char *)(src + i + 2));
-        decoded->append(1, (char)((HEXTOI(a) << 4) | HEXTOI(b)));
-        i += 2;
-      } else if (is_form_url_encoded && src[i] == '+') {
-        decoded->append(1, ' ');
-      } else {
-        decoded->append(1, src[i]);
-      }
-    }
-
-#undef HEXTOI
+  static void LoadQueryString(NameValueCollection *collection,
+                              void *user_data) {
+    const char *query_string = reinterpret_cast<const char *>(user_data);
+    ParseQueryString(query_string, collection);
   }
 
-  void SetQueryString() {
-    const char *query_string = request_info_->query_string;
-    if (query_string == NULL)
-      return;
-
-    const char *p = query_string;
-
-    while (*p != '\0') {
-      const char *name = p;
-      int name_len = 0;
-      const char *value = p;
-      int value_len = 0;
-      const char *eq;
-      const char *amp;
-      int decoded_value_len = 0;
-
-      amp = strchr(name, '&');
-      if (amp == NULL) {
-        amp = name + strlen(name);
-      }
-
-      eq = strchr(name, '=');
-      if (eq != NULL && eq < amp) {
-        name_len = eq - name;
-        value = eq + 1;
-        value_len = amp - value;
-      } else {
-        // TODO: If '=' is missing, use nil instead of empty string for a value?
-        name_len = amp - name;
-        value = amp;
-        value_len = 0;
-      }
-
-      std::string decoded_value;
-      if (value_len > 0) {
-        decoded_value.reserve(value_len);
-        UrlDecode(value, value_len, false, &decoded_value);
-      } else {
-        decoded_value.clear();
-      }
-
-      query_string_.Add(std::string(name, name_len), decoded_value);
-
-      if (*amp == '&')
-        amp++;
-
-      p = amp;
-    }
-  }
-
-  void SetFormData(const std::vector<FormItem> &form_items) {
+  void SetFormData(const FormItemList &form_items) {
     for (auto iter = form_items.begin(); iter != form_items.end(); ++iter) {
       if (iter->is_file)
         files_.Add(
@@ -205,10 +160,11 @@ public:
 private:
   struct mg_connection *conn_;
   struct mg_request_info *request_info_;
-  std::vector<HttpHeader> headers_;
+  HttpHeaderList headers_;
   NameValueCollection query_string_;
   NameValueCollection form_;
   HttpFileCollection files_;
+  HttpCookieCollection cookies_;
 };
 
 class MongooseHttpResponseAdapter : public IHttpResponseAdapter {
@@ -216,29 +172,57 @@ public:
   MongooseHttpResponseAdapter(struct mg_connection *conn) : conn_(conn) {}
 
   void Write(const char *data, size_t len) override {
-    mg_write(conn_, data, len);
+    int written = mg_write(conn_, data, len);
+    if (written > 0)
+      mg_add_bytes_sent(conn_, written);
+  }
+
+  void Write(const char *text) override { Write(text, strlen(text)); }
+
+  void Write(const HttpBuffer *buffers, int count) override {
+    struct mg_iovec iov[kMaxWriteBuffers];
+    assert(count <= kMaxWriteBuffers);
+
+    for (int i = 0; i < count; ++i) {
+      iov[i].buf = buffers[i].data;
+      iov[i].len = buffers[i].length;
+    }
+
+    int written = mg_writev(conn_, iov, count);
+    if (written > 0)
+      mg_add_bytes_sent(conn_, written);
+  }
+
+  bool BeginResponse(int status_code, bool can_keep_alive) override {
+    return mg_begin_reply(conn_, status_code, can_keep_alive ? 1 : 0) != 0;
   }
 
-  void Write(const char *text) override { mg_write(conn_, text, strlen(text)); }
+  int64_t TransmitFile(const char *path,
+                       int64_t offset,
+                       int64_t length) override {
+    return mg_send_file_range(conn_, path, offset, length);
+  }
 
-  void Respond405(const std::string &allow, const std::string &extra) override {
+  void Respond405(const char *allow, const char *extra) override {
+    mg_begin_reply(conn_, 405, 1);
     mg_printf(conn_,
               "HTTP/1.1 405 Method Not Allowed\r\n"
               "Content-Length: %d\r\n"
               "Allow: %s\r\n\r\n"
               "%s",
-              extra.length(),
-              allow.c_str(),
-              extra.c_str());
+              (int)strlen(extra),
+              allow,
+              extra);
   }
 
-  void Respond415(const std::string &content_type) override {
+  void Respond415(const char *content_type) override {
+    static const char kFormat[] = "Content type %s not allowed";
+    mg_begin_reply(conn_, 415, 0);
     mg_printf(conn_,
               "HTTP/1.1 415 Unsupported Media Type\r\n"
-              "Content-Length: %d\r\n"
-              "Content type: %s not allowed",
-              content_type.length(),
-              content_type.c_str());
+              "Content-Length: %d\r\n\r\n",
+              (int)(strlen(content_type) + sizeof(kFormat) - 3));
+    mg_printf(conn_, kFormat, content_type);
   }
 
 private:
@@ -246,8 +230,8 @@ private:
 };
 
 static bool CreateRequestUploadDirectory(const std::string &upload_dir,
-                                         std::string *request_dir) {
-  std::string new_path(upload_dir);
+                                         ArenaString *request_dir) {
+  ArenaString new_path(upload_dir.data(), upload_dir.length());
 
   if (new_path.length() > 0) {
     if (*(new_path.end() - 1) == '\\')
@@ -266,7 +250,7 @@ static bool CreateRequestUploadDirectory(const std::string &upload_dir,
     char unique_name[64];
     sprintf(unique_name, "%012d", rand() % INT_MAX);
 
-    std::string new_dir_name(new_path);
+    ArenaString new_dir_name(new_path);
     new_dir_name.append(unique_name);
 
     if (mkdir(new_dir_name.c_str()) == 0) {
@@ -278,15 +262,54 @@ static bool CreateRequestUploadDirectory(const std::string &upload_dir,
   return false;
 }
 
-static bool IsEndWith(const std::string &str, const std::string &suffix) {
-  if (str.length() < suffix.length())
+static bool IsEndWith(const ArenaString &str, const char *suffix) {
+  size_t suffix_length = strlen(suffix);
+  if (str.length() < suffix_length)
     return false;
 
-  return str.compare(str.length() - suffix.length(), suffix.length(), suffix) ==
-         0;
+  return str.compare(str.length() - suffix_length, suffix_length, suffix) == 0;
 }
 
 int AspliteMongooseAdapter::RequestHandler(struct mg_connection *conn) {
+  if (worker_arena == NULL)
+    worker_arena = new RequestArena(kRequestArenaInitialSize);
+
+  int result;
+  {
+    // All request scoped objects must be gone when the scope is left.
+    RequestArenaScope arena_scope(worker_arena);
+    result = ProcessRequest(conn);
+  }
+
+  struct mg_request_info *request_info = mg_get_request_info(conn);
+  AspliteMongooseAdapter *adapter = DefaultGetter(request_info->user_data);
+  if (result != 0 && adapter->config_.trace_memory) {
+    // Once the arena has grown to fit the requests, it serves them
+    // without heap allocations.
+    const RequestArena::Statistics &stats = worker_arena->GetStatistics();
+    fprintf(stderr,
+            "asplite: %s: request arena: %u allocations, %u bytes, "
+            "%u heap allocations\n",
+            request_info->uri,
+            (unsigned)stats.allocation_count,
+            (unsigned)stats.allocated_bytes,
+            (unsigned)stats.heap_allocation_count);
+  }
+
+  worker_arena->Reset();
+  return result;
+}
+
+void AspliteMongooseAdapter::WorkerThreadStop(struct mg_connection *conn,
+                                              void *user_data) {
+  delete worker_arena;
+  worker_arena = NULL;
+
+  LuaStateAllocator::ReleaseThreadCache();
+  membuf_release_thread_cache();
+}
+
+int AspliteMongooseAdapter::ProcessRequest(struct mg_connection *conn) {
   struct mg_request_info *request_info = mg_get_request_info(conn);
   AspliteMongooseAdapter *adapter = DefaultGetter(request_info->user_data);
 
@@ -294,7 +317,7 @@ int AspliteMongooseAdapter::RequestHandler(struct mg_connection *conn) {
   MongooseHttpResponseAdapter response_adapter(conn);
   MongooseHttpServerAdapter server_adapter(conn);
 
-  std::string asp_path = server_adapter.UriToFile(request_adapter.GetUri());
+  ArenaString asp_path = server_adapter.UriToFile(request_adapter.GetUri());
   if (asp_path.empty()) {
     // File not found
     return 0;
@@ -305,10 +328,12 @@ int AspliteMongooseAdapter::RequestHandler(struct mg_connection *conn) {
     return 0;
   }
 
-  std::vector<FormItem> form_items;
-  std::string request_upload_directory;
+  FormItemList form_items;
+  ArenaString request_upload_directory;
+  OutputCache *output_cache = NULL;
+  time_t page_time = 0;
 
-  if (request_adapter.GetRequestMethod() == "POST") {
+  if (strcmp(request_adapter.GetRequestMethod(), "POST") == 0) {
     // TODO: Do not parse the body because the page code
     // may be interested in special handling of entity.
     // Instead provide asplite.ParseRequestBody method and
@@ -322,30 +347,65 @@ int AspliteMongooseAdapter::RequestHandler(struct mg_connection *conn) {
     CreateRequestUploadDirectory(adapter->config_.upload_directory,
                                  &request_upload_directory);
 
-    ProcessPostRequest(&request_adapter,
-                       &response_adapter,
-                       request_upload_directory,
-                       &form_items);
+    if (!ProcessPostRequest(&request_adapter,
+                            &response_adapter,
+                            request_upload_directory,
+                            &form_items)) {
+      if (!request_upload_directory.empty())
+        rmdir(request_upload_directory.c_str());
+      return 1;
+    }
 
     request_adapter.SetFormData(form_items);
-  } else if (request_adapter.GetRequestMethod() == "GET") {
-    ;  // default
+  } else if (strcmp(request_adapter.GetRequestMethod(), "GET") == 0) {
+    // Only responses to GET requests are cached. A cached response is
+    // sent without creating a Lua state.
+    if (OutputCache::GetPageTime(asp_path, &page_time)) {
+      output_cache = &adapter->output_cache_;
+      if (output_cache->Serve(
+              asp_path, page_time, &request_adapter, &response_adapter))
+        return 1;
+    }
   } else {
     response_adapter.Respond405("GET, POST", "");
+    return 1;
   }
 
-  lua_State *L = luaL_newstate();
+  LuaStateAllocator lua_allocator;
+  lua_State *L = lua_allocator.NewState();
 
   struct AspPageContext context;
   context.config = &adapter->config_;
   context.server = &server_adapter;
   context.request = &request_adapter;
   context.response = &response_adapter;
+  context.output_cache = output_cache;
+  context.page_time = page_time;
+  context.application = &adapter->application_;
+  context.cache = &adapter->cache_;
+  context.session_store = &adapter->session_store_;
+  context.luac_pack =
+      adapter->luac_pack_open_ ? &adapter->luac_pack_ : NULL;
 
   ExeciteAspPage(L, asp_path, context);
 
   lua_close(L);
 
+  if (adapter->config_.trace_memory) {
+    // Anything still in use after lua_close would be a leak.
+    const LuaStateAllocator::Statistics &stats =
+        lua_allocator.GetStatistics();
+    fprintf(stderr,
+            "asplite: %s: lua state: %u bytes peak, %u bytes in use, "
+            "%u small and %u large allocations, %u slabs\n",
+            request_info->uri,
+            (unsigned)stats.peak_bytes_in_use,
+            (unsigned)stats.bytes_in_use,
+            (unsigned)stats.small_allocation_count,
+            (unsigned)stats.large_allocation_count,
+            (unsigned)stats.slab_count);
+  }
+
   if (!request_upload_directory.empty()) {
     for (auto iter = form_items.begin(); iter != form_items.end(); ++iter) {
       if (iter->is_file)
@@ -360,5 +420,18 @@ int AspliteMongooseAdapter::RequestHandler(struct mg_connection *conn) {
 
 bool AspliteMongooseAdapter::Init(const AspliteConfig &config) {
   config_ = config;
+  cache_.set_memory_limit(config.cache_memory_limit);
+  output_cache_.set_memory_limit(config.output_cache_memory_limit);
+  session_store_.Start(config.session_timeout * 60,
+                       config.session_memory_limit);
+
+  // Pages fall back to .luac files if the pack cannot be opened.
+  luac_pack_open_ = false;
+  if (config.cache_luac && config.luac_pack &&
+      !config.cache_directory.empty()) {
+    mkdir(config.cache_directory.c_str());
+    luac_pack_open_ = luac_pack_.Open(config.cache_directory + "/luac.pack");
+  }
+
   return true;
 }
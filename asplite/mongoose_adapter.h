@@ -24,6 +24,10 @@
 #define ASPLITE_MONGOOSE_ADAPTER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
 
 #include "asplite/asplite.h"
+#include "asplite/bytecode_pack.h"
+#include "asplite/output_cache.h"
+#include "asplite/session_store.h"
+#include "asplite/shared_cache.h"
 #include "mongoose/mongoose.h"
 
 class AspliteMongooseAdapter;
@@ -31,11 +35,20 @@ class AspliteMongooseAdapter;
 class AspliteMongooseAdapter {
 public:
   static int RequestHandler(struct mg_connection *conn);
+  static void WorkerThreadStop(struct mg_connection *conn, void *user_data);
 
   bool Init(const AspliteConfig &config);
 
 private:
+  static int ProcessRequest(struct mg_connection *conn);
+
   AspliteConfig config_;
+  OutputCache output_cache_;
+  SharedCache application_;
+  SharedCache cache_;
+  SessionStore session_store_;
+  BytecodePack luac_pack_;
+  bool luac_pack_open_;
 };
 
 #endif  // ASPLITE_MONGOOSE_ADAPTER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
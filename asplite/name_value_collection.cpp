@@ -22,9 +22,21 @@
 
 #include "asplite/name_value_collection.h"
 
+#include <ctype.h>
+
 #include <string>
 
+void NameValueCollection::Load() {
+  LoadCallback callback = load_callback_;
+
+  // Reset first, so the callback may use the public interface.
+  load_callback_ = NULL;
+  callback(this, load_user_data_);
+}
+
 bool NameValueCollection::Add(const key_type &name, const value_type &value) {
+  EnsureLoaded();
+
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter == keys_.end()) {
     keys_[name] = values_.size();
@@ -39,6 +51,8 @@ bool NameValueCollection::Add(const key_type &name, const value_type &value) {
 }
 
 bool NameValueCollection::Get(size_t index, value_type *value) const {
+  EnsureLoaded();
+
   if (index >= values_.size())
     return false;
 
@@ -56,6 +70,8 @@ bool NameValueCollection::Get(size_t index, value_type *value) const {
 }
 
 bool NameValueCollection::Get(const key_type &name, value_type *value) const {
+  EnsureLoaded();
+
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter != keys_.end())
     return Get(iter->second, value);
@@ -64,6 +80,8 @@ bool NameValueCollection::Get(const key_type &name, value_type *value) const {
 }
 
 bool NameValueCollection::GetKey(size_t index, key_type *key) const {
+  EnsureLoaded();
+
   if (index >= values_.size())
     return false;
 
@@ -73,6 +91,8 @@ bool NameValueCollection::GetKey(size_t index, key_type *key) const {
 
 bool NameValueCollection::GetValues(size_t index,
                                     const value_list_type **value) const {
+  EnsureLoaded();
+
   if (index >= values_.size())
     return false;
 
@@ -82,6 +102,8 @@ bool NameValueCollection::GetValues(size_t index,
 
 bool NameValueCollection::GetValues(const key_type &name,
                                     const value_list_type **values) const {
+  EnsureLoaded();
+
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter == keys_.end())
     return false;
@@ -90,6 +112,8 @@ bool NameValueCollection::GetValues(const key_type &name,
 }
 
 NameValueCollection::value_list_type NameValueCollection::AllKeys() const {
+  EnsureLoaded();
+
   value_list_type keys;
   for (key_map_type::const_iterator iter = keys_.begin(); iter != keys_.end();
        ++iter) {
@@ -99,6 +123,8 @@ NameValueCollection::value_list_type NameValueCollection::AllKeys() const {
 }
 
 bool NameValueCollection::Set(const key_type &name, const value_type &value) {
+  EnsureLoaded();
+
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter == keys_.end()) {
     keys_[name] = values_.size();
@@ -114,6 +140,8 @@ bool NameValueCollection::Set(const key_type &name, const value_type &value) {
 }
 
 bool NameValueCollection::Remove(const key_type &name) {
+  EnsureLoaded();
+
   key_map_type::const_iterator iter = keys_.find(name);
   if (iter == keys_.end())
     return false;
@@ -124,11 +152,11 @@ bool NameValueCollection::Remove(const key_type &name) {
 }
 
 // TODO: Add CreateXWwwFormString
-std::string CreateQueryString(const NameValueCollection &coll) {
-  std::string query_string;
+ArenaString CreateQueryString(const NameValueCollection &coll) {
+  ArenaString query_string;
 
   for (size_t i = 0; i < coll.GetCount(); i++) {
-    std::string key;
+    NameValueCollection::key_type key;
 
     if (!coll.GetKey(i, &key))
       continue;
@@ -151,9 +179,9 @@ std::string CreateQueryString(const NameValueCollection &coll) {
            ++iter) {
         // TODO: mitigate null keys/values
         // TODO: URL encode values.
-        query_string += key;
+        query_string.append(key.data(), key.length());
         query_string += '=';
-        query_string += *iter;
+        query_string.append(iter->data(), iter->length());
         if (iter != items->end() - 1)
           query_string += '&';
       }
@@ -164,3 +192,56 @@ std::string CreateQueryString(const NameValueCollection &coll) {
   }
   return query_string;
 }
+
+void ParseQueryString(const char *query_string, NameValueCollection *coll) {
+  NameValueCollection::key_type name;
+  NameValueCollection::value_type value;
+  const char *p = query_string;
+
+  while (*p != '\0') {
+    const char *name_begin = p;
+    const char *eq = NULL;
+
+    // Find the end of the pair and the first '=' within it.
+    while (*p != '\0' && *p != '&') {
+      if (*p == '=' && eq == NULL)
+        eq = p;
+      p++;
+    }
+
+    // TODO: If '=' is missing, use nil instead of empty string for a value?
+    const char *name_end = eq != NULL ? eq : p;
+    name.assign(name_begin, name_end - name_begin);
+
+    value.clear();
+    if (eq != NULL && p > eq + 1)
+      UrlDecode(eq + 1, p - (eq + 1), false, &value);
+
+    coll->Add(name, value);
+
+    if (*p == '&')
+      p++;
+  }
+}
+
+void UrlDecode(const char *src,
+               size_t src_len,
+               bool is_form_url_encoded,
+               ArenaString *decoded) {
+#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+  for (size_t i = 0; i < src_len; i++) {
+    if (src[i] == '%' && i + 2 < src_len &&
+        isxdigit(*(const unsigned char *)(src + i + 1)) &&
+        isxdigit(*(const unsigned char *)(src + i + 2))) {
+      int a = tolower(*(const unsigned char *)(src + i + 1));
+      int b = tolower(*(const unsigned char *)(src + i + 2));
+      decoded->append(1, (char)((HEXTOI(a) << 4) | HEXTOI(b)));
+      i += 2;
+    } else if (is_form_url_encoded && src[i] == '+') {
+      decoded->append(1, ' ');
+    } else {
+      decoded->append(1, src[i]);
+    }
+  }
+#undef HEXTOI
+}
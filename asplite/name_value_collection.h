@@ -27,14 +27,31 @@
 #include <string>
 #include <vector>
 
+#include "asplite/request_arena.h"
+
 class NameValueCollection {
 public:
-  typedef std::string key_type;
-  typedef std::string value_type;
-  typedef std::vector<key_type> key_list_type;
-  typedef std::vector<value_type> value_list_type;
+  typedef ArenaString key_type;
+  typedef ArenaString value_type;
+  typedef std::vector<key_type, ArenaAllocator<key_type> > key_list_type;
+  typedef std::vector<value_type, ArenaAllocator<value_type> > value_list_type;
+
+  // Called once to populate the collection on its first access.
+  typedef void (*LoadCallback)(NameValueCollection *collection,
+                               void *user_data);
+
+  NameValueCollection() : load_callback_(NULL), load_user_data_(NULL) {}
 
-  size_t GetCount() const { return values_.size(); }
+  // Defers populating the collection until it is accessed.
+  void SetLoadCallback(LoadCallback callback, void *user_data) {
+    load_callback_ = callback;
+    load_user_data_ = user_data;
+  }
+
+  size_t GetCount() const {
+    EnsureLoaded();
+    return values_.size();
+  }
 
   bool Add(const key_type &name, const value_type &value);
   bool Get(size_t index, value_type *value) const;
@@ -44,6 +61,7 @@ public:
   bool GetValues(const key_type &name, const value_list_type **values) const;
 
   void Clear() {
+    load_callback_ = NULL;
     keys_.clear();
     values_.clear();
   }
@@ -54,11 +72,25 @@ public:
 
 private:
   typedef std::pair<key_type, value_list_type> pair_type;
-  typedef std::vector<pair_type> pair_list_type;
-  typedef std::map<key_type, typename pair_list_type::size_type> key_map_type;
+  typedef std::vector<pair_type, ArenaAllocator<pair_type> > pair_list_type;
+  typedef std::map<key_type,
+                   typename pair_list_type::size_type,
+                   std::less<key_type>,
+                   ArenaAllocator<std::pair<const key_type,
+                                            pair_list_type::size_type> > >
+      key_map_type;
+
+  void EnsureLoaded() const {
+    if (load_callback_ != NULL)
+      const_cast<NameValueCollection *>(this)->Load();
+  }
+
+  void Load();
 
   key_map_type keys_;
   pair_list_type values_;
+  LoadCallback load_callback_;
+  void *load_user_data_;
 };
 
 // http://www.whatwg.org/specs/web-apps/current-work/
@@ -66,6 +98,16 @@ private:
 // #application/x-www-form-urlencoded-encoding-algorithm
 
 // TODO: Add CreateXWwwFormString
-std::string CreateQueryString(const NameValueCollection &coll);
+ArenaString CreateQueryString(const NameValueCollection &coll);
+
+// Adds name/value pairs of |query_string| to |coll| in a single pass.
+void ParseQueryString(const char *query_string, NameValueCollection *coll);
+
+// Appends URL-decoded |src| to |decoded|.
+// If |is_form_url_encoded| is set, '+' is decoded as a space.
+void UrlDecode(const char *src,
+               size_t src_len,
+               bool is_form_url_encoded,
+               ArenaString *decoded);
 
 #endif  // ASPLITE_NAME_VALUE_COLLECTION_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
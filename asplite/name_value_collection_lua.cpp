@@ -62,14 +62,14 @@ int name_value_collection_Get(lua_State *L) {
   // TODO: permit nil
   if (lua_type(L, 1) == LUA_TNUMBER) {
     lua_Unsigned index = luaL_checkunsigned(L, 1);
-    std::string value;
+    NameValueCollection::value_type value;
     if (collection->Get(index, &value))
       lua_pushlstring(L, value.data(), value.length());
     else
       lua_pushnil(L);
   } else {
     const char *name = luaL_checkstring(L, 1);
-    std::string value;
+    NameValueCollection::value_type value;
     if (collection->Get(name, &value))
       lua_pushlstring(L, value.data(), value.length());
     else
@@ -81,7 +81,7 @@ int name_value_collection_Get(lua_State *L) {
 int name_value_collection_GetKey(lua_State *L) {
   NameValueCollection *collection = GetCollection(L, lua_upvalueindex(1));
   lua_Unsigned index = luaL_checkunsigned(L, 1);
-  std::string key;
+  NameValueCollection::key_type key;
   if (collection->GetKey(index, &key))
     lua_pushlstring(L, key.data(), key.length());
   else
@@ -196,7 +196,7 @@ int CreateNameValueCollection(lua_State *L, NameValueCollection *collection) {
 
 int QueryString___tostring(lua_State *L) {
   NameValueCollection *collection = GetCollection(L, lua_upvalueindex(1));
-  std::string query_string = CreateQueryString(*collection);
+  ArenaString query_string = CreateQueryString(*collection);
   lua_pushlstring(L, query_string.data(), query_string.length());
   return 1;
 }
@@ -0,0 +1,342 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/output_cache.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "asplite/response_writer.h"
+
+namespace {
+
+// Larger responses are not cached.
+const size_t kMaxCachedResponseSize = 1024 * 1024;
+
+// Limits the number of variants kept for a page with VaryByParam or
+// VaryByHeader, since the values come from the client.
+const size_t kMaxVariantsPerPage = 256;
+
+// Rough cost of the map nodes and the response object, added to the sizes
+// of the key and the response when the memory use is accounted.
+const size_t kResponseOverhead = 128;
+
+bool EqualStrings(const std::string &a, const ArenaString &b) {
+  return a.length() == b.length() &&
+         memcmp(a.data(), b.data(), a.length()) == 0;
+}
+
+// Extracts the next name from a list of names separated by ';'.
+// Returns false if there are no more names.
+bool NextListItem(const char **list, const char **item, size_t *length) {
+  const char *p = *list;
+  while (*p == ';' || isspace((unsigned char)*p))
+    ++p;
+
+  if (*p == '\0')
+    return false;
+
+  const char *begin = p;
+  while (*p != '\0' && *p != ';')
+    ++p;
+
+  const char *end = p;
+  while (end > begin && isspace((unsigned char)end[-1]))
+    --end;
+
+  *item = begin;
+  *length = end - begin;
+  *list = p;
+  return true;
+}
+
+bool IsNone(const char *name, size_t length) {
+  return length == 4 && tolower((unsigned char)name[0]) == 'n' &&
+         tolower((unsigned char)name[1]) == 'o' &&
+         tolower((unsigned char)name[2]) == 'n' &&
+         tolower((unsigned char)name[3]) == 'e';
+}
+
+// Appends |value| prefixed with its length, so that different lists of
+// values cannot produce the same key.
+void AppendKeyPart(const char *value, size_t length, std::string *key) {
+  char prefix[24];
+  key->append(prefix, sprintf(prefix, "%u:", (unsigned)length));
+  key->append(value, length);
+}
+
+// Builds the key of a page variant from the query string parameters listed
+// in |vary_by_param|, or the whole query string if it is "*", and from the
+// request headers listed in |vary_by_header|.
+void BuildVaryKey(IHttpRequestAdapter *request,
+                  const std::string &vary_by_param,
+                  const std::string &vary_by_header,
+                  std::string *key) {
+  const char *list;
+  const char *name;
+  size_t length;
+
+  key->clear();
+
+  if (vary_by_param == "*") {
+    const char *query_string = request->GetQueryStringOld();
+    AppendKeyPart(query_string, strlen(query_string), key);
+  } else {
+    list = vary_by_param.c_str();
+    while (NextListItem(&list, &name, &length)) {
+      if (IsNone(name, length))
+        continue;
+
+      const NameValueCollection::value_list_type *values;
+      if (!request->GetQueryString().GetValues(
+              NameValueCollection::key_type(name, length), &values)) {
+        key->append("-", 1);
+        continue;
+      }
+
+      key->append("#", 1);
+      for (size_t i = 0; i < values->size(); ++i)
+        AppendKeyPart((*values)[i].data(), (*values)[i].length(), key);
+    }
+  }
+
+  key->append("|", 1);
+
+  list = vary_by_header.c_str();
+  while (NextListItem(&list, &name, &length)) {
+    if (IsNone(name, length))
+      continue;
+
+    std::string header(name, length);
+    const char *value = request->GetHeader(header.c_str());
+    if (value != NULL)
+      AppendKeyPart(value, strlen(value), key);
+    else
+      key->append("-", 1);
+  }
+}
+
+}  // namespace
+
+bool OutputCache::GetPageTime(const ArenaString &asp_path, time_t *mtime) {
+  struct stat st;
+  if (stat(asp_path.c_str(), &st) != 0)
+    return false;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+bool OutputCache::Serve(const ArenaString &asp_path,
+                        time_t mtime,
+                        IHttpRequestAdapter *request,
+                        IHttpResponseAdapter *response) {
+  std::string path(asp_path.data(), asp_path.length());
+  Shard &shard = GetShard(path);
+  std::shared_ptr<const DependencyList> dependencies;
+  std::shared_ptr<const CachedResponse> cached;
+
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    PageMap::iterator page = shard.pages.find(path);
+    if (page == shard.pages.end())
+      return false;
+
+    if (page->second.mtime != mtime) {
+      // The page has been modified and is about to be recompiled.
+      shard.pages.erase(page);
+      return false;
+    }
+
+    std::string key;
+    BuildVaryKey(request,
+                 page->second.vary_by_param,
+                 page->second.vary_by_header,
+                 &key);
+
+    VariantMap::iterator variant = page->second.variants.find(key);
+    if (variant == page->second.variants.end())
+      return false;
+
+    if (variant->second->expires <= time(NULL)) {
+      page->second.variants.erase(variant);
+      return false;
+    }
+
+    dependencies = page->second.dependencies;
+    cached = variant->second;
+  }
+
+  // The included files are checked outside of the lock as well.
+  if (dependencies && !AreDependenciesCurrent(*dependencies)) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    PageMap::iterator page = shard.pages.find(path);
+    if (page != shard.pages.end() &&
+        page->second.dependencies == dependencies)
+      shard.pages.erase(page);
+    return false;
+  }
+
+  // The response is sent outside of the lock; the entry stays alive
+  // until then even if it gets replaced.
+  HttpResponseWriter writer(request, response);
+  writer.SendCachedResponse(cached->head.data(),
+                            cached->head.length(),
+                            cached->body.data(),
+                            cached->body.length());
+  return true;
+}
+
+void OutputCache::Store(const ArenaString &asp_path,
+                        time_t mtime,
+                        const ArenaString &dependencies,
+                        IHttpRequestAdapter *request,
+                        const OutputCachePolicy &policy,
+                        const ArenaString &head,
+                        const ArenaString &body) {
+  if (policy.duration <= 0 || body.length() > kMaxCachedResponseSize)
+    return;
+
+  std::shared_ptr<DependencyList> dependency_list;
+  if (!dependencies.empty()) {
+    dependency_list.reset(new DependencyList);
+    if (!GetDependencyTimes(dependencies, dependency_list.get()))
+      return;
+  }
+
+  time_t now = time(NULL);
+  std::shared_ptr<CachedResponse> cached(new CachedResponse(&bytes_));
+  cached->expires = now + policy.duration;
+  cached->head.assign(head.data(), head.length());
+  cached->body.assign(body.data(), body.length());
+
+  std::string path(asp_path.data(), asp_path.length());
+  Shard &shard = GetShard(path);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  CachedPage &page = shard.pages[path];
+  bool same_dependencies =
+      page.dependencies && dependency_list
+          ? *page.dependencies == *dependency_list
+          : page.dependencies == dependency_list;
+  if (page.mtime != mtime || !same_dependencies ||
+      !EqualStrings(page.vary_by_param, policy.vary_by_param) ||
+      !EqualStrings(page.vary_by_header, policy.vary_by_header)) {
+    page.mtime = mtime;
+    page.dependencies = dependency_list;
+    page.vary_by_param.assign(policy.vary_by_param.data(),
+                              policy.vary_by_param.length());
+    page.vary_by_header.assign(policy.vary_by_header.data(),
+                               policy.vary_by_header.length());
+    page.variants.clear();
+  }
+
+  std::string key;
+  BuildVaryKey(request, page.vary_by_param, page.vary_by_header, &key);
+
+  if (page.variants.size() >= kMaxVariantsPerPage &&
+      page.variants.find(key) == page.variants.end()) {
+    for (VariantMap::iterator iter = page.variants.begin();
+         iter != page.variants.end();) {
+      if (iter->second->expires <= now)
+        iter = page.variants.erase(iter);
+      else
+        ++iter;
+    }
+
+    if (page.variants.size() >= kMaxVariantsPerPage)
+      return;
+  }
+
+  size_t size = key.length() + cached->head.length() + cached->body.length() +
+                kResponseOverhead;
+  if (memory_limit_ != 0 && bytes_ + size > memory_limit_) {
+    RemoveExpired(&shard, now);
+    if (bytes_ + size > memory_limit_)
+      return;
+  }
+
+  cached->size = size;
+  bytes_ += size;
+  page.variants[key] = cached;
+}
+
+OutputCache::Shard &OutputCache::GetShard(const std::string &path) {
+  return shards_[std::hash<std::string>()(path) % kShardCount];
+}
+
+bool OutputCache::GetDependencyTimes(const ArenaString &dependencies,
+                                     DependencyList *list) {
+  const char *p = dependencies.data();
+  const char *end = p + dependencies.length();
+
+  // Each line has the hash of the file, a space and the path.
+  while (p < end) {
+    const char *line_end = (const char *)memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+
+    const char *path = (const char *)memchr(p, ' ', line_end - p);
+    if (path == NULL)
+      return false;
+
+    std::string file(path + 1, line_end - path - 1);
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+      return false;
+
+    list->push_back(DependencyList::value_type(file, st.st_mtime));
+    p = line_end + 1;
+  }
+
+  return true;
+}
+
+bool OutputCache::AreDependenciesCurrent(const DependencyList &list) {
+  for (size_t i = 0; i < list.size(); ++i) {
+    struct stat st;
+    if (stat(list[i].first.c_str(), &st) != 0 ||
+        st.st_mtime != list[i].second)
+      return false;
+  }
+
+  return true;
+}
+
+void OutputCache::RemoveExpired(Shard *shard, time_t now) {
+  for (PageMap::iterator page = shard->pages.begin();
+       page != shard->pages.end();
+       ++page) {
+    VariantMap &variants = page->second.variants;
+    for (VariantMap::iterator iter = variants.begin();
+         iter != variants.end();) {
+      if (iter->second->expires <= now)
+        iter = variants.erase(iter);
+      else
+        ++iter;
+    }
+  }
+}
@@ -0,0 +1,148 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_OUTPUT_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_OUTPUT_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+#include <time.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "asplite/asplite.h"
+
+// Caching parameters declared by the OutputCache directive of a page.
+struct OutputCachePolicy {
+  OutputCachePolicy() : duration(0) {}
+
+  int duration;  // In seconds, 0 if the page is not cached.
+  ArenaString vary_by_param;
+  ArenaString vary_by_header;
+};
+
+// Keeps complete responses of pages that declare an OutputCache directive,
+// so that they are served without running the page. A page has a variant
+// per combination of its VaryByParam query string values and VaryByHeader
+// request header values. Pages are spread over shards with a lock each.
+// All variants of a page are dropped when the modification time of the
+// page file or of a file it includes changes, that is when the page gets
+// recompiled. New responses are not cached while the cached ones exceed
+// the memory limit.
+class OutputCache {
+public:
+  OutputCache() : memory_limit_(0), bytes_(0) {}
+
+  // Limits the memory used by the cached responses to roughly |bytes|.
+  // 0 means no limit. Must be set before the cache is used.
+  void set_memory_limit(size_t bytes) { memory_limit_ = bytes; }
+
+  // Returns the modification time of |asp_path| in |mtime|, which is used
+  // as the version of the cached page.
+  static bool GetPageTime(const ArenaString &asp_path, time_t *mtime);
+
+  // Sends the cached response for a GET request of |asp_path|, whose file
+  // was modified at |mtime|. Returns false if there is no valid cached
+  // response.
+  bool Serve(const ArenaString &asp_path,
+             time_t mtime,
+             IHttpRequestAdapter *request,
+             IHttpResponseAdapter *response);
+
+  // Stores a response of |asp_path| compiled from the file version
+  // |mtime|. |dependencies| lists the files the page includes, one per
+  // line as in the bytecode cache. |head| is the status line with the
+  // headers that do not change between requests.
+  void Store(const ArenaString &asp_path,
+             time_t mtime,
+             const ArenaString &dependencies,
+             IHttpRequestAdapter *request,
+             const OutputCachePolicy &policy,
+             const ArenaString &head,
+             const ArenaString &body);
+
+private:
+  // The memory of a response is accounted in |bytes| while it is alive.
+  struct CachedResponse {
+    explicit CachedResponse(std::atomic<size_t> *bytes)
+        : bytes(bytes), size(0) {}
+    ~CachedResponse() { *bytes -= size; }
+
+    time_t expires;
+    std::string head;
+    std::string body;
+    std::atomic<size_t> *bytes;
+    size_t size;
+  };
+
+  // Included files with their modification times when the page was cached.
+  typedef std::vector<std::pair<std::string, time_t> > DependencyList;
+
+  typedef std::unordered_map<std::string,
+                             std::shared_ptr<const CachedResponse> >
+      VariantMap;
+
+  struct CachedPage {
+    CachedPage() : mtime(0) {}
+
+    time_t mtime;
+    std::shared_ptr<const DependencyList> dependencies;
+    std::string vary_by_param;
+    std::string vary_by_header;
+    VariantMap variants;
+  };
+
+  typedef std::unordered_map<std::string, CachedPage> PageMap;
+
+  struct Shard {
+    std::mutex mutex;
+    PageMap pages;
+  };
+
+  static const size_t kShardCount = 16;
+
+  OutputCache(const OutputCache &);
+  OutputCache &operator=(const OutputCache &);
+
+  Shard &GetShard(const std::string &path);
+
+  // Fills |list| with the files in |dependencies| and their modification
+  // times. Returns false if one of them cannot be found.
+  static bool GetDependencyTimes(const ArenaString &dependencies,
+                                 DependencyList *list);
+
+  static bool AreDependenciesCurrent(const DependencyList &list);
+
+  // Drops the expired responses of all pages in |shard|. The pages stay.
+  static void RemoveExpired(Shard *shard, time_t now);
+
+  size_t memory_limit_;
+  std::atomic<size_t> bytes_;
+  Shard shards_[kShardCount];
+};
+
+#endif  // ASPLITE_OUTPUT_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
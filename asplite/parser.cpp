@@ -23,7 +23,9 @@
 #include "asplite/parser.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Searches char c in range between |begin| and |end| exclusive.
 // The function updates new_lines with number of new lines encountered.
@@ -57,6 +59,59 @@ static const char *SearchCharacter(const char *begin,
   return NULL;
 }
 
+static const char *SkipSpaces(const char *p, const char *end) {
+  while (p < end && isspace((unsigned char)*p))
+    p++;
+  return p;
+}
+
+static int IsToken(const char *begin,
+                   const char *end,
+                   const char *token) {
+  size_t length = strlen(token);
+  size_t i;
+
+  if ((size_t)(end - begin) != length)
+    return 0;
+
+  for (i = 0; i < length; i++) {
+    if (tolower((unsigned char)begin[i]) != tolower((unsigned char)token[i]))
+      return 0;
+  }
+
+  return 1;
+}
+
+// Scans a name or an attribute name of a directive.
+static const char *ScanName(const char *p, const char *end) {
+  while (p < end && !isspace((unsigned char)*p) && *p != '=')
+    p++;
+  return p;
+}
+
+// Scans an attribute value at |p|, which can be quoted with either
+// double or single quotes. Returns the end of the value including the
+// closing quote, and the value itself in |value| and |value_end|.
+static const char *ScanValue(const char *p,
+                             const char *end,
+                             const char **value,
+                             const char **value_end) {
+  if (p < end && (*p == '\"' || *p == '\'')) {
+    char quote = *p++;
+    *value = p;
+    while (p < end && *p != quote)
+      p++;
+    *value_end = p;
+    return p < end ? p + 1 : p;
+  }
+
+  *value = p;
+  while (p < end && !isspace((unsigned char)*p))
+    p++;
+  *value_end = p;
+  return p;
+}
+
 static const char *TryParseChunk(const char *buffer,
                                  const char *current,
                                  const char *end,
@@ -137,6 +192,81 @@ static const char *TryParseChunk(const char *buffer,
   return NULL;
 }
 
+static size_t CountNewlines(const char *begin, const char *end) {
+  size_t count = 0;
+  for (; begin < end; begin++) {
+    if (*begin == '\n')
+      count++;
+  }
+  return count;
+}
+
+// Parses a code declaration block at |current| like
+//    <script runat="server"> function Helper() ... end </script>
+// Script tags without runat="server" are left as content. A block without
+// its closing tag is reported as UnterminatedScriptBlock.
+static const char *TryParseScriptBlock(const char *buffer,
+                                       const char *current,
+                                       const char *end,
+                                       ParserCallback callback,
+                                       void *user_data,
+                                       size_t *lineno) {
+  static const char kOpenTag[] = "<script";
+  static const char kCloseTag[] = "</script";
+  const size_t kOpenTagLength = sizeof(kOpenTag) - 1;
+  const size_t kCloseTagLength = sizeof(kCloseTag) - 1;
+  const char *attributes;
+  const char *attributes_end;
+  const char *runat;
+  const char *runat_end;
+  const char *code;
+  const char *p;
+
+  if ((size_t)(end - current) <= kOpenTagLength ||
+      !IsToken(current, current + kOpenTagLength, kOpenTag))
+    return NULL;
+
+  attributes = current + kOpenTagLength;
+  if (!isspace((unsigned char)*attributes))
+    return NULL;
+
+  attributes_end = SearchCharacter(attributes, end, '>', NULL);
+  if (attributes_end == NULL ||
+      !GetDirectiveAttribute(
+          attributes, attributes_end, "runat", &runat, &runat_end) ||
+      !IsToken(runat, runat_end, "server"))
+    return NULL;
+
+  code = attributes_end + 1;
+  for (p = code; (size_t)(end - p) >= kCloseTagLength; p++) {
+    const char *close_end;
+
+    if (*p != '<' || !IsToken(p, p + kCloseTagLength, kCloseTag))
+      continue;
+
+    close_end = SearchCharacter(p + kCloseTagLength, end, '>', NULL);
+    if (close_end == NULL)
+      break;
+
+    callback(buffer,
+             CodeDeclarationBlock,
+             *lineno + CountNewlines(current, code),
+             code - buffer,
+             p - buffer,
+             user_data);
+    *lineno += CountNewlines(current, close_end);
+    return close_end + 1;
+  }
+
+  callback(buffer,
+           UnterminatedScriptBlock,
+           *lineno,
+           current - buffer,
+           end - buffer,
+           user_data);
+  return end;
+}
+
 int ParseBuffer(const char *buffer,
                 size_t buffer_size,
                 ParserCallback callback,
@@ -159,6 +289,10 @@ int ParseBuffer(const char *buffer,
 
       new_position =
           TryParseChunk(buffer, current, end, callback, user_data, &lineno);
+      if (new_position == NULL) {
+        new_position = TryParseScriptBlock(
+            buffer, current, end, callback, user_data, &lineno);
+      }
       if (new_position != NULL) {
         // Point just past the directive
         last = current = new_position;
@@ -174,3 +308,81 @@ int ParseBuffer(const char *buffer,
 
   return 0;
 }
+
+int IsDirectiveName(const char *begin, const char *end, const char *name) {
+  const char *name_begin = SkipSpaces(begin, end);
+  return IsToken(name_begin, ScanName(name_begin, end), name);
+}
+
+int GetDirectiveAttribute(const char *begin,
+                          const char *end,
+                          const char *name,
+                          const char **value,
+                          const char **value_end) {
+  const char *p = begin;
+
+  for (;;) {
+    const char *attribute;
+    const char *attribute_end;
+    const char *attribute_value;
+    const char *attribute_value_end;
+
+    attribute = SkipSpaces(p, end);
+    if (attribute == end)
+      return 0;
+
+    attribute_end = ScanName(attribute, end);
+    p = SkipSpaces(attribute_end, end);
+    if (p == end || *p != '=')
+      continue;  // The directive name or an attribute without value
+
+    p = ScanValue(SkipSpaces(p + 1, end),
+                  end,
+                  &attribute_value,
+                  &attribute_value_end);
+
+    if (IsToken(attribute, attribute_end, name)) {
+      *value = attribute_value;
+      *value_end = attribute_value_end;
+      return 1;
+    }
+  }
+}
+
+const char *FindIncludeComment(const char *begin,
+                               const char *end,
+                               const char **attributes,
+                               const char **attributes_end,
+                               const char **comment_end) {
+  static const char kInclude[] = "#include";
+  const size_t kIncludeLength = sizeof(kInclude) - 1;
+  const char *p = begin;
+
+  while ((p = SearchCharacter(p, end, '<', NULL)) != NULL) {
+    const char *comment = p;
+
+    p++;
+    if (end - comment < 4 || strncmp(comment, "<!--", 4) != 0)
+      continue;
+
+    p = SkipSpaces(comment + 4, end);
+    if ((size_t)(end - p) < kIncludeLength ||
+        !IsToken(p, p + kIncludeLength, kInclude))
+      continue;
+
+    p += kIncludeLength;
+    *attributes = p;
+    for (; p + 3 <= end; p++) {
+      if (p[0] == '-' && p[1] == '-' && p[2] == '>') {
+        *attributes_end = p;
+        *comment_end = p + 3;
+        return comment;
+      }
+    }
+
+    // An unterminated comment is left as content.
+    return NULL;
+  }
+
+  return NULL;
+}
@@ -27,12 +27,13 @@
 
 enum ChunkType {
   Content,
-  DirectiveBlock,        // parsed, but ignored and replaced with a comment
-  CodeDeclarationBlock,  // not yet implemented
+  DirectiveBlock,        // kept as a comment after taking effect
+  CodeDeclarationBlock,  // <script runat="server">, outside the page function
   InlineCodeRenderBlock,
   InlineExpressionRenderBlock,
   InlineExpressionRenderHtmlBlock,
-  ServerSideComment
+  ServerSideComment,
+  UnterminatedScriptBlock  // an error, the rest of the buffer is skipped
 };
 
 typedef void (*ParserCallback)(const char *buffer,
@@ -42,6 +43,29 @@ typedef void (*ParserCallback)(const char *buffer,
                                size_t end,
                                void *user_data);
 
+// Returns non-zero if the directive text between <%@ and %> in
+// [begin, end) names the directive |name|. Names are case insensitive.
+int IsDirectiveName(const char *begin, const char *end, const char *name);
+
+// Looks up the attribute |name| in the directive text [begin, end).
+// Returns non-zero and the unquoted value in [*value, *value_end) if found.
+int GetDirectiveAttribute(const char *begin,
+                          const char *end,
+                          const char *name,
+                          const char **value,
+                          const char **value_end);
+
+// Searches content in [begin, end) for an include comment like
+//    <!-- #include file="header.inc" -->
+// Returns the beginning of the comment, the text after #include in
+// [*attributes, *attributes_end) and the end of the comment in
+// |comment_end|, or NULL if there is none.
+const char *FindIncludeComment(const char *begin,
+                               const char *end,
+                               const char **attributes,
+                               const char **attributes_end,
+                               const char **comment_end);
+
 int ParseBuffer(const char *buffer,
                 size_t buffer_size,
                 ParserCallback callback,
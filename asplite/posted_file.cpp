@@ -24,7 +24,7 @@
 
 #include <Windows.h>
 
-void HttpPostedFile::SaveAs(const std::string &name) const {
+void HttpPostedFile::SaveAs(const char *name) const {
   // TODO: Fix to wide
-  CopyFileA(internal_name_.c_str(), name.c_str(), false);
+  CopyFileA(internal_name_.c_str(), name, false);
 }
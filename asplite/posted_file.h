@@ -25,28 +25,30 @@
 
 #include <string>
 
+#include "asplite/request_arena.h"
+
 class HttpPostedFile {
 public:
   HttpPostedFile() : content_length_(0) {}
-  HttpPostedFile(const std::string &file_name,
+  HttpPostedFile(const ArenaString &file_name,
                  size_t content_length,
-                 const std::string &content_type,
-                 const std::string &internal_name)
+                 const ArenaString &content_type,
+                 const ArenaString &internal_name)
       : file_name_(file_name),
         content_length_(content_length),
         content_type_(content_type),
         internal_name_(internal_name) {}
 
   size_t GetContentLength() const { return content_length_; }
-  std::string GetContentType() const { return content_type_; }
-  std::string GetFileName() const { return file_name_; }
-  void SaveAs(const std::string &name) const;
+  const ArenaString &GetContentType() const { return content_type_; }
+  const ArenaString &GetFileName() const { return file_name_; }
+  void SaveAs(const char *name) const;
 
 private:
   size_t content_length_;
-  std::string content_type_;
-  std::string file_name_;
-  std::string internal_name_;
+  ArenaString content_type_;
+  ArenaString file_name_;
+  ArenaString internal_name_;
 };
 
 #endif  // ASPLITE_POSTED_FILE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
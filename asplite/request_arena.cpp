@@ -0,0 +1,134 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/request_arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "asplite/thread_local.h"
+
+namespace {
+
+// Do not keep blocks of huge requests (e.g. large uploads) forever.
+const size_t kMaxRetainedSize = 1024 * 1024;
+
+ASPLITE_THREAD_LOCAL RequestArena *current_arena = NULL;
+
+}  // namespace
+
+size_t RequestArena::AlignedOffset(Block *block, size_t alignment) {
+  uintptr_t base = reinterpret_cast<uintptr_t>(BlockData(block));
+  uintptr_t top = base + block->used;
+  return ((top + alignment - 1) & ~(alignment - 1)) - base;
+}
+
+RequestArena::RequestArena(size_t initial_size)
+    : blocks_(NULL), initial_size_(initial_size) {
+  blocks_ = AllocateBlock(initial_size_);
+}
+
+RequestArena::~RequestArena() {
+  while (blocks_ != NULL) {
+    Block *next = blocks_->next;
+    free(blocks_);
+    blocks_ = next;
+  }
+}
+
+RequestArena::Block *RequestArena::AllocateBlock(size_t size) {
+  Block *block = (Block *)malloc(sizeof(Block) + size);
+  if (block == NULL)
+    throw std::bad_alloc();
+
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void *RequestArena::Allocate(size_t size, size_t alignment) {
+  assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+
+  size_t offset = AlignedOffset(blocks_, alignment);
+  if (offset + size > blocks_->size) {
+    // Grow geometrically, so the number of blocks per request stays small.
+    size_t block_size = blocks_->size * 2;
+    if (block_size < size + alignment)
+      block_size = size + alignment;
+
+    Block *block = AllocateBlock(block_size);
+    block->next = blocks_;
+    blocks_ = block;
+    statistics_.heap_allocation_count++;
+    offset = AlignedOffset(blocks_, alignment);
+  }
+
+  blocks_->used = offset + size;
+  statistics_.allocation_count++;
+  statistics_.allocated_bytes += size;
+  return BlockData(blocks_) + offset;
+}
+
+void RequestArena::Deallocate(void *ptr, size_t size) {
+  // Strings and vectors that grow in place release their previous
+  // storage right after the new one is allocated, so only the
+  // most recent allocation is worth reclaiming.
+  char *p = static_cast<char *>(ptr);
+  char *top = BlockData(blocks_) + blocks_->used;
+  if (p + size == top)
+    blocks_->used -= size;
+}
+
+void RequestArena::Reset() {
+  size_t total_size = 0;
+  for (Block *block = blocks_; block != NULL; block = block->next)
+    total_size += block->size;
+
+  if (blocks_->next != NULL || total_size > kMaxRetainedSize) {
+    // The request did not fit into a single block. Replace the chain
+    // with a single block that fits the whole request, so the next
+    // similar request is served without touching the heap.
+    while (blocks_ != NULL) {
+      Block *next = blocks_->next;
+      free(blocks_);
+      blocks_ = next;
+    }
+
+    if (total_size > kMaxRetainedSize)
+      total_size = initial_size_;
+
+    blocks_ = AllocateBlock(total_size);
+  }
+
+  blocks_->used = 0;
+  statistics_ = Statistics();
+}
+
+RequestArena *RequestArena::GetCurrent() {
+  return current_arena;
+}
+
+void RequestArena::SetCurrent(RequestArena *arena) {
+  current_arena = arena;
+}
@@ -0,0 +1,187 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_REQUEST_ARENA_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_REQUEST_ARENA_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Monotonic allocator for request scoped objects.
+// Memory is never returned to the heap on deallocation, instead the whole
+// arena is rewound by Reset() once the request is complete. Blocks are kept
+// between requests, so a worker that serves similar requests does not touch
+// the global heap in steady state.
+class RequestArena {
+public:
+  struct Statistics {
+    Statistics()
+        : allocation_count(0), allocated_bytes(0), heap_allocation_count(0) {}
+
+    size_t allocation_count;       // Allocations served by the arena
+    size_t allocated_bytes;        // Bytes served by the arena
+    size_t heap_allocation_count;  // Blocks requested from the global heap
+  };
+
+  explicit RequestArena(size_t initial_size);
+  ~RequestArena();
+
+  void *Allocate(size_t size, size_t alignment);
+
+  // Gives back memory only if |ptr| is the most recent allocation.
+  void Deallocate(void *ptr, size_t size);
+
+  // Releases all allocations. Statistics are reset as well.
+  void Reset();
+
+  const Statistics &GetStatistics() const { return statistics_; }
+
+  // Arena that is used by default constructed ArenaAllocator on the
+  // calling thread. May be NULL in which case allocators use the heap.
+  static RequestArena *GetCurrent();
+  static void SetCurrent(RequestArena *arena);
+
+private:
+  struct Block {
+    Block *next;
+    size_t size;
+    size_t used;
+  };
+
+  RequestArena(const RequestArena &);
+  RequestArena &operator=(const RequestArena &);
+
+  Block *AllocateBlock(size_t size);
+  static size_t AlignedOffset(Block *block, size_t alignment);
+  static char *BlockData(Block *block) {
+    return reinterpret_cast<char *>(block + 1);
+  }
+
+  Block *blocks_;  // Most recent block first
+  size_t initial_size_;
+  Statistics statistics_;
+};
+
+// Sets the current arena of the calling thread for the lifetime of
+// the object.
+class RequestArenaScope {
+public:
+  explicit RequestArenaScope(RequestArena *arena)
+      : previous_(RequestArena::GetCurrent()) {
+    RequestArena::SetCurrent(arena);
+  }
+
+  ~RequestArenaScope() { RequestArena::SetCurrent(previous_); }
+
+private:
+  RequestArenaScope(const RequestArenaScope &);
+  RequestArenaScope &operator=(const RequestArenaScope &);
+
+  RequestArena *previous_;
+};
+
+// STL allocator that binds to the current arena of the thread at the
+// time of construction and falls back to the heap if there is none.
+template <typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena_(RequestArena::GetCurrent()) {}
+  explicit ArenaAllocator(RequestArena *arena) : arena_(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other)
+      : arena_(other.arena()) {}
+
+  RequestArena *arena() const { return arena_; }
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void * = 0) {
+    if (arena_ != NULL) {
+      return static_cast<pointer>(
+          arena_->Allocate(n * sizeof(T), std::alignment_of<T>::value));
+    }
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(pointer p, size_type n) {
+    if (arena_ != NULL)
+      arena_->Deallocate(p, n * sizeof(T));
+    else
+      ::operator delete(p);
+  }
+
+  size_type max_size() const {
+    return std::numeric_limits<size_type>::max() / sizeof(T);
+  }
+
+  void construct(pointer p, const T &value) { new (p) T(value); }
+  void destroy(pointer p) { p->~T(); }
+
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&... args) {
+    new (p) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U>
+  void destroy(U *p) {
+    p->~U();
+  }
+
+private:
+  RequestArena *arena_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() != b.arena();
+}
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> >
+    ArenaString;
+
+#endif  // ASPLITE_REQUEST_ARENA_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,444 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/response_writer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "asplite/http_date.h"
+
+namespace {
+
+const size_t kHeadersReserve = 512;
+
+// Output of a streamed response is collected up to this size before it
+// is sent, so that small fragments do not cost a system call each.
+const size_t kWriteBufferSize = 8 * 1024;
+
+// Appends "|name|: |date|\r\n" to |headers|.
+void AppendHttpDateHeader(const char *name,
+                          const char *date,
+                          ArenaString *headers) {
+  headers->append(name);
+  headers->append(": ", 2);
+  headers->append(date, kHttpDateLength);
+  headers->append("\r\n", 2);
+}
+
+bool GetFileSize(const char *path, int64_t *size) {
+#ifdef _WIN32
+  struct _stati64 st;
+  if (_stati64(path, &st) != 0 || (st.st_mode & _S_IFDIR) != 0)
+    return false;
+#else
+  struct stat st;
+  if (stat(path, &st) != 0 || S_ISDIR(st.st_mode))
+    return false;
+#endif  // _WIN32
+  *size = st.st_size;
+  return true;
+}
+
+const char *ParseNumber(const char *p, int64_t *value) {
+  if (*p < '0' || *p > '9')
+    return NULL;
+
+  *value = 0;
+  while (*p >= '0' && *p <= '9')
+    *value = *value * 10 + (*p++ - '0');
+  return p;
+}
+
+// Parses a Range header of a single byte range against a file of |size|
+// bytes. Returns 1 and the range in |first| and |last| if the range is
+// satisfiable, -1 if it is not, and 0 if the header should be ignored.
+int ParseByteRange(const char *header,
+                   int64_t size,
+                   int64_t *first,
+                   int64_t *last) {
+  if (strncmp(header, "bytes=", 6) != 0)
+    return 0;
+
+  const char *p = header + 6;
+  if (*p == '-') {
+    // Suffix range: the last N bytes
+    int64_t suffix;
+    p = ParseNumber(p + 1, &suffix);
+    if (p == NULL || *p != '\0')
+      return 0;
+    if (suffix == 0 || size == 0)
+      return -1;
+    *first = suffix < size ? size - suffix : 0;
+    *last = size - 1;
+    return 1;
+  }
+
+  p = ParseNumber(p, first);
+  if (p == NULL || *p++ != '-')
+    return 0;
+
+  if (*p == '\0') {
+    *last = size - 1;
+  } else {
+    p = ParseNumber(p, last);
+    if (p == NULL || *p != '\0' || *last < *first)
+      return 0;  // Includes lists of ranges, which are not supported
+    if (*last >= size)
+      *last = size - 1;
+  }
+
+  return *first < size ? 1 : -1;
+}
+
+}  // namespace
+
+HttpResponseWriter::HttpResponseWriter(IHttpRequestAdapter *request,
+                                       IHttpResponseAdapter *response)
+    : request_(request),
+      response_(response),
+      status_(200),
+      capture_(false),
+      captured_(false),
+      sets_cookie_(false),
+      headers_sent_(false),
+      headers_pending_(false),
+      chunk_end_pending_(false),
+      chunked_(false),
+      complete_(false) {}
+
+void HttpResponseWriter::BeginHeaders(int status,
+                                      const char *reason,
+                                      const char *content_type,
+                                      size_t content_type_length,
+                                      const time_t *expires) {
+  status_ = status;
+
+  headers_.clear();
+  headers_.reserve(kHeadersReserve);
+
+  char status_line[32];
+  sprintf(status_line, "HTTP/1.1 %d ", status);
+  headers_.append(status_line);
+  headers_.append(reason);
+  headers_.append("\r\n", 2);
+
+  if (content_type_length > 0)
+    AddHeader("Content-Type",
+              sizeof("Content-Type") - 1,
+              content_type,
+              content_type_length);
+
+  if (expires != NULL) {
+    char date[kHttpDateLength + 1];
+    FormatHttpDate(*expires, date);
+    AppendHttpDateHeader("Expires", date, &headers_);
+  }
+}
+
+void HttpResponseWriter::AddHeader(const char *name,
+                                   size_t name_length,
+                                   const char *value,
+                                   size_t value_length) {
+  // A response that sets a cookie belongs to a single client.
+  if (name_length == sizeof("Set-Cookie") - 1 &&
+      strnicmp(name, "Set-Cookie", name_length) == 0)
+    sets_cookie_ = true;
+
+  headers_.append(name, name_length);
+  headers_.append(": ", 2);
+  headers_.append(value, value_length);
+  headers_.append("\r\n", 2);
+}
+
+void HttpResponseWriter::SendHeaders(const char *body,
+                                     size_t body_length,
+                                     bool complete) {
+  if (complete) {
+    if (capture_ && status_ == 200 && !sets_cookie_) {
+      captured_head_ = headers_;
+      captured_body_.assign(body != NULL ? body : "", body_length);
+      captured_ = true;
+    }
+
+    FinishHeaders(body_length);
+
+    HttpBuffer buffers[2];
+    buffers[0].data = headers_.data();
+    buffers[0].length = headers_.length();
+    buffers[1].data = body;
+    buffers[1].length = body_length;
+    response_->Write(buffers, body_length > 0 ? 2 : 1);
+    complete_ = true;
+    return;
+  }
+
+  FinishHeaders(-1);
+
+  // The rest of the body follows; hold the headers back so that they go
+  // out together with the first flush of the write buffer.
+  headers_pending_ = true;
+  Write(body, body_length);
+}
+
+void HttpResponseWriter::SendCachedResponse(const char *head,
+                                            size_t head_length,
+                                            const char *body,
+                                            size_t body_length) {
+  status_ = 200;
+  headers_.reserve(head_length + kHeadersReserve);
+  headers_.assign(head, head_length);
+  SendHeaders(body, body_length, true);
+}
+
+bool HttpResponseWriter::TransmitFile(const char *path,
+                                      int64_t offset,
+                                      int64_t length,
+                                      const char *body,
+                                      size_t body_length) {
+  int64_t file_size;
+  if (!GetFileSize(path, &file_size))
+    return false;
+
+  if (offset < 0 || offset > file_size)
+    offset = file_size;
+  if (length < 0 || length > file_size - offset)
+    length = file_size - offset;
+
+  if (complete_)
+    return true;
+
+  if (headers_sent_) {
+    StreamFile(path, offset, length);
+    return true;
+  }
+
+  if (offset == 0 && length == file_size && status_ == 200 &&
+      body_length == 0) {
+    AddHeader("Accept-Ranges", sizeof("Accept-Ranges") - 1, "bytes", 5);
+
+    const char *range = request_->GetHeader("Range");
+    int64_t first, last;
+    int result = range ? ParseByteRange(range, file_size, &first, &last) : 0;
+    char content_range[96];
+
+    if (result > 0) {
+      SetStatus(206, "Partial Content");
+      AddHeader("Content-Range",
+                sizeof("Content-Range") - 1,
+                content_range,
+                sprintf(content_range,
+                        "bytes %lld-%lld/%lld",
+                        (long long)first,
+                        (long long)last,
+                        (long long)file_size));
+      offset = first;
+      length = last - first + 1;
+    } else if (result < 0) {
+      SetStatus(416, "Requested range not satisfiable");
+      AddHeader("Content-Range",
+                sizeof("Content-Range") - 1,
+                content_range,
+                sprintf(content_range, "bytes */%lld", (long long)file_size));
+      SendHeaders(NULL, 0, true);
+      return true;
+    }
+  }
+
+  FinishHeaders(body_length + length);
+
+  HttpBuffer buffers[2];
+  buffers[0].data = headers_.data();
+  buffers[0].length = headers_.length();
+  buffers[1].data = body;
+  buffers[1].length = body_length;
+  response_->Write(buffers, body_length > 0 ? 2 : 1);
+
+  // A short file leaves the client waiting on the announced length, the
+  // server closes the connection in that case.
+  if (length > 0)
+    response_->TransmitFile(path, offset, length);
+
+  complete_ = true;
+  return true;
+}
+
+void HttpResponseWriter::SetStatus(int status, const char *reason) {
+  status_ = status;
+
+  char status_line[64];
+  sprintf(status_line, "HTTP/1.1 %d %s", status, reason);
+  headers_.replace(0, headers_.find("\r\n"), status_line);
+}
+
+void HttpResponseWriter::FinishHeaders(int64_t content_length) {
+  bool can_keep_alive = true;
+  char framing[64];
+
+  char date[kHttpDateLength + 1];
+  GetCurrentHttpDate(date);
+  AppendHttpDateHeader("Date", date, &headers_);
+
+  if (content_length >= 0) {
+    sprintf(framing, "Content-Length: %lld\r\n", (long long)content_length);
+  } else if (strcmp(request_->GetHttpVersion(), "1.0") != 0) {
+    strcpy(framing, "Transfer-Encoding: chunked\r\n");
+    chunked_ = true;
+  } else {
+    framing[0] = '\0';
+    can_keep_alive = false;
+  }
+
+  headers_.append(framing);
+
+  if (response_->BeginResponse(status_, can_keep_alive))
+    headers_.append("Connection: keep-alive\r\n\r\n");
+  else
+    headers_.append("Connection: close\r\n\r\n");
+
+  headers_sent_ = true;
+}
+
+void HttpResponseWriter::Write(const char *data, size_t length) {
+  if (complete_ || length == 0)
+    return;
+
+  if (buffer_.length() + length <= kWriteBufferSize) {
+    if (buffer_.capacity() < kWriteBufferSize)
+      buffer_.reserve(kWriteBufferSize);
+    buffer_.append(data, length);
+    return;
+  }
+
+  SendBuffered(data, length, false);
+}
+
+void HttpResponseWriter::Flush() {
+  if (complete_)
+    return;
+
+  if (headers_pending_ || !buffer_.empty())
+    SendBuffered(NULL, 0, false);
+}
+
+void HttpResponseWriter::End() {
+  if (!headers_sent_) {
+    BeginHeaders(500, "Internal Server Error", NULL, 0, NULL);
+    SendHeaders(NULL, 0, true);
+    return;
+  }
+
+  if (!complete_)
+    SendBuffered(NULL, 0, true);
+
+  complete_ = true;
+}
+
+void HttpResponseWriter::SendBuffered(const char *data,
+                                      size_t length,
+                                      bool last) {
+  HttpBuffer buffers[6];
+  int count = 0;
+
+  if (headers_pending_) {
+    buffers[count].data = headers_.data();
+    buffers[count].length = headers_.length();
+    ++count;
+  }
+
+  if (chunk_end_pending_) {
+    buffers[count].data = "\r\n";
+    buffers[count].length = 2;
+    ++count;
+  }
+
+  // Buffered data and |data| form a single chunk.
+  size_t chunk_length = buffer_.length() + length;
+  char chunk_size[16];
+  if (chunked_ && chunk_length > 0) {
+    buffers[count].data = chunk_size;
+    buffers[count].length =
+        sprintf(chunk_size, "%x\r\n", (unsigned)chunk_length);
+    ++count;
+  }
+
+  if (!buffer_.empty()) {
+    buffers[count].data = buffer_.data();
+    buffers[count].length = buffer_.length();
+    ++count;
+  }
+
+  if (length > 0) {
+    buffers[count].data = data;
+    buffers[count].length = length;
+    ++count;
+  }
+
+  if (chunked_) {
+    static const char kChunkEnd[] = "\r\n0\r\n\r\n";
+    const char *end = chunk_length > 0 ? kChunkEnd : kChunkEnd + 2;
+    size_t end_length = chunk_length > 0 ? 2 : 0;
+    if (last)
+      end_length += 5;
+
+    if (end_length > 0) {
+      buffers[count].data = end;
+      buffers[count].length = end_length;
+      ++count;
+    }
+  }
+
+  if (count > 0)
+    response_->Write(buffers, count);
+
+  buffer_.clear();
+  headers_pending_ = false;
+  chunk_end_pending_ = false;
+}
+
+void HttpResponseWriter::StreamFile(const char *path,
+                                    int64_t offset,
+                                    int64_t length) {
+  if (length == 0)
+    return;
+
+  // Send what is buffered and open a chunk for the file, the chunk is
+  // closed when anything else is sent.
+  SendBuffered(NULL, 0, false);
+
+  if (chunked_) {
+    char chunk_size[32];
+    response_->Write(
+        chunk_size,
+        sprintf(chunk_size, "%llx\r\n", (unsigned long long)length));
+  }
+
+  // A short file breaks the body framing, so nothing more can be sent and
+  // the server closes the connection.
+  if (response_->TransmitFile(path, offset, length) != length) {
+    complete_ = true;
+    return;
+  }
+  chunk_end_pending_ = chunked_;
+}
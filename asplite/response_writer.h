@@ -0,0 +1,136 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_RESPONSE_WRITER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_RESPONSE_WRITER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <time.h>
+
+#include "asplite/asplite.h"
+
+// Serializes the response header block and frames the body on the wire.
+// A response that is sent in one piece goes out with Content-Length.
+// A response that is sent in parts uses chunked transfer encoding, or,
+// for HTTP/1.0 clients, is delimited by closing the connection.
+// Parts are collected in a small write buffer which is sent when it fills
+// up, on Flush and on End.
+class HttpResponseWriter {
+public:
+  HttpResponseWriter(IHttpRequestAdapter *request,
+                     IHttpResponseAdapter *response);
+
+  // Starts the header block with the status line and standard headers.
+  // |expires| may be NULL.
+  void BeginHeaders(int status,
+                    const char *reason,
+                    const char *content_type,
+                    size_t content_type_length,
+                    const time_t *expires);
+
+  void AddHeader(const char *name,
+                 size_t name_length,
+                 const char *value,
+                 size_t value_length);
+
+  // Completes the header block and sends it together with |body|.
+  // If |complete| is true, |body| is the whole response body.
+  void SendHeaders(const char *body, size_t body_length, bool complete);
+
+  // Sends a part of the body. Must be called after SendHeaders.
+  // Output of a complete response is discarded.
+  void Write(const char *data, size_t length);
+
+  // Sends buffered headers and data.
+  void Flush();
+
+  // Sends |length| bytes of the file |path| starting at |offset|, or the
+  // rest of the file if |length| is negative. If the headers have not
+  // been sent yet, |body| followed by the file completes the response, and
+  // a Range request header is honoured when the whole file is sent.
+  // Otherwise the file is appended to the streamed body. Returns false if
+  // the file cannot be opened.
+  bool TransmitFile(const char *path,
+                    int64_t offset,
+                    int64_t length,
+                    const char *body,
+                    size_t body_length);
+
+  // Terminates the body. Sends an empty 500 response if nothing has been
+  // sent yet, so that the client is not left waiting on a kept alive
+  // connection.
+  void End();
+
+  // Sends a response kept by the output cache. |head| is the status line
+  // and the headers captured from the original response; the Date and
+  // framing headers are added.
+  void SendCachedResponse(const char *head,
+                          size_t head_length,
+                          const char *body,
+                          size_t body_length);
+
+  // If |capture| is true, a copy of the response is kept when it is sent
+  // in one piece with status 200 and does not set cookies, see captured().
+  void set_capture(bool capture) { capture_ = capture; }
+
+  bool headers_sent() const { return headers_sent_; }
+
+  bool captured() const { return captured_; }
+
+  // The status line and headers of the captured response, without the
+  // Date, framing and Connection headers.
+  const ArenaString &captured_head() const { return captured_head_; }
+
+  const ArenaString &captured_body() const { return captured_body_; }
+
+private:
+  // Replaces the status line of the header block.
+  void SetStatus(int status, const char *reason);
+
+  // Appends the Date, framing and Connection headers and completes the
+  // header block. |content_length| is negative if the body is streamed.
+  void FinishHeaders(int64_t content_length);
+
+  // Sends pending headers, buffered data and |data| in one go. If |last|
+  // is true, the terminating chunk is appended.
+  void SendBuffered(const char *data, size_t length, bool last);
+
+  // Appends a file to the streamed body.
+  void StreamFile(const char *path, int64_t offset, int64_t length);
+
+  IHttpRequestAdapter *request_;
+  IHttpResponseAdapter *response_;
+  ArenaString headers_;
+  ArenaString buffer_;
+  ArenaString captured_head_;
+  ArenaString captured_body_;
+  int status_;
+  bool capture_;
+  bool captured_;
+  bool sets_cookie_;
+  bool headers_sent_;
+  bool headers_pending_;
+  bool chunk_end_pending_;
+  bool chunked_;
+  bool complete_;
+};
+
+#endif  // ASPLITE_RESPONSE_WRITER_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,214 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/session_store.h"
+
+#include <chrono>
+#include <functional>
+
+namespace {
+
+// Rough per session cost of the map and list nodes, added to the id and
+// data sizes when the memory use is accounted.
+const size_t kSessionOverhead = 128;
+
+// How often the reaper thread looks for expired sessions.
+const int kReapIntervalSeconds = 30;
+
+}  // namespace
+
+SessionStore::SessionStore()
+    : timeout_(20 * 60), memory_limit_(0), stopping_(false) {}
+
+SessionStore::~SessionStore() {
+  Stop();
+}
+
+void SessionStore::Start(int timeout, size_t memory_limit) {
+  Stop();
+
+  timeout_ = timeout;
+  memory_limit_ = memory_limit;
+  stopping_ = false;
+  reaper_ = std::thread(&SessionStore::ReaperThread, this);
+}
+
+void SessionStore::Stop() {
+  if (!reaper_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(reaper_mutex_);
+    stopping_ = true;
+  }
+  reaper_wakeup_.notify_one();
+  reaper_.join();
+}
+
+void SessionStore::GenerateId(char *id) {
+  static const char kDigits[] = "0123456789abcdef";
+  uint32_t random[kIdLength / 8];
+
+  {
+    std::lock_guard<std::mutex> lock(random_mutex_);
+    for (size_t i = 0; i < kIdLength / 8; ++i)
+      random[i] = random_();
+  }
+
+  for (size_t i = 0; i < kIdLength; ++i)
+    id[i] = kDigits[(random[i / 8] >> (i % 8 * 4)) & 0xf];
+  id[kIdLength] = '\0';
+}
+
+bool SessionStore::Load(const char *id, size_t id_length, ArenaString *data) {
+  std::string key(id, id_length);
+  Shard &shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  SessionMap::iterator iter = Find(&shard, key, time(NULL));
+  if (iter == shard.sessions.end())
+    return false;
+
+  data->assign(iter->second.data.data(), iter->second.data.length());
+  return true;
+}
+
+void SessionStore::Touch(const char *id, size_t id_length) {
+  std::string key(id, id_length);
+  Shard &shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Find(&shard, key, time(NULL));
+}
+
+void SessionStore::Save(const char *id,
+                        size_t id_length,
+                        const char *data,
+                        size_t data_length) {
+  std::string key(id, id_length);
+  Shard &shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  time_t now = time(NULL);
+  SessionMap::iterator iter = Find(&shard, key, now);
+  if (iter == shard.sessions.end()) {
+    iter = shard.sessions.insert(SessionMap::value_type(key, Session())).first;
+    shard.lru.push_front(&iter->first);
+    iter->second.lru = shard.lru.begin();
+    iter->second.last_access = now;
+    ++shard.created;
+  }
+
+  Session &session = iter->second;
+  shard.bytes -= session.size;
+  session.data.assign(data, data_length);
+  session.size = id_length + data_length + kSessionOverhead;
+  shard.bytes += session.size;
+
+  if (memory_limit_ != 0) {
+    size_t limit = memory_limit_ / kShardCount;
+    while (shard.bytes > limit && !shard.lru.empty()) {
+      RemoveSession(&shard, shard.sessions.find(*shard.lru.back()));
+      ++shard.evictions;
+    }
+  }
+}
+
+void SessionStore::Abandon(const char *id, size_t id_length) {
+  std::string key(id, id_length);
+  Shard &shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  SessionMap::iterator iter = shard.sessions.find(key);
+  if (iter != shard.sessions.end())
+    RemoveSession(&shard, iter);
+}
+
+SessionStore::Statistics SessionStore::GetStatistics() {
+  Statistics statistics;
+
+  for (size_t i = 0; i < kShardCount; ++i) {
+    Shard &shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    statistics.count += shard.sessions.size();
+    statistics.bytes += shard.bytes;
+    statistics.created += shard.created;
+    statistics.expirations += shard.expirations;
+    statistics.evictions += shard.evictions;
+  }
+
+  return statistics;
+}
+
+SessionStore::Shard &SessionStore::GetShard(const std::string &id) {
+  return shards_[std::hash<std::string>()(id) % kShardCount];
+}
+
+SessionStore::SessionMap::iterator SessionStore::Find(Shard *shard,
+                                                      const std::string &id,
+                                                      time_t now) {
+  SessionMap::iterator iter = shard->sessions.find(id);
+  if (iter == shard->sessions.end())
+    return iter;
+
+  if (now - iter->second.last_access >= timeout_) {
+    RemoveSession(shard, iter);
+    ++shard->expirations;
+    return shard->sessions.end();
+  }
+
+  iter->second.last_access = now;
+  shard->lru.splice(shard->lru.begin(), shard->lru, iter->second.lru);
+  return iter;
+}
+
+void SessionStore::RemoveSession(Shard *shard, SessionMap::iterator iter) {
+  shard->bytes -= iter->second.size;
+  shard->lru.erase(iter->second.lru);
+  shard->sessions.erase(iter);
+}
+
+void SessionStore::RemoveExpired(Shard *shard, time_t now) {
+  while (!shard->lru.empty()) {
+    SessionMap::iterator iter = shard->sessions.find(*shard->lru.back());
+    if (now - iter->second.last_access < timeout_)
+      break;
+    RemoveSession(shard, iter);
+    ++shard->expirations;
+  }
+}
+
+void SessionStore::ReaperThread() {
+  std::unique_lock<std::mutex> lock(reaper_mutex_);
+
+  while (!stopping_) {
+    reaper_wakeup_.wait_for(lock, std::chrono::seconds(kReapIntervalSeconds));
+    if (stopping_)
+      break;
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < kShardCount; ++i) {
+      Shard &shard = shards_[i];
+      std::lock_guard<std::mutex> shard_lock(shard.mutex);
+      RemoveExpired(&shard, now);
+    }
+  }
+}
@@ -0,0 +1,155 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_SESSION_STORE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_SESSION_STORE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "asplite/request_arena.h"
+
+// In-memory store of session state, which backs the Session object.
+// A session is a serialized Lua table kept under a random id, which the
+// client presents in a cookie. Sessions expire when they are not used for
+// the session timeout; each access restarts the timeout. A background
+// thread removes expired sessions. Sessions are spread over shards with a
+// lock each, and the least recently used ones are evicted when the memory
+// limit is exceeded.
+class SessionStore {
+public:
+  struct Statistics {
+    Statistics()
+        : count(0), bytes(0), created(0), expirations(0), evictions(0) {}
+
+    size_t count;
+    size_t bytes;  // Approximate memory used by the sessions
+    uint64_t created;
+    uint64_t expirations;  // Sessions removed after the timeout
+    uint64_t evictions;    // Sessions dropped to stay within the limit
+  };
+
+  // Length of a session id.
+  static const size_t kIdLength = 32;
+
+  SessionStore();
+  ~SessionStore();
+
+  // Sets the session timeout and the memory limit, 0 means no limit,
+  // and starts the thread that removes expired sessions.
+  void Start(int timeout, size_t memory_limit);
+
+  // Stops the reaper thread. Called by the destructor.
+  void Stop();
+
+  // Generates a new session id, |id| must have room for kIdLength + 1
+  // characters.
+  void GenerateId(char *id);
+
+  // Returns the data of the session |id| and restarts its timeout.
+  bool Load(const char *id, size_t id_length, ArenaString *data);
+
+  // Restarts the timeout of the session |id| without reading it.
+  void Touch(const char *id, size_t id_length);
+
+  // Stores the data of the session |id|, creating it if necessary.
+  void Save(const char *id,
+            size_t id_length,
+            const char *data,
+            size_t data_length);
+
+  void Abandon(const char *id, size_t id_length);
+
+  int timeout() const { return timeout_; }
+
+  Statistics GetStatistics();
+
+private:
+  // Ids of the sessions in the order of use. The ids point into the
+  // session map, whose nodes do not move.
+  typedef std::list<const std::string *> LruList;
+
+  struct Session {
+    Session() : last_access(0), size(0) {}
+
+    std::string data;
+    time_t last_access;
+    size_t size;
+    LruList::iterator lru;
+  };
+
+  typedef std::unordered_map<std::string, Session> SessionMap;
+
+  struct Shard {
+    Shard() : bytes(0), created(0), expirations(0), evictions(0) {}
+
+    std::mutex mutex;
+    SessionMap sessions;
+    LruList lru;  // Most recently used first
+    size_t bytes;
+    uint64_t created;
+    uint64_t expirations;
+    uint64_t evictions;
+  };
+
+  static const size_t kShardCount = 64;
+
+  SessionStore(const SessionStore &);
+  SessionStore &operator=(const SessionStore &);
+
+  Shard &GetShard(const std::string &id);
+
+  // Looks up a live session and restarts its timeout. Expired sessions
+  // are removed.
+  SessionMap::iterator Find(Shard *shard, const std::string &id, time_t now);
+
+  void RemoveSession(Shard *shard, SessionMap::iterator iter);
+
+  // Removes expired sessions. Since the sessions are kept in the order of
+  // use, the scan stops at the first live one.
+  void RemoveExpired(Shard *shard, time_t now);
+
+  void ReaperThread();
+
+  int timeout_;  // In seconds
+  size_t memory_limit_;
+  Shard shards_[kShardCount];
+
+  std::mutex random_mutex_;
+  std::random_device random_;
+
+  std::thread reaper_;
+  std::mutex reaper_mutex_;
+  std::condition_variable reaper_wakeup_;
+  bool stopping_;
+};
+
+#endif  // ASPLITE_SESSION_STORE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
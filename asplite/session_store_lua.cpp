@@ -0,0 +1,140 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/asplite.h"
+
+#include <assert.h>
+
+#include "lua/lua.hpp"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "asplite/lua_serializer.h"
+#include "asplite/session_store.h"
+
+namespace {
+
+inline SessionStore *GetStore(lua_State *L) {
+  return reinterpret_cast<SessionStore *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+// load(id)
+// Returns the session table or nil if there is no such session.
+int session_store_Load(lua_State *L) {
+  size_t id_length;
+  const char *id = luaL_checklstring(L, 1, &id_length);
+
+  ArenaString data;
+  if (!GetStore(L)->Load(id, id_length, &data) ||
+      !DeserializeLuaValue(L, data.data(), data.length()))
+    lua_pushnil(L);
+  return 1;
+}
+
+// save(id, data)
+int session_store_Save(lua_State *L) {
+  size_t id_length;
+  const char *id = luaL_checklstring(L, 1, &id_length);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  ArenaString data;
+  SerializeLuaValue(L, 2, &data);
+  GetStore(L)->Save(id, id_length, data.data(), data.length());
+  return 0;
+}
+
+// touch(id)
+int session_store_Touch(lua_State *L) {
+  size_t id_length;
+  const char *id = luaL_checklstring(L, 1, &id_length);
+  GetStore(L)->Touch(id, id_length);
+  return 0;
+}
+
+// abandon(id)
+int session_store_Abandon(lua_State *L) {
+  size_t id_length;
+  const char *id = luaL_checklstring(L, 1, &id_length);
+  GetStore(L)->Abandon(id, id_length);
+  return 0;
+}
+
+// new_id()
+int session_store_NewId(lua_State *L) {
+  char id[SessionStore::kIdLength + 1];
+  GetStore(L)->GenerateId(id);
+  lua_pushlstring(L, id, SessionStore::kIdLength);
+  return 1;
+}
+
+// timeout()
+// Returns the session timeout in minutes.
+int session_store_Timeout(lua_State *L) {
+  lua_pushinteger(L, GetStore(L)->timeout() / 60);
+  return 1;
+}
+
+// stats()
+// Returns a table with count, bytes, created, expirations and evictions
+// fields.
+int session_store_Stats(lua_State *L) {
+  SessionStore::Statistics statistics = GetStore(L)->GetStatistics();
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)statistics.count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, (lua_Number)statistics.bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)statistics.created);
+  lua_setfield(L, -2, "created");
+  lua_pushnumber(L, (lua_Number)statistics.expirations);
+  lua_setfield(L, -2, "expirations");
+  lua_pushnumber(L, (lua_Number)statistics.evictions);
+  lua_setfield(L, -2, "evictions");
+  return 1;
+}
+
+}  // namespace
+
+// Pushes a table of functions operating on |store|, which are wrapped by
+// asplite.CreateSessionObject.
+int CreateSessionStoreTable(lua_State *L, SessionStore *store) {
+  static const luaL_Reg kFunctions[] = {
+    {"load", session_store_Load},
+    {"save", session_store_Save},
+    {"touch", session_store_Touch},
+    {"abandon", session_store_Abandon},
+    {"new_id", session_store_NewId},
+    {"timeout", session_store_Timeout},
+    {"stats", session_store_Stats},
+    {NULL, NULL}
+  };
+
+  int stack = lua_gettop(L);
+
+  luaL_newlibtable(L, kFunctions);
+  lua_pushlightuserdata(L, store);
+  luaL_setfuncs(L, kFunctions, 1);
+
+  assert(stack + 1 == lua_gettop(L));
+  return 1;
+}
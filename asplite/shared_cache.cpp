@@ -0,0 +1,268 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/shared_cache.h"
+
+#include <functional>
+
+namespace {
+
+// Rough per entry cost of the map and list nodes, added to the key and
+// value sizes when the memory use is accounted.
+const size_t kEntryOverhead = 96;
+
+}  // namespace
+
+SharedCache::SharedCache() : memory_limit_(0), bytes_(0), evict_cursor_(0) {}
+
+bool SharedCache::Get(const char *key, size_t key_length, ArenaString *value) {
+  std::string name(key, key_length);
+  Stripe &stripe = GetStripe(name);
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+
+  Reap(&stripe);
+  EntryMap::iterator iter = Find(&stripe, name);
+  if (iter == stripe.entries.end() || iter->second.reserved) {
+    ++stripe.misses;
+    return false;
+  }
+
+  ++stripe.hits;
+  stripe.lru.splice(stripe.lru.begin(), stripe.lru, iter->second.lru);
+  value->assign(iter->second.value.data(), iter->second.value.length());
+  return true;
+}
+
+void SharedCache::Set(const char *key,
+                      size_t key_length,
+                      const char *value,
+                      size_t value_length,
+                      int ttl) {
+  std::string name(key, key_length);
+  Stripe &stripe = GetStripe(name);
+
+  {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    Reap(&stripe);
+    EntryMap::iterator iter = stripe.entries.find(name);
+    if (iter == stripe.entries.end()) {
+      iter = stripe.entries.insert(EntryMap::value_type(name, Entry())).first;
+    } else if (iter->second.reserved) {
+      iter->second.reserved = false;
+      stripe.reserved_released.notify_all();
+    } else {
+      bytes_ -= iter->second.size;
+      stripe.lru.erase(iter->second.lru);
+    }
+
+    Entry &entry = iter->second;
+    entry.value.assign(value, value_length);
+    entry.expires = ttl > 0 ? time(NULL) + ttl : 0;
+    entry.size = key_length + value_length + kEntryOverhead;
+    bytes_ += entry.size;
+    stripe.lru.push_front(&iter->first);
+    entry.lru = stripe.lru.begin();
+  }
+
+  Evict();
+}
+
+bool SharedCache::Remove(const char *key, size_t key_length) {
+  std::string name(key, key_length);
+  Stripe &stripe = GetStripe(name);
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+
+  EntryMap::iterator iter = Find(&stripe, name);
+  if (iter == stripe.entries.end() || iter->second.reserved)
+    return false;
+
+  RemoveEntry(&stripe, iter);
+  return true;
+}
+
+void SharedCache::Clear() {
+  for (size_t i = 0; i < kStripeCount; ++i) {
+    Stripe &stripe = stripes_[i];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    // Reserved entries stay, their owners are about to set them.
+    for (EntryMap::iterator iter = stripe.entries.begin();
+         iter != stripe.entries.end();) {
+      EntryMap::iterator next = iter;
+      ++next;
+      if (!iter->second.reserved)
+        RemoveEntry(&stripe, iter);
+      iter = next;
+    }
+  }
+}
+
+SharedCache::ReserveResult SharedCache::GetOrReserve(const char *key,
+                                                     size_t key_length,
+                                                     ArenaString *value) {
+  std::string name(key, key_length);
+  Stripe &stripe = GetStripe(name);
+  std::unique_lock<std::mutex> lock(stripe.mutex);
+
+  for (;;) {
+    EntryMap::iterator iter = Find(&stripe, name);
+    if (iter == stripe.entries.end()) {
+      ++stripe.misses;
+      Entry &entry = stripe.entries[name];
+      entry.reserved = true;
+      entry.owner = std::this_thread::get_id();
+      return kReserved;
+    }
+
+    if (!iter->second.reserved) {
+      ++stripe.hits;
+      stripe.lru.splice(stripe.lru.begin(), stripe.lru, iter->second.lru);
+      value->assign(iter->second.value.data(), iter->second.value.length());
+      return kFound;
+    }
+
+    if (iter->second.owner == std::this_thread::get_id())
+      return kRecursive;
+
+    if (!BeginWait(iter->second.owner))
+      return kDeadlock;
+    stripe.reserved_released.wait(lock);
+    EndWait();
+  }
+}
+
+void SharedCache::Release(const char *key, size_t key_length) {
+  std::string name(key, key_length);
+  Stripe &stripe = GetStripe(name);
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+
+  EntryMap::iterator iter = stripe.entries.find(name);
+  if (iter != stripe.entries.end() && iter->second.reserved &&
+      iter->second.owner == std::this_thread::get_id()) {
+    stripe.entries.erase(iter);
+    stripe.reserved_released.notify_all();
+  }
+}
+
+SharedCache::Statistics SharedCache::GetStatistics() {
+  Statistics statistics;
+
+  for (size_t i = 0; i < kStripeCount; ++i) {
+    Stripe &stripe = stripes_[i];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    statistics.hits += stripe.hits;
+    statistics.misses += stripe.misses;
+    statistics.evictions += stripe.evictions;
+    statistics.count += stripe.lru.size();
+  }
+
+  statistics.bytes = bytes_;
+  return statistics;
+}
+
+SharedCache::Stripe &SharedCache::GetStripe(const std::string &key) {
+  return stripes_[std::hash<std::string>()(key) % kStripeCount];
+}
+
+SharedCache::EntryMap::iterator SharedCache::Find(Stripe *stripe,
+                                                  const std::string &key) {
+  EntryMap::iterator iter = stripe->entries.find(key);
+  if (iter != stripe->entries.end() && iter->second.expires != 0 &&
+      iter->second.expires <= time(NULL)) {
+    RemoveEntry(stripe, iter);
+    return stripe->entries.end();
+  }
+
+  return iter;
+}
+
+void SharedCache::RemoveEntry(Stripe *stripe, EntryMap::iterator iter) {
+  if (!iter->second.reserved) {
+    bytes_ -= iter->second.size;
+    stripe->lru.erase(iter->second.lru);
+  }
+
+  stripe->entries.erase(iter);
+}
+
+void SharedCache::Reap(Stripe *stripe) {
+  time_t now = time(NULL);
+  if (now < stripe->next_reap)
+    return;
+
+  stripe->next_reap = now + kReapInterval;
+  for (EntryMap::iterator iter = stripe->entries.begin();
+       iter != stripe->entries.end();) {
+    EntryMap::iterator next = iter;
+    ++next;
+    if (!iter->second.reserved && iter->second.expires != 0 &&
+        iter->second.expires <= now)
+      RemoveEntry(stripe, iter);
+    iter = next;
+  }
+}
+
+void SharedCache::Evict() {
+  if (memory_limit_ == 0)
+    return;
+
+  // Gives up after a round over the stripes without an entry to evict,
+  // which leaves only reserved entries.
+  size_t idle = 0;
+  while (bytes_ > memory_limit_ && idle < kStripeCount) {
+    Stripe &stripe = stripes_[evict_cursor_++ % kStripeCount];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    if (stripe.lru.empty()) {
+      ++idle;
+      continue;
+    }
+
+    RemoveEntry(&stripe, stripe.entries.find(*stripe.lru.back()));
+    ++stripe.evictions;
+    idle = 0;
+  }
+}
+
+bool SharedCache::BeginWait(std::thread::id owner) {
+  std::thread::id self = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(waits_mutex_);
+
+  // The map never has a cycle, so the walk ends.
+  for (std::thread::id thread = owner;;) {
+    if (thread == self)
+      return false;
+    WaitMap::const_iterator iter = waits_.find(thread);
+    if (iter == waits_.end())
+      break;
+    thread = iter->second;
+  }
+
+  waits_[self] = owner;
+  return true;
+}
+
+void SharedCache::EndWait() {
+  std::lock_guard<std::mutex> lock(waits_mutex_);
+  waits_.erase(std::this_thread::get_id());
+}
@@ -0,0 +1,175 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef ASPLITE_SHARED_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+#define ASPLITE_SHARED_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "asplite/request_arena.h"
+
+// Process wide key/value store that outlives requests. It backs the
+// Application and Cache objects of pages. Values are opaque byte strings,
+// serialized Lua values in practice. Keys are spread over stripes with a
+// lock each, so that requests touching different keys rarely contend.
+// Entries may expire after a time to live, and the least recently used
+// entries of the stripes are evicted in turn when the memory used by all
+// entries exceeds the limit.
+class SharedCache {
+public:
+  struct Statistics {
+    Statistics() : hits(0), misses(0), evictions(0), count(0), bytes(0) {}
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;  // Entries dropped to stay within the memory limit
+    size_t count;
+    size_t bytes;  // Approximate memory used by the entries
+  };
+
+  enum ReserveResult {
+    kFound,      // The value is returned
+    kReserved,   // The caller must Set or Release the key
+    kRecursive,  // The key is already reserved by the calling thread
+    kDeadlock,   // The owner of the key waits on a key the caller reserved
+  };
+
+  SharedCache();
+
+  // Limits the memory used by the entries to roughly |bytes|.
+  // 0 means no limit. Must be set before the cache is used.
+  void set_memory_limit(size_t bytes) { memory_limit_ = bytes; }
+
+  bool Get(const char *key, size_t key_length, ArenaString *value);
+
+  // Stores |value| under |key|. The entry expires after |ttl| seconds,
+  // or never if |ttl| is not positive.
+  void Set(const char *key,
+           size_t key_length,
+           const char *value,
+           size_t value_length,
+           int ttl);
+
+  bool Remove(const char *key, size_t key_length);
+
+  void Clear();
+
+  // Returns the value of |key| if it is present. Otherwise reserves the
+  // key, so that other threads asking for it wait until the caller
+  // either stores the value with Set or gives up with Release. This way
+  // an expensive value is computed once rather than by every request
+  // that misses it at the same time. A caller holding a reservation may
+  // reserve other keys, but it does not wait for a key whose owner is
+  // itself waiting, directly or not, for a key the caller reserved.
+  ReserveResult GetOrReserve(const char *key,
+                             size_t key_length,
+                             ArenaString *value);
+
+  void Release(const char *key, size_t key_length);
+
+  Statistics GetStatistics();
+
+private:
+  // Keys of the entries in the order of use. The keys point into the
+  // entry map, whose nodes do not move.
+  typedef std::list<const std::string *> LruList;
+
+  struct Entry {
+    Entry() : expires(0), size(0), reserved(false) {}
+
+    std::string value;
+    time_t expires;  // 0 if the entry does not expire
+    size_t size;
+    LruList::iterator lru;  // Valid unless reserved
+
+    // A reserved entry has no value yet; |owner| is computing it.
+    bool reserved;
+    std::thread::id owner;
+  };
+
+  typedef std::unordered_map<std::string, Entry> EntryMap;
+
+  struct Stripe {
+    Stripe() : hits(0), misses(0), evictions(0), next_reap(0) {}
+
+    std::mutex mutex;
+    std::condition_variable reserved_released;
+    EntryMap entries;
+    LruList lru;  // Most recently used first
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    time_t next_reap;
+  };
+
+  // Threads waiting on a reserved key, mapped to the owner of the key.
+  typedef std::unordered_map<std::thread::id, std::thread::id> WaitMap;
+
+  static const size_t kStripeCount = 64;
+
+  // Expired entries that are not looked up again are removed from a
+  // stripe at most this often, in seconds.
+  static const time_t kReapInterval = 60;
+
+  SharedCache(const SharedCache &);
+  SharedCache &operator=(const SharedCache &);
+
+  Stripe &GetStripe(const std::string &key);
+
+  // Looks up a live entry. Expired entries are removed.
+  EntryMap::iterator Find(Stripe *stripe, const std::string &key);
+
+  void RemoveEntry(Stripe *stripe, EntryMap::iterator iter);
+
+  // Removes the expired entries of the stripe if it is time to.
+  void Reap(Stripe *stripe);
+
+  // Evicts the least recently used entry of one stripe after another
+  // until the entries fit into the memory limit. Called without locks.
+  void Evict();
+
+  // Records that the calling thread waits for a key reserved by |owner|.
+  // Returns false if |owner| already waits for the caller, directly or
+  // through other threads.
+  bool BeginWait(std::thread::id owner);
+  void EndWait();
+
+  size_t memory_limit_;
+  std::atomic<size_t> bytes_;
+  std::atomic<size_t> evict_cursor_;
+  Stripe stripes_[kStripeCount];
+
+  std::mutex waits_mutex_;
+  WaitMap waits_;
+};
+
+#endif  // ASPLITE_SHARED_CACHE_H_562542B9_D0D5_4362_9B23_E9E1CABF9903
@@ -0,0 +1,192 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "asplite/asplite.h"
+
+#include <assert.h>
+
+#include "lua/lua.hpp"
+#include "lua/lualib.h"
+#include "lua/lauxlib.h"
+
+#include "asplite/lua_serializer.h"
+#include "asplite/shared_cache.h"
+
+namespace {
+
+inline SharedCache *GetCache(lua_State *L) {
+  return reinterpret_cast<SharedCache *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+void PushValue(lua_State *L, const ArenaString &value) {
+  if (!DeserializeLuaValue(L, value.data(), value.length()))
+    lua_pushnil(L);
+}
+
+// serialize(buffer, value)
+// Serializes |value| into the ArenaString |buffer|. Called protected.
+int SerializeProtected(lua_State *L) {
+  ArenaString *out = reinterpret_cast<ArenaString *>(lua_touserdata(L, 1));
+  SerializeLuaValue(L, 2, out);
+  return 0;
+}
+
+// get(key)
+int shared_cache_Get(lua_State *L) {
+  size_t key_length;
+  const char *key = luaL_checklstring(L, 1, &key_length);
+
+  ArenaString value;
+  if (GetCache(L)->Get(key, key_length, &value))
+    PushValue(L, value);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// set(key, value [, ttl])
+// Removes the key if |value| is nil.
+int shared_cache_Set(lua_State *L) {
+  size_t key_length;
+  const char *key = luaL_checklstring(L, 1, &key_length);
+  int ttl = luaL_optint(L, 3, 0);
+
+  if (lua_isnil(L, 2)) {
+    GetCache(L)->Remove(key, key_length);
+    return 0;
+  }
+
+  ArenaString value;
+  SerializeLuaValue(L, 2, &value);
+  GetCache(L)->Set(key, key_length, value.data(), value.length(), ttl);
+  return 0;
+}
+
+// remove(key)
+int shared_cache_Remove(lua_State *L) {
+  size_t key_length;
+  const char *key = luaL_checklstring(L, 1, &key_length);
+  lua_pushboolean(L, GetCache(L)->Remove(key, key_length));
+  return 1;
+}
+
+// clear()
+int shared_cache_Clear(lua_State *L) {
+  GetCache(L)->Clear();
+  return 0;
+}
+
+// get_or_add(key, factory [, ttl])
+// Returns the value of |key|. If there is none, the value returned by
+// |factory| is stored and returned. Concurrent requests for the same key
+// wait for the first one instead of calling their factories.
+int shared_cache_GetOrAdd(lua_State *L) {
+  SharedCache *cache = GetCache(L);
+  size_t key_length;
+  const char *key = luaL_checklstring(L, 1, &key_length);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  int ttl = luaL_optint(L, 3, 0);
+
+  ArenaString value;
+  switch (cache->GetOrReserve(key, key_length, &value)) {
+    case SharedCache::kFound:
+      PushValue(L, value);
+      return 1;
+
+    case SharedCache::kRecursive:
+      return luaL_error(L, "GetOrAdd is called recursively for key %s", key);
+
+    case SharedCache::kDeadlock:
+      return luaL_error(L, "GetOrAdd for key %s would deadlock", key);
+
+    case SharedCache::kReserved:
+      break;
+  }
+
+  // The reservation must be released whatever happens, so the factory
+  // and the serialization are called protected.
+  lua_pushvalue(L, 2);
+  if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+    cache->Release(key, key_length);
+    return lua_error(L);
+  }
+
+  if (lua_isnil(L, -1)) {
+    cache->Release(key, key_length);
+    return 1;
+  }
+
+  lua_pushcfunction(L, SerializeProtected);
+  lua_pushlightuserdata(L, &value);
+  lua_pushvalue(L, -3);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+    cache->Release(key, key_length);
+    return lua_error(L);
+  }
+
+  cache->Set(key, key_length, value.data(), value.length(), ttl);
+  return 1;
+}
+
+// stats()
+// Returns a table with hits, misses, evictions, count and bytes fields.
+int shared_cache_Stats(lua_State *L) {
+  SharedCache::Statistics statistics = GetCache(L)->GetStatistics();
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)statistics.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)statistics.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)statistics.evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, (lua_Number)statistics.count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, (lua_Number)statistics.bytes);
+  lua_setfield(L, -2, "bytes");
+  return 1;
+}
+
+}  // namespace
+
+// Pushes a table of functions operating on |cache|, which are wrapped by
+// asplite.CreateCacheObject.
+int CreateSharedCacheTable(lua_State *L, SharedCache *cache) {
+  static const luaL_Reg kFunctions[] = {
+    {"get", shared_cache_Get},
+    {"set", shared_cache_Set},
+    {"remove", shared_cache_Remove},
+    {"clear", shared_cache_Clear},
+    {"get_or_add", shared_cache_GetOrAdd},
+    {"stats", shared_cache_Stats},
+    {NULL, NULL}
+  };
+
+  int stack = lua_gettop(L);
+
+  luaL_newlibtable(L, kFunctions);
+  lua_pushlightuserdata(L, cache);
+  luaL_setfuncs(L, kFunctions, 1);
+
+  assert(stack + 1 == lua_gettop(L));
+  return 1;
+}
@@ -636,7 +636,8 @@ static void f_parser (lua_State *L, void *ud) {
   int c = zgetc(p->z);  /* read first character */
   if (c == LUA_SIGNATURE[0]) {
     checkmode(L, p->mode, "binary");
-    cl = luaU_undump(L, p->z, &p->buff, p->name);
+    cl = luaU_undump(L, p->z, &p->buff, p->name,
+                     p->mode != NULL && strchr(p->mode, 's') != NULL);
   }
   else {
     checkmode(L, p->mode, "text");
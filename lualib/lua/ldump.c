@@ -21,6 +21,7 @@ typedef struct {
  void* data;
  int strip;
  int status;
+ size_t offset;				/* bytes dumped so far */
 } DumpState;
 
 #define DumpMem(b,n,size,D)	DumpBlock(b,(n)*(size),D)
@@ -34,6 +35,14 @@ static void DumpBlock(const void* b, size_t size, DumpState* D)
   D->status=(*D->writer)(D->L,b,size,D->data);
   lua_lock(D->L);
  }
+ D->offset+=size;
+}
+
+static void DumpAlign(size_t align, DumpState* D)
+{
+ static const char padding[8]={0};
+ size_t n=(align-D->offset%align)%align;
+ if ((D->strip & LUA_DUMPALIGN) && n>0) DumpBlock(padding,n,D);
 }
 
 static void DumpChar(int y, DumpState* D)
@@ -55,6 +64,7 @@ static void DumpNumber(lua_Number x, DumpState* D)
 static void DumpVector(const void* b, int n, size_t size, DumpState* D)
 {
  DumpInt(n,D);
+ DumpAlign(size,D);
  DumpMem(b,n,size,D);
 }
 
@@ -120,10 +130,10 @@ static void DumpUpvalues(const Proto* f, DumpState* D)
 static void DumpDebug(const Proto* f, DumpState* D)
 {
  int i,n;
- DumpString((D->strip) ? NULL : f->source,D);
- n= (D->strip) ? 0 : f->sizelineinfo;
+ DumpString((D->strip & LUA_STRIPSOURCE) ? NULL : f->source,D);
+ n= (D->strip & LUA_STRIPLINES) ? 0 : f->sizelineinfo;
  DumpVector(f->lineinfo,n,sizeof(int),D);
- n= (D->strip) ? 0 : f->sizelocvars;
+ n= (D->strip & LUA_STRIPNAMES) ? 0 : f->sizelocvars;
  DumpInt(n,D);
  for (i=0; i<n; i++)
  {
@@ -131,7 +141,7 @@ static void DumpDebug(const Proto* f, DumpState* D)
   DumpInt(f->locvars[i].startpc,D);
   DumpInt(f->locvars[i].endpc,D);
  }
- n= (D->strip) ? 0 : f->sizeupvalues;
+ n= (D->strip & LUA_STRIPNAMES) ? 0 : f->sizeupvalues;
  DumpInt(n,D);
  for (i=0; i<n; i++) DumpString(f->upvalues[i].name,D);
 }
@@ -153,6 +163,7 @@ static void DumpHeader(DumpState* D)
 {
  lu_byte h[LUAC_HEADERSIZE];
  luaU_header(h);
+ if (D->strip & LUA_DUMPALIGN) h[LUAC_FORMATINDEX]=LUAC_FORMATALIGNED;
  DumpBlock(h,LUAC_HEADERSIZE,D);
 }
 
@@ -167,6 +178,7 @@ int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip
  D.data=data;
  D.strip=strip;
  D.status=0;
+ D.offset=0;
  DumpHeader(&D);
  DumpFunction(f,&D);
  return D.status;
@@ -486,8 +486,13 @@ typedef struct Proto {
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* maximum stack used by this function */
+  lu_byte inplace;  /* arrays in a chunk image loaded in place */
 } Proto;
 
+/* bits of Proto.inplace; such arrays are not owned by the state */
+#define PROTO_CODEINPLACE	1
+#define PROTO_LINEINFOINPLACE	2
+
 
 
 /*
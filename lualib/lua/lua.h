@@ -264,6 +264,23 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 
+/* debug information lua_dumpx can leave out */
+#define LUA_STRIPSOURCE	1	/* source names, the chunk name is used on load */
+#define LUA_STRIPLINES	2	/* line information */
+#define LUA_STRIPNAMES	4	/* names of locals and upvalues */
+#define LUA_STRIPALL	(LUA_STRIPSOURCE | LUA_STRIPLINES | LUA_STRIPNAMES)
+
+/*
+** lua_dumpx flag to align code and line information in the chunk. Such
+** chunks can be loaded with mode "bs" if their image stays unchanged and
+** in memory while the state lives: functions then refer to these arrays
+** in the image instead of copies. The state neither frees nor counts them.
+*/
+#define LUA_DUMPALIGN	8
+
+LUA_API int (lua_dumpx) (lua_State *L, lua_Writer writer, void *data,
+                                       int strip);
+
 
 /*
 ** coroutine functions
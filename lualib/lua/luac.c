@@ -95,7 +95,7 @@ static int doargs(int argc, char* argv[])
   else if (IS("-p"))			/* parse only */
    dumping=0;
   else if (IS("-s"))			/* strip debug information */
-   stripping=1;
+   stripping=LUA_STRIPALL;
   else if (IS("-v"))			/* show version */
    ++version;
   else					/* unknown option */
@@ -16,6 +16,7 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lstate.h"
 #include "lstring.h"
 #include "lundump.h"
 #include "lzio.h"
@@ -25,6 +26,10 @@ typedef struct {
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ const char* source;			/* for functions dumped without source */
+ size_t offset;				/* bytes loaded so far */
+ int aligned;				/* chunk dumped with LUA_DUMPALIGN */
+ int inplace;				/* arrays may stay in the image */
 } LoadState;
 
 static l_noret error(LoadState* S, const char* why)
@@ -44,7 +49,39 @@ static l_noret error(LoadState* S, const char* why)
 
 static void LoadBlock(LoadState* S, void* b, size_t size)
 {
- if (luaZ_read(S->Z,b,size)!=0) error(S,"truncated");
+ ZIO* z=S->Z;
+ if (size<=z->n && size!=0)		/* fast path: block is in the buffer */
+ {
+  memcpy(b,z->p,size);
+  z->p+=size;
+  z->n-=size;
+ }
+ else if (luaZ_read(z,b,size)!=0) error(S,"truncated");
+ S->offset+=size;
+}
+
+static void LoadAlign(LoadState* S, size_t align)
+{
+ char padding[8];
+ size_t n=(align-S->offset%align)%align;
+ if (S->aligned && n>0) LoadBlock(S,padding,n);
+}
+
+/*
+** return the vector of n items at the current position if it can stay in
+** the image, i.e. when loading in place and the vector is in the buffer
+** and aligned; NULL if it has to be copied
+*/
+static void* LoadInPlace(LoadState* S, int n, size_t size)
+{
+ ZIO* z=S->Z;
+ const char* p=z->p;
+ size_t total=n*size;
+ if (!S->inplace || n==0 || total>z->n || (size_t)p%size!=0) return NULL;
+ z->p+=total;
+ z->n-=total;
+ S->offset+=total;
+ return cast(void*,p);
 }
 
 static int LoadChar(LoadState* S)
@@ -75,6 +112,15 @@ static TString* LoadString(LoadState* S)
  LoadVar(S,size);
  if (size==0)
   return NULL;
+ else if (size<=S->Z->n)		/* make the string right from the buffer */
+ {
+  ZIO* z=S->Z;
+  TString* ts=luaS_newlstr(S->L,z->p,size-1);	/* remove trailing '\0' */
+  z->p+=size;
+  z->n-=size;
+  S->offset+=size;
+  return ts;
+ }
  else
  {
   char* s=luaZ_openspace(S->L,S->b,size);
@@ -86,9 +132,19 @@ static TString* LoadString(LoadState* S)
 static void LoadCode(LoadState* S, Proto* f)
 {
  int n=LoadInt(S);
- f->code=luaM_newvector(S->L,n,Instruction);
- f->sizecode=n;
- LoadVector(S,f->code,n,sizeof(Instruction));
+ LoadAlign(S,sizeof(Instruction));
+ f->code=cast(Instruction*,LoadInPlace(S,n,sizeof(Instruction)));
+ if (f->code!=NULL)
+ {
+  f->inplace|=PROTO_CODEINPLACE;
+  f->sizecode=n;
+ }
+ else
+ {
+  f->code=luaM_newvector(S->L,n,Instruction);
+  f->sizecode=n;
+  LoadVector(S,f->code,n,sizeof(Instruction));
+ }
 }
 
 static void LoadFunction(LoadState* S, Proto* f);
@@ -150,10 +206,21 @@ static void LoadDebug(LoadState* S, Proto* f)
 {
  int i,n;
  f->source=LoadString(S);
+ if (f->source==NULL) f->source=luaS_new(S->L,S->source);
  n=LoadInt(S);
- f->lineinfo=luaM_newvector(S->L,n,int);
- f->sizelineinfo=n;
- LoadVector(S,f->lineinfo,n,sizeof(int));
+ LoadAlign(S,sizeof(int));
+ f->lineinfo=cast(int*,LoadInPlace(S,n,sizeof(int)));
+ if (f->lineinfo!=NULL)
+ {
+  f->inplace|=PROTO_LINEINFOINPLACE;
+  f->sizelineinfo=n;
+ }
+ else
+ {
+  f->lineinfo=luaM_newvector(S->L,n,int);
+  f->sizelineinfo=n;
+  LoadVector(S,f->lineinfo,n,sizeof(int));
+ }
  n=LoadInt(S);
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
@@ -194,16 +261,36 @@ static void LoadHeader(LoadState* S)
  luaU_header(h);
  memcpy(s,h,sizeof(char));			/* first char already read */
  LoadBlock(S,s+sizeof(char),LUAC_HEADERSIZE-sizeof(char));
+ if (s[LUAC_FORMATINDEX]==LUAC_FORMATALIGNED)
+ {
+  S->aligned=1;
+  h[LUAC_FORMATINDEX]=LUAC_FORMATALIGNED;
+ }
  if (memcmp(h,s,N0)==0) return;
  if (memcmp(h,s,N1)!=0) error(S,"not a");
  if (memcmp(h,s,N2)!=0) error(S,"version mismatch in");
  if (memcmp(h,s,N3)!=0) error(S,"incompatible"); else error(S,"corrupted");
 }
 
+/*
+** make room in the string table for the strings of the part of the chunk
+** already in the buffer, so that the table is not grown step by step
+*/
+#define BYTES_PER_STRING	64
+
+static void ReserveStrings(LoadState* S)
+{
+ stringtable* tb=&G(S->L)->strt;
+ size_t n=tb->nuse+S->Z->n/BYTES_PER_STRING;
+ int size=tb->size;
+ while ((size_t)size<n && size<=MAX_INT/2) size*=2;
+ if (size>tb->size) luaS_resize(S->L,size);
+}
+
 /*
 ** load precompiled chunk
 */
-Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
+Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, int inplace)
 {
  LoadState S;
  Closure* cl;
@@ -213,10 +300,15 @@ Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
   S.name="binary string";
  else
   S.name=name;
+ S.source=name;
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ S.offset=sizeof(char);			/* first char already read */
+ S.aligned=0;
+ S.inplace=inplace;
  LoadHeader(&S);
+ ReserveStrings(&S);
  cl=luaF_newLclosure(L,1);
  setclLvalue(L,L->top,cl); incr_top(L);
  cl->l.p=luaF_newproto(L);
@@ -10,8 +10,8 @@
 #include "lobject.h"
 #include "lzio.h"
 
-/* load one chunk; from lundump.c */
-LUAI_FUNC Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name);
+/* load one chunk, in place if possible; from lundump.c */
+LUAI_FUNC Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, int inplace);
 
 /* make header; from lundump.c */
 LUAI_FUNC void luaU_header (lu_byte* h);
@@ -22,6 +22,10 @@ LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data,
 /* data to catch conversion errors */
 #define LUAC_TAIL		"\x19\x93\r\n\x1a\n"
 
+/* format byte in the header and its value for chunks with LUA_DUMPALIGN */
+#define LUAC_FORMATINDEX	(sizeof(LUA_SIGNATURE)-sizeof(char)+1)
+#define LUAC_FORMATALIGNED	1
+
 /* size in bytes of header of binary files */
 #define LUAC_HEADERSIZE		(sizeof(LUA_SIGNATURE)-sizeof(char)+2+6+sizeof(LUAC_TAIL)-sizeof(char))
 
@@ -0,0 +1,192 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2013 Alex Kozlov
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom
+// the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Compares membuf with the implementation it replaced, which grew buffers
+// to the exact size needed and allocated every block from the heap:
+//    append     many small fragments, like generated page code
+//    grow       a few large chunks, like a file read in pieces
+//    segmented  small fragments into a segmented buffer, as code
+//               declarations are collected
+// Usage: membuf_bench [repeat]
+// Outside of Visual Studio it builds with
+//    g++ -O2 -I.. main.cpp ../asplite/membuf.cpp -o membuf_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "asplite/membuf.h"
+
+namespace {
+
+// The previous implementation. File backing is left out, the benchmark
+// does not use it.
+struct membuf *OldCreate(size_t capacity) {
+  struct membuf *buf = (struct membuf *)malloc(sizeof(struct membuf));
+  memset(buf, 0, sizeof(struct membuf));
+  buf->fd = -1;
+  buf->ptr = malloc(capacity);
+  memset(buf->ptr, 0, capacity);
+  buf->capacity = capacity;
+  return buf;
+}
+
+int OldEnsure(struct membuf *buf, size_t new_size) {
+  void *p = realloc(buf->ptr, new_size);
+  if (p == NULL)
+    return 1;
+
+  buf->ptr = p;
+  buf->capacity = new_size;
+  return 0;
+}
+
+int OldEnsureExtra(struct membuf *buf, size_t size) {
+  if (buf->capacity - buf->size < size)
+    return OldEnsure(buf, buf->size + size);
+  return 0;
+}
+
+int OldAppend(struct membuf *buf, const void *data, size_t length) {
+  int result = OldEnsureExtra(buf, length);
+  if (result)
+    return result;
+
+  memmove(((char *)buf->ptr) + buf->size, data, length);
+  buf->size += length;
+  return 0;
+}
+
+void OldClose(struct membuf *buf) {
+  free(buf->ptr);
+  free(buf);
+}
+
+const char kFragment[] = "Response.Write(";
+const size_t kFragmentLength = sizeof(kFragment) - 1;
+const size_t kFragmentCount = 100000;
+
+const int kRounds = 5;
+
+const size_t kChunkSize = 64 * 1024;
+const size_t kChunkCount = 16;
+
+char chunk[kChunkSize];
+
+// Keeps the compiler from dropping the work.
+size_t total_size = 0;
+
+void BaselineAppend() {
+  struct membuf *buf = OldCreate(0);
+  for (size_t i = 0; i < kFragmentCount; i++)
+    OldAppend(buf, kFragment, kFragmentLength);
+  total_size += membuf_size(buf);
+  OldClose(buf);
+}
+
+void CurrentAppend() {
+  struct membuf *buf = membuf_create(0, -1, 0, 0);
+  for (size_t i = 0; i < kFragmentCount; i++)
+    membuf_append(buf, kFragment, kFragmentLength);
+  total_size += membuf_size(buf);
+  membuf_close(buf);
+}
+
+void BaselineGrow() {
+  struct membuf *buf = OldCreate(0);
+  for (size_t i = 0; i < kChunkCount; i++) {
+    OldEnsureExtra(buf, kChunkSize);
+    memcpy(membuf_ptr(buf), chunk, kChunkSize);
+    buf->size += kChunkSize;
+  }
+  total_size += membuf_size(buf);
+  OldClose(buf);
+}
+
+void CurrentGrow() {
+  struct membuf *buf = membuf_create(0, -1, 0, 0);
+  for (size_t i = 0; i < kChunkCount; i++) {
+    membuf_ensure_extra(buf, kChunkSize);
+    memcpy(membuf_ptr(buf), chunk, kChunkSize);
+    buf->size += kChunkSize;
+  }
+  total_size += membuf_size(buf);
+  membuf_close(buf);
+}
+
+void CurrentSegmented() {
+  struct membuf *buf = membuf_create_segmented(4096);
+  for (size_t i = 0; i < kFragmentCount; i++)
+    membuf_append(buf, kFragment, kFragmentLength);
+  total_size += membuf_size(buf);
+  membuf_close(buf);
+}
+
+// Returns the milliseconds |repeat| calls of |run| take, the best of a few
+// rounds to keep other load out.
+double Measure(void (*run)(), int repeat) {
+  double best = 0;
+
+  for (int round = 0; round < kRounds; round++) {
+    clock_t start = clock();
+    for (int i = 0; i < repeat; i++)
+      run();
+
+    double time = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    if (round == 0 || time < best)
+      best = time;
+  }
+
+  return best;
+}
+
+void Report(const char *name,
+            void (*baseline_run)(),
+            void (*current_run)(),
+            int repeat) {
+  double baseline_time = Measure(baseline_run, repeat);
+  double current_time = Measure(current_run, repeat);
+  printf("%-10s %10.1f ms %10.1f ms %8.2fx\n",
+         name,
+         baseline_time,
+         current_time,
+         current_time > 0 ? baseline_time / current_time : 0.0);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int repeat = argc > 1 ? atoi(argv[1]) : 200;
+  if (repeat <= 0)
+    repeat = 200;
+
+  memset(chunk, 'x', sizeof(chunk));
+
+  printf("%-10s %13s %13s %9s\n", "", "baseline", "current", "speedup");
+  Report("append", BaselineAppend, CurrentAppend, repeat);
+  Report("grow", BaselineGrow, CurrentGrow, repeat);
+  Report("segmented", BaselineAppend, CurrentSegmented, repeat);
+
+  membuf_release_thread_cache();
+  return total_size == 0;
+}
@@ -390,9 +390,18 @@ static void start_mongoose(int argc, char *argv[]) {
   asplite_config.cache_luac = false;
   asplite_config.cache_directory = "cache";
   asplite_config.upload_directory = "upload";
+  asplite_config.cache_memory_limit = 64 * 1024 * 1024;
+  asplite_config.output_cache_memory_limit = 64 * 1024 * 1024;
+  asplite_config.session_timeout = 20;
+  asplite_config.session_memory_limit = 256 * 1024 * 1024;
+  asplite_config.minify_content = false;
+  asplite_config.strip_luac = false;
+  asplite_config.luac_pack = false;
+  asplite_config.trace_memory = false;
 
   asplite.Init(asplite_config);
   callbacks.begin_request = asplite.RequestHandler;
+  callbacks.worker_thread_stop = asplite.WorkerThreadStop;
   ctx = mg_start(&callbacks, &asplite, (const char **) options);
   for (i = 0; options[i] != NULL; i++) {
     free(options[i]);
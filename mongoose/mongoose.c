@@ -130,6 +130,8 @@ typedef long off_t;
 #define snprintf _snprintf
 #define vsnprintf _vsnprintf
 #define mg_sleep(x) Sleep(x)
+#define mg_atomic_cas(p, o, n) (InterlockedCompareExchange((p), (n), (o)) == (o))
+#define mg_memory_barrier() MemoryBarrier()
 
 #define pipe(x) _pipe(x, MG_BUF_LEN, _O_BINARY)
 #ifndef popen
@@ -203,11 +205,13 @@ struct pollfd {
 // Mark required libraries
 #ifdef _MSC_VER
 #pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Mswsock.lib")
 #endif
 
 #else    // UNIX  specific
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -223,6 +227,9 @@ struct pollfd {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -241,6 +248,8 @@ struct pollfd {
 #define mg_mkdir(x, y) mkdir(x, y)
 #define mg_remove(x) remove(x)
 #define mg_sleep(x) usleep((x) * 1000)
+#define mg_atomic_cas(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define mg_memory_barrier() __sync_synchronize()
 #define ERRNO errno
 #define INVALID_SOCKET (-1)
 #define INT64_FMT PRId64
@@ -1510,6 +1519,66 @@ static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
   return sent;
 }
 
+// Maximum number of buffers passed to a single gathering send.
+#define MG_IOV_MAX 16
+
+// Write a list of buffers to the socket, gathering them into one send()
+// where possible. Return number of bytes written.
+static int64_t push_vec(SOCKET sock, const struct mg_iovec *iov, int iovcnt) {
+  int64_t sent;
+  size_t offset;  // Number of bytes of iov[0] that are already sent
+  int i, count;
+
+  sent = 0;
+  offset = 0;
+  while (iovcnt > 0) {
+#if defined(_WIN32)
+    WSABUF vec[MG_IOV_MAX];
+    DWORD n;
+#else
+    struct iovec vec[MG_IOV_MAX];
+    struct msghdr msg;
+    ssize_t n;
+#endif // _WIN32
+
+    count = iovcnt > MG_IOV_MAX ? MG_IOV_MAX : iovcnt;
+    for (i = 0; i < count; i++) {
+      size_t skip = i == 0 ? offset : 0;
+#if defined(_WIN32)
+      vec[i].buf = (char *) iov[i].buf + skip;
+      vec[i].len = (ULONG) (iov[i].len - skip);
+#else
+      vec[i].iov_base = (char *) iov[i].buf + skip;
+      vec[i].iov_len = iov[i].len - skip;
+#endif // _WIN32
+    }
+
+#if defined(_WIN32)
+    if (WSASend(sock, vec, (DWORD) count, &n, 0, NULL, NULL) != 0 || n == 0)
+      break;
+#else
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+    if ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) <= 0)
+      break;
+#endif // _WIN32
+
+    sent += n;
+
+    // Skip the buffers that have been sent completely
+    while (iovcnt > 0 && (size_t) n >= iov[0].len - offset) {
+      n -= (int) (iov[0].len - offset);
+      offset = 0;
+      iov++;
+      iovcnt--;
+    }
+    offset += n;
+  }
+
+  return sent;
+}
+
 // Read from IO channel - opened file descriptor, socket, or SSL descriptor.
 // Return negative value on error, or number of bytes read on success.
 static int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
@@ -1628,6 +1697,48 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   return (int) total;
 }
 
+int mg_writev(struct mg_connection *conn, const struct mg_iovec *iov,
+              int iovcnt) {
+  int64_t total;
+  int i, n;
+
+  // Throttled and SSL connections cannot gather, send buffers one by one.
+  if (conn->throttle > 0 || conn->ssl != NULL) {
+    total = 0;
+    for (i = 0; i < iovcnt; i++) {
+      if (iov[i].len == 0) {
+        continue;
+      }
+      if ((n = mg_write(conn, iov[i].buf, iov[i].len)) <= 0) {
+        return total > 0 ? (int) total : n;
+      }
+      total += n;
+      if ((size_t) n < iov[i].len) {
+        break;
+      }
+    }
+  } else {
+    total = push_vec(conn->client.sock, iov, iovcnt);
+  }
+  return (int) total;
+}
+
+int mg_begin_reply(struct mg_connection *conn, int status_code,
+                   int can_keep_alive) {
+  conn->status_code = status_code;
+  // Whatever is left of the request body would be taken for the next
+  // request on the connection.
+  if (!can_keep_alive || conn->content_len < 0 ||
+      conn->consumed_content < conn->content_len) {
+    conn->must_close = 1;
+  }
+  return should_keep_alive(conn);
+}
+
+void mg_add_bytes_sent(struct mg_connection *conn, size_t num_bytes) {
+  conn->num_bytes_sent += num_bytes;
+}
+
 // Alternative alloc_vprintf() for non-compliant C runtimes
 static int alloc_vprintf2(char **buf, const char *fmt, va_list ap) {
   va_list ap_copy;
@@ -2887,7 +2998,7 @@ static void send_file_data(struct mg_connection *conn, struct file *filep,
     if (len > filep->size - offset) {
       len = filep->size - offset;
     }
-    mg_write(conn, filep->membuf + offset, (size_t) len);
+    conn->num_bytes_sent += mg_write(conn, filep->membuf + offset, (size_t) len);
   } else if (len > 0 && filep->fp != NULL) {
     fseeko(filep->fp, offset, SEEK_SET);
     while (len > 0) {
@@ -2922,6 +3033,40 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
   strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
 }
 
+// Date string for the current second, shared by all worker threads.
+// An odd sequence number means that an update is in progress. Readers
+// that see the sequence change while copying format the date themselves.
+static struct {
+  volatile long seq;
+  time_t time;
+  char str[64];
+} cached_date;
+
+static void current_gmt_time_string(char *buf, size_t buf_len) {
+  time_t curtime = time(NULL);
+  long seq = cached_date.seq;
+
+  mg_memory_barrier();
+  if ((seq & 1) == 0 && cached_date.time == curtime) {
+    mg_strlcpy(buf, cached_date.str, buf_len);
+    mg_memory_barrier();
+    if (cached_date.seq == seq) {
+      return;
+    }
+  }
+
+  gmt_time_string(buf, buf_len, &curtime);
+
+  // Publish the new string, unless another thread is doing that already
+  if ((seq & 1) == 0 && buf_len >= sizeof(cached_date.str) &&
+      mg_atomic_cas(&cached_date.seq, seq, seq + 1)) {
+    cached_date.time = curtime;
+    mg_strlcpy(cached_date.str, buf, sizeof(cached_date.str));
+    mg_memory_barrier();
+    cached_date.seq = seq + 2;
+  }
+}
+
 static void construct_etag(char *buf, size_t buf_len,
                            const struct file *filep) {
   snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
@@ -2936,11 +3081,92 @@ static void fclose_on_exec(struct file *filep) {
   }
 }
 
+// Like send_file_data(), but lets the kernel copy the data from the file
+// to the socket where possible.
+static void transmit_file_data(struct mg_connection *conn, struct file *filep,
+                               int64_t offset, int64_t len) {
+  if (filep->fp == NULL || conn->ssl != NULL || conn->throttle > 0) {
+    send_file_data(conn, filep, offset, len);
+    return;
+  }
+
+  offset = offset < 0 ? 0 : offset > filep->size ? filep->size : offset;
+  if (len > filep->size - offset) {
+    len = filep->size - offset;
+  }
+
+#if defined(__linux__)
+  {
+    off_t off = (off_t) offset;
+    ssize_t n;
+
+    while (len > 0) {
+      n = sendfile(conn->client.sock, fileno(filep->fp), &off,
+                   len > INT_MAX ? INT_MAX : (size_t) len);
+      if (n <= 0) {
+        break;
+      }
+      conn->num_bytes_sent += n;
+      len -= n;
+    }
+  }
+#elif defined(_WIN32) && !defined(_WIN32_WCE)
+  {
+    HANDLE handle = (HANDLE) _get_osfhandle(fileno(filep->fp));
+    LARGE_INTEGER position;
+    DWORD n;
+
+    while (len > 0) {
+      n = len > INT_MAX ? INT_MAX : (DWORD) len;
+      position.QuadPart = offset;
+      if (!SetFilePointerEx(handle, position, NULL, FILE_BEGIN) ||
+          !TransmitFile(conn->client.sock, handle, n, 0, NULL, NULL, 0)) {
+        break;
+      }
+      conn->num_bytes_sent += n;
+      offset += n;
+      len -= n;
+    }
+  }
+#else
+  send_file_data(conn, filep, offset, len);
+#endif
+}
+
+long long mg_send_file_range(struct mg_connection *conn, const char *path,
+                             long long offset, long long len) {
+  struct file file = STRUCT_FILE_INITIALIZER;
+  int64_t num_bytes_sent = conn->num_bytes_sent;
+
+  if (!mg_stat(conn, path, &file) || file.is_directory ||
+      !mg_fopen(conn, path, "rb", &file)) {
+    conn->must_close = 1;
+    return -1;
+  }
+  fclose_on_exec(&file);
+
+  if (offset < 0 || offset > file.size) {
+    offset = file.size;
+  }
+  if (len < 0 || len > file.size - offset) {
+    len = file.size - offset;
+  }
+
+  transmit_file_data(conn, &file, offset, len);
+  mg_fclose(&file);
+
+  // The reply is broken if the file could not be sent completely
+  num_bytes_sent = conn->num_bytes_sent - num_bytes_sent;
+  if (num_bytes_sent < len) {
+    conn->must_close = 1;
+  }
+  return num_bytes_sent;
+}
+
 static void handle_file_request(struct mg_connection *conn, const char *path,
                                 struct file *filep) {
   char date[64], lm[64], etag[64], range[64];
   const char *msg = "OK", *hdr;
-  time_t curtime = time(NULL);
   int64_t cl, r1, r2;
   struct vec mime_vec;
   int n;
@@ -2992,7 +3218,7 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
 
   // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
   // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
-  gmt_time_string(date, sizeof(date), &curtime);
+  current_gmt_time_string(date, sizeof(date));
   gmt_time_string(lm, sizeof(lm), &filep->modification_time);
   construct_etag(etag, sizeof(etag), filep);
 
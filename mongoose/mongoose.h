@@ -216,6 +216,32 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Buffer descriptor for mg_writev().
+struct mg_iovec {
+  const void *buf;
+  size_t len;
+};
+
+
+// Send several buffers to the client, gathering them into as few
+// system calls as possible. Return value is the same as for mg_write().
+int mg_writev(struct mg_connection *, const struct mg_iovec *iov, int iovcnt);
+
+
+// Tell mongoose about a reply that a begin_request() handler writes itself.
+// |status_code| is logged and taken into account for keep-alive. Pass 0 in
+// |can_keep_alive| if the end of the reply is marked by closing the
+// connection. The connection is closed as well if the request body has
+// not been read completely. Return 1 if the connection is kept alive after
+// the reply, in which case the reply must be delimited by Content-Length
+// or chunked encoding, 0 otherwise.
+int mg_begin_reply(struct mg_connection *, int status_code, int can_keep_alive);
+
+
+// Add |num_bytes| to the number of bytes sent, as reported in the access log.
+void mg_add_bytes_sent(struct mg_connection *, size_t num_bytes);
+
+
 // Send data to a websocket client wrapped in a websocket frame.
 // It is unsafe to read/write to this connection from another thread.
 // This function is available when mongoose is compiled with -DUSE_WEBSOCKET
@@ -268,6 +294,18 @@ int mg_printf(struct mg_connection *,
 void mg_send_file(struct mg_connection *conn, const char *path);
 
 
+// Send |len| bytes of the file |path| starting at |offset|, without any
+// headers. If |len| is negative, the rest of the file is sent. Uses
+// sendfile() or TransmitFile() where possible, so the data does not pass
+// through user space. The connection is closed after the reply unless all
+// |len| bytes are sent, as the body length has already been announced.
+// Return:
+//  -1  if the file cannot be opened
+//  >=0 number of bytes sent
+long long mg_send_file_range(struct mg_connection *conn, const char *path,
+                             long long offset, long long len);
+
+
 // Read data from the remote end, return number of bytes read.
 // Return:
 //   0     connection has been closed by peer. No more data could be read.